@@ -0,0 +1,154 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# MiniVSFS benchmark suite: times the tools across image sizes, file sizes,
+# file counts and fill levels, runs the microbenchmarks, and writes one JSON
+# document (to $BENCH_JSON, default stdout). Each timing is the best of
+# $BENCH_REPS runs (default 3).
+ROOT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+OUT="${BENCH_JSON:-/dev/stdout}"
+[[ "$OUT" == /* ]] || OUT="$PWD/$OUT"
+cd "$ROOT_DIR"
+
+BUILDER="$ROOT_DIR/mkfs_builder"
+ADDER="$ROOT_DIR/mkfs_adder"
+BITMAP_BENCH="$ROOT_DIR/bitmap_bench"
+CRC32_BENCH="$ROOT_DIR/crc32_bench"
+REPS="${BENCH_REPS:-3}"
+
+for bin in "$BUILDER" "$ADDER" "$BITMAP_BENCH" "$CRC32_BENCH"; do
+  if [[ ! -x "$bin" ]]; then
+    echo "[bench] $bin not found. Run: make build bitmap_bench crc32_bench" >&2
+    exit 1
+  fi
+done
+
+# Work in a scratch directory; images are sparse, files are random
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR"
+
+log() {
+  echo "[bench] $*" >&2
+}
+
+# Best wall time in seconds over $REPS runs of "$@"; $PREP (if set) runs untimed before each
+best_of() {
+  local best=0 start end ns
+  for ((r = 0; r < REPS; r++)); do
+    [[ -n "${PREP:-}" ]] && eval "$PREP"
+    start=$(date +%s%N)
+    "$@" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    if ((best == 0 || ns < best)); then
+      best=$ns
+    fi
+  done
+  awk -v ns="$best" 'BEGIN { printf "%.6f", ns / 1e9 }'
+}
+
+# MB/s for bytes moved in seconds
+rate() {
+  awk -v b="$1" -v s="$2" 'BEGIN { printf "%.1f", (s > 0 ? b / s / 1e6 : 0) }'
+}
+
+# Comma-separating the entries of a JSON array as they are appended
+sep() {
+  if [[ -n "${first:-}" ]]; then
+    first=""
+  else
+    printf ', '
+  fi
+}
+
+# Making a manifest of count files of size bytes under dir
+make_files() {
+  local dir=$1 count=$2 size=$3
+  mkdir -p "$dir"
+  for ((i = 0; i < count; i++)); do
+    head -c "$size" /dev/urandom > "$dir/f$i"
+  done
+  find "$dir" -type f > "$dir.list"
+}
+
+builder_cases() {
+  # size_kib inodes
+  printf '%s\n' "1024 128" "65536 4096" "1048576 65536" "16777216 1048576"
+}
+
+json_builder() {
+  first=1
+  printf '['
+  while read -r kib inodes; do
+    log "mkfs_builder $kib KiB, $inodes inodes"
+    PREP='rm -f b.img'
+    local t
+    t=$(best_of "$BUILDER" --image b.img --size-kib "$kib" --inodes "$inodes")
+    sep
+    printf '{"size_kib": %s, "inodes": %s, "seconds": %s}' "$kib" "$inodes" "$t"
+  done < <(builder_cases)
+  printf ']'
+}
+
+# One in-place add of the files in dir.list onto a copy of base.img
+adder_case() {
+  local kind=$1 dir=$2 count=$3 size=$4 fill=$5
+  PREP="cp --sparse=always base.img run.img"
+  local t
+  t=$(best_of "$ADDER" --input run.img --in-place --manifest "$dir.list")
+  sep
+  printf '{"case": "%s", "files": %s, "file_bytes": %s, "fill_pct": %s, "seconds": %s, "mb_per_s": %s}' \
+    "$kind" "$count" "$size" "$fill" "$t" "$(rate $((count * size)) "$t")"
+}
+
+json_adder() {
+  first=1
+  printf '['
+  "$BUILDER" --image empty.img --size-kib 262144 --inodes 16384 > /dev/null
+
+  # File size: one file into an empty 256 MiB image
+  for size in 4096 65536 1048576 16777216 67108864; do
+    log "mkfs_adder 1 file of $size bytes"
+    make_files "size$size" 1 "$size"
+    cp --sparse=always empty.img base.img
+    adder_case file_size "size$size" 1 "$size" 0
+  done
+
+  # File count: many 4 KiB files at once
+  for count in 1 100 1000 5000; do
+    log "mkfs_adder $count files of 4096 bytes"
+    make_files "count$count" "$count" 4096
+    cp --sparse=always empty.img base.img
+    adder_case file_count "count$count" "$count" 4096 0
+  done
+
+  # Fill level: 100 files of 64 KiB into an image already holding 256 KiB files
+  make_files fill 100 65536
+  for fill in 0 50 90; do
+    log "mkfs_adder 100 files into a $fill% full image"
+    local n=$((65536 * fill / 100 / 64))
+    cp --sparse=always empty.img base.img
+    if ((n > 0)); then
+      make_files "prefill$fill" "$n" 262144
+      "$ADDER" --input base.img --in-place --manifest "prefill$fill.list" > /dev/null
+    fi
+    adder_case fill_level fill 100 65536 "$fill"
+  done
+  printf ']'
+}
+
+log "bitmap_bench"
+bitmap=$("$BITMAP_BENCH" --json)
+log "crc32_bench"
+crc32=$("$CRC32_BENCH" --json)
+
+{
+  printf '{"commit": "%s", "date": "%s", "cpus": %s, "reps": %s,\n' \
+    "$(git -C "$ROOT_DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(nproc)" "$REPS"
+  printf ' "builder": %s,\n' "$(json_builder)"
+  printf ' "adder": %s,\n' "$(json_adder)"
+  printf ' "bitmap": %s,\n' "$bitmap"
+  printf ' "crc32": %s}\n' "$crc32"
+} > "$OUT"
+log "done"
@@ -0,0 +1,127 @@
+// Microbenchmark: free-bit search on a 90%-full bitmap.
+// Compares the original bit-at-a-time scan from bit 0 with the word/AVX2 scan
+// plus first-free hint used by mkfs_adder.
+//   bitmap_bench [allocations] [--json]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/bitmap.h"
+
+#define NBITS (32u * 32768u)       // 32 bitmap blocks: a 4 GiB image
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_bit(uint8_t *bitmap, uint64_t i) {
+    bitmap[i / 8] |= (uint8_t)(1u << (i % 8));
+}
+
+// The scan mkfs_adder used before: one bit at a time from bit 0
+static uint64_t naive_find_clear(const uint8_t *bitmap, uint64_t nbits) {
+    for (uint64_t i = 0; i < nbits; i++) {
+        if (!(bitmap[i / 8] & (1u << (i % 8)))) {
+            return i;
+        }
+    }
+    return nbits;
+}
+
+// Filling the bitmap to ~90%: the first 70% solid, the rest two-thirds used at random
+static void fill(uint8_t *bitmap) {
+    memset(bitmap, 0, NBITS / 8);
+    srand(42);
+    for (uint64_t i = 0; i < NBITS; i++) {
+        if (i < (uint64_t)NBITS * 70 / 100 || rand() % 3 != 0) {
+            set_bit(bitmap, i);
+        }
+    }
+}
+
+// Allocating `count` bits one by one, as repeated single-block adds would
+static double run(uint8_t *bitmap, uint64_t count, int fast, uint64_t *checksum) {
+    uint64_t hint = 0;
+    double t0 = now_sec();
+    for (uint64_t n = 0; n < count; n++) {
+        uint64_t i = fast ? bitmap_find_clear(bitmap, NBITS, hint) : naive_find_clear(bitmap, NBITS);
+        if (i >= NBITS) {
+            break;
+        }
+        hint = i;
+        set_bit(bitmap, i);
+        *checksum += i;
+    }
+    return now_sec() - t0;
+}
+
+// One cold search from bit 0, repeated: isolates the word scan from the hint
+static double cold_scan(const uint8_t *bitmap, int fast, int reps) {
+    volatile uint64_t sink = 0;
+    double t0 = now_sec();
+    for (int r = 0; r < reps; r++) {
+        sink += fast ? bitmap_find_clear(bitmap, NBITS, 0) : naive_find_clear(bitmap, NBITS);
+    }
+    (void)sink;
+    return (now_sec() - t0) / reps;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t count = 2000;
+    int json = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else {
+            count = strtoull(argv[i], NULL, 10);
+        }
+    }
+    uint8_t *bitmap = malloc(NBITS / 8);
+    if (!bitmap) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    uint64_t used = 0;
+    fill(bitmap);
+    for (uint64_t i = 0; i < NBITS; i++) {
+        used += (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+
+    double cold_naive = cold_scan(bitmap, 0, 50);
+    double cold_fast = cold_scan(bitmap, 1, 50);
+
+    uint64_t sum_naive = 0, sum_fast = 0;
+    double t_naive = run(bitmap, count, 0, &sum_naive);
+    fill(bitmap);
+    double t_fast = run(bitmap, count, 1, &sum_fast);
+    free(bitmap);
+
+    if (sum_naive != sum_fast) {
+        fprintf(stderr, "Error: scans disagree\n");
+        return 1;
+    }
+
+    if (json) {
+        printf("{\"bits\": %u, \"fill_pct\": %.1f, \"allocations\": %lu, "
+               "\"cold_scan_us\": {\"bit_at_a_time\": %.2f, \"word\": %.2f}, "
+               "\"alloc_ns\": {\"bit_at_a_time\": %.1f, \"word_hint\": %.1f}}\n",
+               NBITS, 100.0 * used / NBITS, count, cold_naive * 1e6, cold_fast * 1e6,
+               t_naive * 1e9 / count, t_fast * 1e9 / count);
+        return 0;
+    }
+    printf("bitmap: %u bits, %.1f%% full, %lu allocations\n", NBITS, 100.0 * used / NBITS, count);
+#ifdef BITMAP_HAVE_AVX2
+    printf("avx2: %s\n", bitmap_cpu_has_avx2() ? "yes" : "no");
+#endif
+    printf("cold scan   bit-at-a-time: %10.1f us   word: %8.1f us   speedup %.1fx\n",
+           cold_naive * 1e6, cold_fast * 1e6, cold_naive / cold_fast);
+    printf("allocations bit-at-a-time: %10.1f ns   word+hint: %6.1f ns   speedup %.1fx\n",
+           t_naive * 1e9 / count, t_fast * 1e9 / count, t_naive / t_fast);
+    return 0;
+}
@@ -0,0 +1,101 @@
+// CRC32 self-test and throughput benchmark.
+//   crc32_bench --self-test   compare every implementation with the reference table
+//   crc32_bench [MiB] [--json] GB/s per implementation on an in-cache and a large buffer
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crc32.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Running fn over buf repeatedly for ~0.2 s and returning GB/s
+static double throughput(uint32_t (*fn)(const void *, size_t), const uint8_t *buf, size_t len, uint32_t *out) {
+    uint64_t bytes = 0;
+    uint32_t acc = 0;
+    double t0 = now_sec(), t;
+    do {
+        acc ^= fn(buf, len);
+        bytes += len;
+        t = now_sec() - t0;
+    } while (t < 0.2);
+    *out = acc;
+    return bytes / t / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_fast_init();
+
+    if (argc > 1 && strcmp(argv[1], "--self-test") == 0) {
+        if (crc32_self_test() != 0) {
+            return 1;
+        }
+        printf("crc32 self-test passed (%s)\n", crc32_fast_impl());
+        return 0;
+    }
+
+    size_t big = (size_t)64 << 20;
+    int json = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else {
+            big = strtoull(argv[i], NULL, 10) << 20;
+        }
+    }
+    uint8_t *buf = malloc(big);
+    if (!buf) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    for (size_t i = 0; i < big; i++) {
+        buf[i] = (uint8_t)(i * 131 + (i >> 9));
+    }
+
+    struct { const char *name; uint32_t (*fn)(const void *, size_t); int ok; } impls[] = {
+        {"bytewise", crc32_bytewise, 1},
+        {"slice16", crc32_slice16, 1},
+        {"pclmul", crc32_pclmul, crc32_have_pclmul()},
+    };
+    size_t sizes[] = {4096, big};
+
+    if (json) {
+        printf("{\"dispatch\": \"%s\", \"results\": [", crc32_fast_impl());
+    } else {
+        printf("dispatch: %s\n", crc32_fast_impl());
+    }
+    const char *sep = "";
+    for (size_t s = 0; s < 2; s++) {
+        uint32_t want = crc32_bytewise(buf, sizes[s]);
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+            if (!impls[i].ok) {
+                continue;
+            }
+            uint32_t acc;
+            double gbps = throughput(impls[i].fn, buf, sizes[s], &acc);
+            if (impls[i].fn(buf, sizes[s]) != want) {
+                fprintf(stderr, "Error: %s disagrees with the reference\n", impls[i].name);
+                free(buf);
+                return 1;
+            }
+            if (json) {
+                printf("%s{\"impl\": \"%s\", \"bytes\": %zu, \"gb_per_s\": %.2f}", sep, impls[i].name, sizes[s], gbps);
+                sep = ", ";
+            } else {
+                printf("%-9s %9zu bytes: %7.2f GB/s\n", impls[i].name, sizes[s], gbps);
+            }
+        }
+    }
+    if (json) {
+        printf("]}\n");
+    }
+    free(buf);
+    return 0;
+}
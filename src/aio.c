@@ -0,0 +1,523 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "aio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "stats.h"
+
+// A source fd shared by the chunks queued from it
+typedef struct {
+    int fd;
+    int refs;                    // chunks in flight, plus one while it is the current source
+    int close_fd;
+} aio_src_t;
+
+// One chunk: len bytes of src at src_off go to block_no, mapped at dst
+typedef struct {
+    aio_src_t *src;
+    uint64_t block_no;
+    uint8_t *dst;
+    uint64_t src_off;
+    uint64_t len;
+} aio_req_t;
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+} aio_ring_t;
+
+struct vsfs_aio {
+    const vsfs_image_t *img;
+    int backend;
+    unsigned depth;
+    aio_src_t *cur;
+    int error;                   // errno of the first failed copy
+
+    // io_uring: one request slot per chunk in flight
+    aio_ring_t ring;
+    aio_req_t *reqs;
+    unsigned *free_slots;
+    unsigned nfree;
+    unsigned unsubmitted;
+
+    // Threads: a ring buffer of queued chunks
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t room;
+    pthread_t *tids;
+    unsigned nthreads;
+    aio_req_t *queue;
+    unsigned qhead, qcount, busy;
+    int stopping;
+};
+
+// Dropping one reference; the last one closes the fd if asked to
+static void src_put(aio_src_t *src) {
+    if (--src->refs == 0) {
+        if (src->close_fd) {
+            close(src->fd);
+        }
+        free(src);
+    }
+}
+
+static void aio_fail(vsfs_aio_t *aio, int err) {
+    if (!aio->error) {
+        aio->error = err;
+    }
+}
+
+// ==================================io_uring===================================
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(aio_ring_t *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_len);
+    }
+    if (r->sq_map) {
+        munmap(r->sq_map, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// Setting up a ring of at least *depth entries and checking that it can do
+// IORING_OP_READ (5.6+); -1 with errno set if io_uring is not usable
+static int ring_init(aio_ring_t *r, unsigned *depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = sys_io_uring_setup(*depth, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Kernels before 5.6 set up rings but cannot read through them
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (!probe) {
+        goto fail;
+    }
+    int ok = sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    // At most one SQE and one CQE per slot
+    if (*depth > p.sq_entries) {
+        *depth = p.sq_entries;
+    }
+    return 0;
+
+fail:;
+    int err = errno;
+    ring_free(r);
+    errno = err;
+    return -1;
+}
+
+static void ring_prep_read(vsfs_aio_t *aio, unsigned slot) {
+    aio_ring_t *r = &aio->ring;
+    aio_req_t *req = &aio->reqs[slot];
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->src->fd;
+    sqe->addr = (uintptr_t)req->dst;
+    sqe->len = (uint32_t)req->len;
+    sqe->off = req->src_off;
+    sqe->user_data = slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+}
+
+static void ring_complete(vsfs_aio_t *aio, unsigned slot) {
+    src_put(aio->reqs[slot].src);
+    aio->free_slots[aio->nfree++] = slot;
+}
+
+// Handling every posted completion; short reads are requeued for the rest
+static void ring_reap(vsfs_aio_t *aio) {
+    aio_ring_t *r = &aio->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        unsigned slot = (unsigned)cqe->user_data;
+        int res = cqe->res;
+        aio_req_t *req = &aio->reqs[slot];
+        head++;
+        if (res > 0) {
+            vsfs_stats_bytes(res, res);
+        }
+
+        if (res == -EINTR || res == -EAGAIN) {
+            ring_prep_read(aio, slot);
+        } else if (res <= 0) {
+            // A file that shrank since it was planned ends early
+            aio_fail(aio, res < 0 ? -res : EIO);
+            ring_complete(aio, slot);
+        } else if ((uint64_t)res < req->len) {
+            req->dst += res;
+            req->src_off += res;
+            req->len -= res;
+            ring_prep_read(aio, slot);
+        } else {
+            ring_complete(aio, slot);
+        }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submitting everything prepared, then waiting until a slot is free (or, with all set, every slot)
+static int ring_wait(vsfs_aio_t *aio, int all) {
+    for (;;) {
+        ring_reap(aio);
+        unsigned want = all ? aio->depth : 1;
+        if (aio->nfree >= want && aio->unsubmitted == 0) {
+            return 0;
+        }
+        unsigned min_complete = aio->nfree >= want ? 0 : 1;
+        int ret = sys_io_uring_enter(aio->ring.fd, aio->unsubmitted, min_complete,
+                                     min_complete ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            aio_fail(aio, errno);
+            return -1;
+        }
+        aio->unsubmitted -= (unsigned)ret;
+    }
+}
+
+// ===================================Threads===================================
+
+static void *aio_worker(void *arg) {
+    vsfs_aio_t *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->qcount == 0 && !aio->stopping) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+        if (aio->qcount == 0) {
+            break;
+        }
+        aio_req_t req = aio->queue[aio->qhead];
+        aio->qhead = (aio->qhead + 1) % aio->depth;
+        aio->qcount--;
+        aio->busy++;
+        pthread_cond_broadcast(&aio->room);
+        int failed = aio->error != 0;
+        pthread_mutex_unlock(&aio->lock);
+
+        // After a failure the rest of the queue is only drained
+        int ret = failed ? 0 : vsfs_copy_in(aio->img, req.block_no, req.src->fd, req.src_off, req.len);
+        int err = errno;
+
+        pthread_mutex_lock(&aio->lock);
+        if (ret < 0) {
+            aio_fail(aio, err);
+        }
+        src_put(req.src);
+        aio->busy--;
+        pthread_cond_broadcast(&aio->room);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+// Waiting (lock held) until the queue has room, or with all set until it is idle
+static void pool_wait(vsfs_aio_t *aio, int all) {
+    while (all ? (aio->qcount || aio->busy) : aio->qcount == aio->depth) {
+        pthread_cond_wait(&aio->room, &aio->lock);
+    }
+}
+
+static int pool_init(vsfs_aio_t *aio) {
+    unsigned n = aio->depth < AIO_THREADS_MAX ? aio->depth : AIO_THREADS_MAX;
+    aio->queue = calloc(aio->depth, sizeof(*aio->queue));
+    aio->tids = calloc(n, sizeof(*aio->tids));
+    if (!aio->queue || !aio->tids) {
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        int err = pthread_create(&aio->tids[i], NULL, aio_worker, aio);
+        if (err != 0) {
+            errno = err;
+            break;
+        }
+        aio->nthreads++;
+    }
+    return aio->nthreads ? 0 : -1;
+}
+
+// ====================================Engine===================================
+
+vsfs_aio_t *vsfs_aio_start(const vsfs_image_t *img, int backend, unsigned depth) {
+    vsfs_aio_t *aio = calloc(1, sizeof(*aio));
+    if (!aio) {
+        return NULL;
+    }
+    aio->img = img;
+    aio->depth = depth ? depth : AIO_DEPTH;
+    aio->ring.fd = -1;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->room, NULL);
+
+    if (backend == VSFS_IO_AUTO || backend == VSFS_IO_URING) {
+        if (ring_init(&aio->ring, &aio->depth) == 0) {
+            aio->reqs = calloc(aio->depth, sizeof(*aio->reqs));
+            aio->free_slots = calloc(aio->depth, sizeof(*aio->free_slots));
+            if (!aio->reqs || !aio->free_slots) {
+                vsfs_aio_finish(aio);
+                return NULL;
+            }
+            for (unsigned i = 0; i < aio->depth; i++) {
+                aio->free_slots[aio->nfree++] = aio->depth - 1 - i;
+            }
+            aio->backend = VSFS_IO_URING;
+            return aio;
+        }
+        if (backend == VSFS_IO_URING) {
+            fprintf(stderr, "Warning: io_uring is not available (%s); using threads\n", strerror(errno));
+        }
+        backend = VSFS_IO_THREADS;
+    }
+    if (backend == VSFS_IO_THREADS && pool_init(aio) < 0) {
+        fprintf(stderr, "Warning: could not start I/O threads (%s); copying synchronously\n", strerror(errno));
+        backend = VSFS_IO_SYNC;
+    }
+    aio->backend = backend;
+    return aio;
+}
+
+const char *vsfs_aio_backend(const vsfs_aio_t *aio) {
+    switch (aio->backend) {
+        case VSFS_IO_URING:
+            return "io_uring";
+        case VSFS_IO_THREADS:
+            return "threads";
+        default:
+            return "sync";
+    }
+}
+
+// Queueing one chunk of the current source (lock held for threads)
+static int aio_queue(vsfs_aio_t *aio, uint64_t block_no, uint64_t src_off, uint64_t len) {
+    aio_req_t req = {aio->cur, block_no, vsfs_block(aio->img, block_no), src_off, len};
+
+    if (aio->backend == VSFS_IO_URING) {
+        if (aio->nfree == 0 && ring_wait(aio, 0) < 0) {
+            return -1;
+        }
+        unsigned slot = aio->free_slots[--aio->nfree];
+        aio->reqs[slot] = req;
+        aio->cur->refs++;
+        ring_prep_read(aio, slot);
+        // Starting reads early, without waiting for the ring to fill
+        if (aio->unsubmitted >= AIO_BATCH) {
+            int ret = sys_io_uring_enter(aio->ring.fd, aio->unsubmitted, 0, 0);
+            if (ret > 0) {
+                aio->unsubmitted -= (unsigned)ret;
+            }
+        }
+        return 0;
+    }
+    pool_wait(aio, 0);
+    aio->queue[(aio->qhead + aio->qcount) % aio->depth] = req;
+    aio->qcount++;
+    aio->cur->refs++;
+    pthread_cond_signal(&aio->work);
+    return 0;
+}
+
+int vsfs_aio_copy_in(vsfs_aio_t *aio, uint64_t block_no, int src_fd, uint64_t src_off, uint64_t len) {
+    const vsfs_image_t *img = aio->img;
+    if (block_no >= img->nblocks || (len + BS - 1) / BS > img->nblocks - block_no) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (aio->backend == VSFS_IO_SYNC) {
+        if (aio->error) {
+            errno = aio->error;
+            return -1;
+        }
+        if (vsfs_copy_in(img, block_no, src_fd, src_off, len) < 0) {
+            aio_fail(aio, errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&aio->lock);
+    if (aio->error) {
+        errno = aio->error;
+        ret = -1;
+        goto out;
+    }
+    if (!aio->cur || aio->cur->fd != src_fd) {
+        if (aio->cur) {
+            src_put(aio->cur);
+        }
+        aio->cur = calloc(1, sizeof(*aio->cur));
+        if (!aio->cur) {
+            ret = -1;
+            goto out;
+        }
+        aio->cur->fd = src_fd;
+        aio->cur->refs = 1;
+    }
+    for (uint64_t off = 0; off < len; off += AIO_CHUNK) {
+        uint64_t n = len - off < AIO_CHUNK ? len - off : AIO_CHUNK;
+        if (aio_queue(aio, block_no + off / BS, src_off + off, n) < 0) {
+            errno = aio->error;
+            ret = -1;
+            break;
+        }
+    }
+out:
+    pthread_mutex_unlock(&aio->lock);
+    return ret;
+}
+
+// Waiting (lock held) for every queued chunk
+static int aio_drain(vsfs_aio_t *aio) {
+    if (aio->backend == VSFS_IO_URING) {
+        return ring_wait(aio, 1);
+    }
+    if (aio->backend == VSFS_IO_THREADS) {
+        pool_wait(aio, 1);
+    }
+    return 0;
+}
+
+int vsfs_aio_close(vsfs_aio_t *aio, int src_fd) {
+    if (aio->backend == VSFS_IO_SYNC) {
+        return close(src_fd);
+    }
+    pthread_mutex_lock(&aio->lock);
+    if (aio->cur && aio->cur->fd == src_fd) {
+        // The last chunk to complete closes it
+        aio->cur->close_fd = 1;
+        src_put(aio->cur);
+        aio->cur = NULL;
+        pthread_mutex_unlock(&aio->lock);
+        return 0;
+    }
+    // Chunks of an earlier source may still be reading from it
+    aio_drain(aio);
+    pthread_mutex_unlock(&aio->lock);
+    return close(src_fd);
+}
+
+int vsfs_aio_finish(vsfs_aio_t *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio_drain(aio);
+    if (aio->cur) {
+        src_put(aio->cur);
+        aio->cur = NULL;
+    }
+    aio->stopping = 1;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (unsigned i = 0; i < aio->nthreads; i++) {
+        pthread_join(aio->tids[i], NULL);
+    }
+    ring_free(&aio->ring);
+    pthread_cond_destroy(&aio->room);
+    pthread_cond_destroy(&aio->work);
+    pthread_mutex_destroy(&aio->lock);
+
+    int err = aio->error;
+    free(aio->reqs);
+    free(aio->free_slots);
+    free(aio->queue);
+    free(aio->tids);
+    free(aio);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
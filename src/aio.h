@@ -0,0 +1,45 @@
+// Asynchronous copy-in of file data. Copies are cut into 1 MiB chunks that
+// are read straight into the image mapping with many of them in flight:
+// through io_uring when the kernel has it (raw syscalls, no liburing), else
+// by a pool of threads running vsfs_copy_in().
+#ifndef MINIVSFS_AIO_H
+#define MINIVSFS_AIO_H
+
+#include <stdint.h>
+
+#include "minivsfs.h"
+
+#define AIO_CHUNK (1u << 20)
+#define AIO_DEPTH 64u            // chunks in flight
+#define AIO_BATCH 8u             // io_uring: chunks prepared before they are submitted
+#define AIO_THREADS_MAX 16u
+
+// Backends
+enum {
+    VSFS_IO_AUTO,                // io_uring if available, else threads
+    VSFS_IO_URING,
+    VSFS_IO_THREADS,
+    VSFS_IO_SYNC,                // one vsfs_copy_in() at a time, in the caller
+};
+
+typedef struct vsfs_aio vsfs_aio_t;
+
+// Starting an engine writing into img; NULL on error. An unavailable io_uring
+// falls back to threads, with a warning when it was asked for by name.
+vsfs_aio_t *vsfs_aio_start(const vsfs_image_t *img, int backend, unsigned depth);
+
+// Name of the backend in use ("io_uring", "threads" or "sync")
+const char *vsfs_aio_backend(const vsfs_aio_t *aio);
+
+// Queueing a copy of len bytes of src_fd at src_off to the image at block_no;
+// blocks while the queue is full. src_fd must stay open until it is passed to
+// vsfs_aio_close() or the engine is finished.
+int vsfs_aio_copy_in(vsfs_aio_t *aio, uint64_t block_no, int src_fd, uint64_t src_off, uint64_t len);
+
+// Closing src_fd once every copy queued from it has completed
+int vsfs_aio_close(vsfs_aio_t *aio, int src_fd);
+
+// Waiting for every queued copy and freeing the engine; -1 with errno set if any copy failed
+int vsfs_aio_finish(vsfs_aio_t *aio);
+
+#endif
@@ -0,0 +1,113 @@
+// Free-bitmap search shared by the MiniVSFS tools.
+// Bit i lives in byte i / 8 at position i % 8, as written by set_bitmap_bit().
+#ifndef MINIVSFS_BITMAP_H
+#define MINIVSFS_BITMAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+#endif
+
+// Loading 64 bitmap bits so that bit i of the word is bitmap bit base + i
+static inline uint64_t bitmap_load64(const uint8_t *bitmap, uint64_t word) {
+    uint64_t w;
+    memcpy(&w, bitmap + word * 8, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// Partial trailing word: only the bytes that exist are read
+static inline uint64_t bitmap_load_tail(const uint8_t *bitmap, uint64_t word, uint64_t nbits) {
+    uint64_t bytes = (nbits + 7) / 8 - word * 8;
+    if (bytes >= 8) {
+        return bitmap_load64(bitmap, word);
+    }
+    uint64_t w = 0;
+    for (uint64_t i = 0; i < bytes; i++) {
+        w |= (uint64_t)bitmap[word * 8 + i] << (8 * i);
+    }
+    return w;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// Skipping whole 256-bit chunks that are all ones (full) or all zeros (empty)
+__attribute__((target("avx2")))
+static inline uint64_t bitmap_skip_avx2(const uint8_t *bitmap, uint64_t word, uint64_t full_words, int want_clear) {
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    while (word + 4 <= full_words) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap + word * 8));
+        int skip = want_clear ? _mm256_testc_si256(v, ones) : _mm256_testz_si256(v, v);
+        if (!skip) {
+            break;
+        }
+        word += 4;
+    }
+    return word;
+}
+
+static inline int bitmap_cpu_has_avx2(void) {
+    static int cached = -1;
+    if (cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return cached;
+}
+#endif
+
+// Index of the first bit in [from, nbits) equal to !want_clear, or nbits if none
+static inline uint64_t bitmap_scan(const uint8_t *bitmap, uint64_t nbits, uint64_t from, int want_clear) {
+    if (from >= nbits) {
+        return nbits;
+    }
+    uint64_t word = from / 64;
+    uint64_t last_word = (nbits - 1) / 64;
+    uint64_t full_words = nbits / 64;
+    uint64_t flip = want_clear ? ~0ull : 0;
+
+    // First word: ignoring bits below `from`
+    uint64_t w = (word < full_words ? bitmap_load64(bitmap, word) : bitmap_load_tail(bitmap, word, nbits)) ^ flip;
+    w &= ~0ull << (from % 64);
+    while (!w) {
+        if (++word > last_word) {
+            return nbits;
+        }
+#ifdef BITMAP_HAVE_AVX2
+        if (word + 4 <= full_words && bitmap_cpu_has_avx2()) {
+            word = bitmap_skip_avx2(bitmap, word, full_words, want_clear);
+            if (word > last_word) {
+                return nbits;
+            }
+        }
+#endif
+        w = (word < full_words ? bitmap_load64(bitmap, word) : bitmap_load_tail(bitmap, word, nbits)) ^ flip;
+    }
+    uint64_t bit = word * 64 + (uint64_t)__builtin_ctzll(w);
+    return bit < nbits ? bit : nbits;
+}
+
+static inline uint64_t bitmap_find_clear(const uint8_t *bitmap, uint64_t nbits, uint64_t from) {
+    return bitmap_scan(bitmap, nbits, from, 1);
+}
+
+static inline uint64_t bitmap_find_set(const uint8_t *bitmap, uint64_t nbits, uint64_t from) {
+    return bitmap_scan(bitmap, nbits, from, 0);
+}
+
+// Number of clear bits in [0, nbits), counted run by run
+static inline uint64_t bitmap_count_clear(const uint8_t *bitmap, uint64_t nbits) {
+    uint64_t n = 0;
+    for (uint64_t i = bitmap_find_clear(bitmap, nbits, 0); i < nbits;) {
+        uint64_t end = bitmap_find_set(bitmap, nbits, i);
+        n += end - i;
+        i = bitmap_find_clear(bitmap, nbits, end);
+    }
+    return n;
+}
+
+#endif
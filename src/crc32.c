@@ -0,0 +1,229 @@
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_X86 1
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+// CRC32_SLICE[0] is the classic byte table; CRC32_SLICE[k] advances it k more bytes
+static uint32_t CRC32_SLICE[16][256];
+static uint32_t (*crc32_update)(uint32_t c, const uint8_t *p, size_t n);
+static const char *crc32_impl_name = "bytewise";
+
+// The raw update functions work on the pre-inverted CRC state
+static uint32_t update_bytewise(uint32_t c, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        c = CRC32_SLICE[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c;
+}
+
+static inline uint32_t load32le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t update_slice16(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 16) {
+        uint32_t a = load32le(p) ^ c;
+        uint32_t b = load32le(p + 4);
+        uint32_t d = load32le(p + 8);
+        uint32_t e = load32le(p + 12);
+        c = CRC32_SLICE[15][a & 0xFF] ^ CRC32_SLICE[14][(a >> 8) & 0xFF] ^
+            CRC32_SLICE[13][(a >> 16) & 0xFF] ^ CRC32_SLICE[12][a >> 24] ^
+            CRC32_SLICE[11][b & 0xFF] ^ CRC32_SLICE[10][(b >> 8) & 0xFF] ^
+            CRC32_SLICE[9][(b >> 16) & 0xFF] ^ CRC32_SLICE[8][b >> 24] ^
+            CRC32_SLICE[7][d & 0xFF] ^ CRC32_SLICE[6][(d >> 8) & 0xFF] ^
+            CRC32_SLICE[5][(d >> 16) & 0xFF] ^ CRC32_SLICE[4][d >> 24] ^
+            CRC32_SLICE[3][e & 0xFF] ^ CRC32_SLICE[2][(e >> 8) & 0xFF] ^
+            CRC32_SLICE[1][(e >> 16) & 0xFF] ^ CRC32_SLICE[0][e >> 24];
+        p += 16;
+        n -= 16;
+    }
+    return update_bytewise(c, p, n);
+}
+
+#ifdef CRC32_HAVE_X86
+// Carry-less multiply folding (Intel, "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ"), bit-reflected constants for 0xEDB88320.
+// Folds 64 bytes per iteration, then 16, then Barrett-reduces to 32 bits.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t fold_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64;
+    n -= 64;
+
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        n -= 64;
+    }
+
+    // Folding the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t update_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    // The folding kernel needs at least 64 bytes and works on 16-byte multiples
+    if (n >= 64) {
+        size_t chunk = n & ~(size_t)15;
+        c = fold_pclmul(c, p, chunk);
+        p += chunk;
+        n -= chunk;
+    }
+    return update_slice16(c, p, n);
+}
+#endif
+
+int crc32_have_pclmul(void) {
+#ifdef CRC32_HAVE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+    return 0;
+#endif
+}
+
+void crc32_fast_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        CRC32_SLICE[0][i] = c;
+    }
+    for (int k = 1; k < 16; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = CRC32_SLICE[k - 1][i];
+            CRC32_SLICE[k][i] = (c >> 8) ^ CRC32_SLICE[0][c & 0xFF];
+        }
+    }
+
+    crc32_update = update_slice16;
+    crc32_impl_name = "slice16";
+#ifdef CRC32_HAVE_X86
+    if (crc32_have_pclmul()) {
+        crc32_update = update_pclmul;
+        crc32_impl_name = "pclmul";
+    }
+#endif
+}
+
+uint32_t crc32_fast(const void *data, size_t n) {
+    return crc32_update(0xFFFFFFFFu, data, n) ^ 0xFFFFFFFFu;
+}
+
+const char *crc32_fast_impl(void) {
+    return crc32_impl_name;
+}
+
+uint32_t crc32_bytewise(const void *data, size_t n) {
+    return update_bytewise(0xFFFFFFFFu, data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_slice16(const void *data, size_t n) {
+    return update_slice16(0xFFFFFFFFu, data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_pclmul(const void *data, size_t n) {
+#ifdef CRC32_HAVE_X86
+    return update_pclmul(0xFFFFFFFFu, data, n) ^ 0xFFFFFFFFu;
+#else
+    return crc32_slice16(data, n);
+#endif
+}
+
+int crc32_self_test(void) {
+    // Standard check value for "123456789"
+    if (crc32_bytewise("123456789", 9) != 0xCBF43926u) {
+        fprintf(stderr, "crc32 self-test: reference check value mismatch\n");
+        return -1;
+    }
+
+    enum { MAX_LEN = 9000 };
+    uint8_t *buf = malloc(MAX_LEN + 16);
+    if (!buf) {
+        return -1;
+    }
+    uint32_t seed = 0x12345678u;
+    for (size_t i = 0; i < MAX_LEN + 16; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+
+    int have_pclmul = crc32_have_pclmul();
+    int ret = 0;
+    // Every length up to a few KiB, at every alignment within 16 bytes
+    for (size_t len = 0; len <= MAX_LEN && ret == 0; len += len < 300 ? 1 : 97) {
+        for (size_t off = 0; off < 16; off++) {
+            uint32_t want = crc32_bytewise(buf + off, len);
+            if (crc32_slice16(buf + off, len) != want ||
+                (have_pclmul && crc32_pclmul(buf + off, len) != want) ||
+                crc32_fast(buf + off, len) != want) {
+                fprintf(stderr, "crc32 self-test: mismatch at length %zu offset %zu\n", len, off);
+                ret = -1;
+                break;
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,28 @@
+// Fast CRC32 (reflected polynomial 0xEDB88320), bit-identical to the
+// reference table loop in the tools. Selected at runtime: PCLMULQDQ folding
+// when the CPU has it, slicing-by-16 otherwise.
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Building the tables and picking an implementation; call once before use
+void crc32_fast_init(void);
+
+// Same result as the reference crc32(data, n)
+uint32_t crc32_fast(const void *data, size_t n);
+
+// Name of the implementation crc32_fast() dispatches to
+const char *crc32_fast_impl(void);
+
+// Individual implementations, for the self-test and benchmark
+uint32_t crc32_bytewise(const void *data, size_t n);
+uint32_t crc32_slice16(const void *data, size_t n);
+int crc32_have_pclmul(void);
+uint32_t crc32_pclmul(const void *data, size_t n);   // only when crc32_have_pclmul()
+
+// Comparing every implementation against the byte-at-a-time table; 0 on success
+int crc32_self_test(void);
+
+#endif
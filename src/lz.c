@@ -0,0 +1,159 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_HASH_BITS 14
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writing the 255-continued tail of a length whose nibble saturated at 15
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit,
+                             size_t offset, size_t match) {
+    if (op >= oend) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15))) {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < nlit) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (match == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t m = match - LZ_MIN_MATCH;
+    *token |= (uint8_t)(m < 15 ? m : 15);
+    if (m >= 15 && !(op = put_length(op, oend, m - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+// Greedy parse: the most recent earlier position with the same 4 bytes is the only candidate
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    const uint8_t *oend = dst + cap;
+    uint8_t *op = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+    size_t misses = 0;          // since the last match; incompressible input is skipped faster
+
+    while (n >= LZ_MIN_MATCH && i <= n - LZ_MIN_MATCH) {
+        uint32_t v = load32(src + i);
+        uint32_t h = lz_hash(v);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand == 0xFFFFFFFFu || i - cand > LZ_MAX_OFFSET || load32(src + cand) != v) {
+            i += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n && src[cand + len] == src[i + len]) {
+            len++;
+        }
+        op = put_sequence(op, oend, src + anchor, i - anchor, i - cand, len);
+        if (!op) {
+            return 0;
+        }
+        i += len;
+        anchor = i;
+    }
+
+    op = put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Reading a 255-continued length; SIZE_MAX on truncated input
+static size_t get_length(const uint8_t **ip, const uint8_t *iend, size_t len) {
+    if (len < 15) {
+        return len;
+    }
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return SIZE_MAX;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int64_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + n;
+    size_t out = 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = get_length(&ip, iend, token >> 4);
+        if (nlit == SIZE_MAX || nlit > (size_t)(iend - ip) || nlit > cap - out) {
+            return -1;
+        }
+        memcpy(dst + out, ip, nlit);
+        ip += nlit;
+        out += nlit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = get_length(&ip, iend, token & 15);
+        if (match == SIZE_MAX || offset == 0 || offset > out || match + LZ_MIN_MATCH > cap - out) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        // Overlapping copies repeat the last offset bytes, so go byte by byte
+        const uint8_t *from = dst + out - offset;
+        if (offset >= match) {
+            memcpy(dst + out, from, match);
+        } else {
+            for (size_t k = 0; k < match; k++) {
+                dst[out + k] = from[k];
+            }
+        }
+        out += match;
+    }
+    return (int64_t)out;
+}
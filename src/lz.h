@@ -0,0 +1,24 @@
+// Self-contained LZ77 codec for compressed files (byte-oriented, LZ4-like).
+// A stream is a series of sequences: a token byte (literal count in the high
+// nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning more length
+// bytes follow), the literals, then a 2-byte little-endian match offset.
+// The last sequence carries literals only.
+#ifndef MINIVSFS_LZ_H
+#define MINIVSFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Worst case output size for n input bytes (incompressible data)
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compressing n bytes into dst; the compressed size, or 0 if it would exceed cap
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Decompressing into dst; the decompressed size, or -1 if the stream is corrupt or exceeds cap
+int64_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#endif
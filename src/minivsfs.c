@@ -0,0 +1,698 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "minivsfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "crc32.h"
+#include "lz.h"
+#include "stats.h"
+
+// ==========================DO NOT CHANGE THIS PORTION=========================
+// These functions are there for your help. You should refer to the specifications to see how you can use them.
+// ====================================CRC32====================================
+uint32_t CRC32_TAB[256];
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+// ====================================CRC32====================================
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32_fast((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32_fast(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+
+uint32_t dirent_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(((dirent64_t *)0)->name) && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Bitmap editing
+void set_bitmap_bit(uint8_t *bitmap, uint64_t bit_index) {
+    uint64_t byte_index = bit_index / 8;
+    uint32_t bit_offset = bit_index % 8;
+    bitmap[byte_index] |= (1 << bit_offset);
+}
+
+// Mapping blocks [start, start + count) of the overlay file over the base
+static int overlay_map_run(const vsfs_image_t *img, uint64_t start, uint64_t count) {
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    void *at = mmap(img->base + start * BS, count * BS, PROT_READ | (img->writable ? PROT_WRITE : 0),
+                    MAP_SHARED | MAP_FIXED, img->fd, start * BS);
+    if (at == MAP_FAILED) {
+        perror("Failed to map overlay blocks");
+        return -1;
+    }
+    return 0;
+}
+
+// Mapping the base privately (a stray write never reaches it), then every
+// block the overlay holds and its presence bitmap on top
+static int overlay_map(vsfs_image_t *img, const superblock_t *sb, uint64_t file_blocks) {
+    uint64_t total = sb->total_blocks;
+    if (sb->overlay_start != total || sb->overlay_blocks * BITS_PER_BLOCK < total ||
+        file_blocks < total + sb->overlay_blocks || memchr(sb->base_image, '\0', sizeof(sb->base_image)) == NULL) {
+        fprintf(stderr, "Error: Corrupt overlay superblock\n");
+        return -1;
+    }
+
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int base_fd = open(sb->base_image, O_RDONLY);
+    if (base_fd < 0) {
+        fprintf(stderr, "Error: Cannot open base image '%s': %s\n", sb->base_image, strerror(errno));
+        return -1;
+    }
+    superblock_t base_sb;
+    struct stat st;
+    vsfs_stats_syscall(VSFS_SYS_READ);
+    if (pread(base_fd, &base_sb, sizeof(base_sb), 0) != (ssize_t)sizeof(base_sb) || fstat(base_fd, &st) != 0 ||
+        base_sb.magic != FS_MAGIC || base_sb.total_blocks != total || (uint64_t)st.st_size < total * BS) {
+        fprintf(stderr, "Error: Base image '%s' does not match the overlay\n", sb->base_image);
+        close(base_fd);
+        return -1;
+    }
+    if (base_sb.overlay_blocks) {
+        fprintf(stderr, "Error: Base image '%s' is itself an overlay\n", sb->base_image);
+        close(base_fd);
+        return -1;
+    }
+    if (base_sb.checksum != sb->base_checksum) {
+        fprintf(stderr, "Error: Base image '%s' changed since the overlay was made\n", sb->base_image);
+        close(base_fd);
+        return -1;
+    }
+
+    uint64_t nblocks = total + sb->overlay_blocks;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    void *base = mmap(NULL, nblocks * BS, PROT_READ | (img->writable ? PROT_WRITE : 0), MAP_PRIVATE, base_fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to map base image");
+        close(base_fd);
+        return -1;
+    }
+    img->base = base;
+    img->nblocks = nblocks;
+    img->overlay = 1;
+    img->base_fd = base_fd;
+
+    if (overlay_map_run(img, total, sb->overlay_blocks) < 0) {
+        return -1;
+    }
+    const uint8_t *present = vsfs_block(img, total);
+    for (uint64_t i = bitmap_find_set(present, total, 0); i < total;) {
+        uint64_t end = bitmap_find_clear(present, total, i);
+        if (overlay_map_run(img, i, end - i) < 0) {
+            return -1;
+        }
+        i = bitmap_find_set(present, total, end);
+    }
+    return 0;
+}
+
+int vsfs_overlay_claim(const vsfs_image_t *img, uint64_t start, uint64_t count, int copy) {
+    if (!img->overlay) {
+        return 0;
+    }
+    uint64_t total = vsfs_sb(img)->total_blocks;
+    if (start >= total || count > total - start) {
+        errno = ERANGE;
+        return -1;
+    }
+    uint8_t *present = vsfs_block(img, total);
+    uint64_t end = start + count;
+    for (uint64_t i = bitmap_find_clear(present, end, start); i < end;) {
+        uint64_t run_end = bitmap_find_set(present, end, i);
+        // What the base holds goes to the overlay file before its mapping hides the base
+        for (uint64_t b = i; copy && b < run_end; b++) {
+            vsfs_stats_syscall(VSFS_SYS_WRITE);
+            if (pwrite(img->fd, img->base + b * BS, BS, b * BS) != BS) {
+                return -1;
+            }
+            vsfs_stats_bytes(BS, BS);
+        }
+        if (overlay_map_run(img, i, run_end - i) < 0) {
+            return -1;
+        }
+        for (uint64_t b = i; b < run_end; b++) {
+            set_bitmap_bit(present, b);
+        }
+        i = bitmap_find_clear(present, end, run_end);
+    }
+    return 0;
+}
+
+int vsfs_map(vsfs_image_t *img, int fd, int writable, uint64_t nblocks) {
+    memset(img, 0, sizeof(*img));
+    img->fd = fd;
+    img->writable = writable;
+
+    struct stat st;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat image");
+        return -1;
+    }
+    uint64_t file_blocks = (uint64_t)st.st_size / BS;
+
+    // Overlays are recognised by their superblock before anything is mapped
+    superblock_t sb;
+    vsfs_stats_syscall(VSFS_SYS_READ);
+    if (file_blocks > 0 && pread(fd, &sb, sizeof(sb), 0) == (ssize_t)sizeof(sb) &&
+        sb.magic == FS_MAGIC && sb.version == FS_VERSION && sb.overlay_blocks) {
+        if (overlay_map(img, &sb, file_blocks) < 0) {
+            // The fd stays the caller's
+            if (img->base) {
+                munmap(img->base, img->nblocks * BS);
+            }
+            if (img->overlay) {
+                close(img->base_fd);
+            }
+            memset(img, 0, sizeof(*img));
+            return -1;
+        }
+        return 0;
+    }
+    if (nblocks == 0) {
+        nblocks = file_blocks;
+    }
+    if (nblocks == 0 || nblocks > file_blocks) {
+        fprintf(stderr, "Error: Image is smaller than %lu blocks\n", nblocks ? nblocks : 1);
+        return -1;
+    }
+
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    void *base = mmap(NULL, nblocks * BS, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to map image");
+        return -1;
+    }
+    img->base = base;
+    img->nblocks = nblocks;
+    return 0;
+}
+
+int vsfs_open(vsfs_image_t *img, const char *path, int writable) {
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image");
+        return -1;
+    }
+    if (vsfs_map(img, fd, writable, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    img->owns_fd = 1;
+    return 0;
+}
+
+// Regions end at or before total_blocks, which must itself be mapped
+static int region_ok(const superblock_t *sb, uint64_t start, uint64_t count) {
+    return start < sb->total_blocks && count <= sb->total_blocks - start;
+}
+
+int vsfs_check(const vsfs_image_t *img) {
+    const superblock_t *sb = vsfs_sb(img);
+
+    // Magic number validation
+    if (sb->magic != FS_MAGIC) {
+        fprintf(stderr, "Error: Invalid MiniVSFS image format\n");
+        return -1;
+    }
+
+    if (sb->version != FS_VERSION) {
+        fprintf(stderr, "Error: Unsupported MiniVSFS version %u (expected %u)\n", sb->version, FS_VERSION);
+        return -1;
+    }
+
+    if (sb->block_size != BS || sb->total_blocks > img->nblocks ||
+        (sb->journal_blocks && (sb->journal_blocks < 3 || !region_ok(sb, sb->journal_start, sb->journal_blocks))) ||
+        (sb->refcount_blocks && (!region_ok(sb, sb->refcount_start, sb->refcount_blocks) ||
+                                 sb->refcount_blocks * REFCOUNTS_PER_BLOCK < sb->data_region_blocks)) ||
+        !region_ok(sb, sb->inode_bitmap_start, sb->inode_bitmap_blocks) ||
+        !region_ok(sb, sb->data_bitmap_start, sb->data_bitmap_blocks) ||
+        !region_ok(sb, sb->inode_table_start, sb->inode_table_blocks) ||
+        !region_ok(sb, sb->data_region_start, sb->data_region_blocks) ||
+        !region_ok(sb, sb->summary_start, sb->summary_blocks) ||
+        sb->inode_table_blocks * INODES_PER_BLOCK < sb->inode_count ||
+        sb->inode_table_init == 0 || sb->inode_table_init > sb->inode_table_blocks) {
+        fprintf(stderr, "Error: Corrupt superblock (regions outside the image)\n");
+        return -1;
+    }
+
+    // Bitmaps must be able to describe every inode and data block, the summary every bitmap block
+    if (sb->inode_bitmap_blocks * BITS_PER_BLOCK < sb->inode_count ||
+        sb->data_bitmap_blocks * BITS_PER_BLOCK < sb->data_region_blocks ||
+        sb->summary_blocks * SUMMARY_PER_BLOCK < sb->inode_bitmap_blocks + sb->data_bitmap_blocks) {
+        fprintf(stderr, "Error: Corrupt superblock (bitmaps or summary too small)\n");
+        return -1;
+    }
+    return 0;
+}
+
+int vsfs_close(vsfs_image_t *img) {
+    int ret = 0;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (img->base && munmap(img->base, img->nblocks * BS) != 0) {
+        perror("Failed to unmap image");
+        ret = -1;
+    }
+    if (img->owns_fd && close(img->fd) != 0) {
+        perror("Failed to close image");
+        ret = -1;
+    }
+    if (img->overlay) {
+        close(img->base_fd);
+    }
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    return ret;
+}
+
+// Page-aligned [addr, addr + len) covering blocks [start, start + count)
+static int block_range(const vsfs_image_t *img, uint64_t start, uint64_t count, uint8_t **addr, size_t *len) {
+    if (start >= img->nblocks) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (count == 0 || count > img->nblocks - start) {
+        count = img->nblocks - start;
+    }
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t begin = start * BS / page * page;
+    *addr = img->base + begin;
+    *len = (start + count) * BS - begin;
+    return 0;
+}
+
+int vsfs_sync(const vsfs_image_t *img, uint64_t start, uint64_t count, int wait) {
+    uint8_t *addr;
+    size_t len;
+    vsfs_stats_syscall(VSFS_SYS_SYNC);
+    if (block_range(img, start, count, &addr, &len) < 0 || msync(addr, len, wait ? MS_SYNC : MS_ASYNC) != 0) {
+        perror("Failed to sync image");
+        return -1;
+    }
+    return 0;
+}
+
+int vsfs_advise(const vsfs_image_t *img, uint64_t start, uint64_t count, int advice) {
+    uint8_t *addr;
+    size_t len;
+    if (block_range(img, start, count, &addr, &len) < 0) {
+        return -1;
+    }
+    return madvise(addr, len, advice);
+}
+
+int vsfs_copy_in(const vsfs_image_t *img, uint64_t block_no, int src_fd, uint64_t src_off, uint64_t len) {
+    if (block_no >= img->nblocks || (len + BS - 1) / BS > img->nblocks - block_no) {
+        errno = ERANGE;
+        return -1;
+    }
+    off_t in_off = src_off, out_off = block_no * BS;
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &in_off, img->fd, &out_off, len, 0);
+        vsfs_stats_syscall(VSFS_SYS_COPY);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        vsfs_stats_bytes(n, n);
+        len -= n;
+    }
+    // Fallback for what the kernel would not copy: straight into the mapping
+    uint8_t *dst = img->base + out_off;
+    while (len > 0) {
+        ssize_t n = pread(src_fd, dst, len, in_off);
+        vsfs_stats_syscall(VSFS_SYS_READ);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        vsfs_stats_bytes(n, n);
+        dst += n;
+        in_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+uint32_t vsfs_metadata_crc(const vsfs_image_t *img) {
+    return crc32_fast(img->base, vsfs_sb(img)->data_region_start * BS);
+}
+
+uint32_t vsfs_bitmap_block_free(const uint8_t *bitmap, uint64_t i, uint64_t nbits) {
+    uint64_t first = i * BITS_PER_BLOCK;
+    if (first >= nbits) {
+        return 0;
+    }
+    uint64_t bits = nbits - first < BITS_PER_BLOCK ? nbits - first : BITS_PER_BLOCK;
+    return (uint32_t)bitmap_count_clear(bitmap + i * BS, bits);
+}
+
+void vsfs_summary_build(vsfs_image_t *img) {
+    superblock_t *sb = vsfs_sb(img);
+    uint32_t *summary = vsfs_summary(img);
+    sb->free_inodes = 0;
+    for (uint64_t i = 0; i < sb->inode_bitmap_blocks; i++) {
+        summary[i] = vsfs_bitmap_block_free(vsfs_inode_bitmap(img), i, sb->inode_count);
+        sb->free_inodes += summary[i];
+    }
+    sb->free_blocks = 0;
+    for (uint64_t i = 0; i < sb->data_bitmap_blocks; i++) {
+        summary[sb->inode_bitmap_blocks + i] = vsfs_bitmap_block_free(vsfs_data_bitmap(img), i, sb->data_region_blocks);
+        sb->free_blocks += summary[sb->inode_bitmap_blocks + i];
+    }
+    sb->summary_crc = crc32_fast(summary, sb->summary_blocks * BS);
+}
+
+static journal_header_t *journal_header(const vsfs_image_t *img) {
+    return (journal_header_t *)vsfs_block(img, vsfs_sb(img)->journal_start);
+}
+
+static void journal_header_finalize(journal_header_t *jh) {
+    jh->checksum = 0;
+    jh->checksum = crc32_fast(jh, sizeof(*jh) - sizeof(jh->checksum));
+}
+
+static uint64_t journal_descriptor_blocks(uint64_t count) {
+    return (count + JOURNAL_TARGETS_PER_BLOCK - 1) / JOURNAL_TARGETS_PER_BLOCK;
+}
+
+// Overlays: the header (keeping its sequence) and the log of count blocks
+static int journal_claim(const vsfs_image_t *img, uint64_t count) {
+    const superblock_t *sb = vsfs_sb(img);
+    if (vsfs_overlay_claim(img, sb->journal_start, 1, 1) < 0 ||
+        vsfs_overlay_claim(img, sb->journal_start + 1, journal_descriptor_blocks(count) + count, 0) < 0) {
+        perror("Failed to claim overlay blocks");
+        return -1;
+    }
+    return 0;
+}
+
+void vsfs_journal_format(vsfs_image_t *img) {
+    if (vsfs_sb(img)->journal_blocks == 0) {
+        return;
+    }
+    journal_header_t *jh = journal_header(img);
+    memset(jh, 0, BS);
+    jh->magic = JOURNAL_MAGIC;
+    jh->state = JOURNAL_CLEAN;
+    journal_header_finalize(jh);
+    vsfs_stats_bytes(0, BS);
+}
+
+uint64_t vsfs_journal_capacity(const vsfs_image_t *img) {
+    uint64_t room = vsfs_sb(img)->journal_blocks;
+    if (room < 3) {
+        return 0;
+    }
+    // Header, then one descriptor block per JOURNAL_TARGETS_PER_BLOCK logged blocks
+    room -= 1;
+    return room - journal_descriptor_blocks(room);
+}
+
+// A header is trusted only if its own checksum matches
+static int journal_header_valid(const journal_header_t *jh) {
+    journal_header_t tmp = *jh;
+    journal_header_finalize(&tmp);
+    return jh->magic == JOURNAL_MAGIC && tmp.checksum == jh->checksum;
+}
+
+int vsfs_journal_pending(const vsfs_image_t *img) {
+    if (vsfs_sb(img)->journal_blocks == 0) {
+        return 0;
+    }
+    const journal_header_t *jh = journal_header(img);
+    return journal_header_valid(jh) && jh->state == JOURNAL_COMMITTED;
+}
+
+static int image_fsync(const vsfs_image_t *img) {
+    vsfs_stats_syscall(VSFS_SYS_SYNC);
+    if (fsync(img->fd) != 0) {
+        perror("Failed to sync image");
+        return -1;
+    }
+    return 0;
+}
+
+// Copying every logged block home, then marking the journal clean
+static int journal_checkpoint(vsfs_image_t *img) {
+    const superblock_t *sb = vsfs_sb(img);
+    journal_header_t *jh = journal_header(img);
+    uint64_t count = jh->nblocks;
+    const uint64_t *targets = (const uint64_t *)vsfs_block(img, sb->journal_start + 1);
+    uint64_t first_copy = sb->journal_start + 1 + journal_descriptor_blocks(count);
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t *home = vsfs_block(img, targets[i]);
+        // The journal itself is never a target
+        if (!home || (targets[i] >= sb->journal_start && targets[i] < sb->journal_start + sb->journal_blocks)) {
+            fprintf(stderr, "Error: Journal entry %lu targets invalid block %lu\n", i, targets[i]);
+            return -1;
+        }
+        if (vsfs_overlay_claim(img, targets[i], 1, 0) < 0) {
+            perror("Failed to claim overlay blocks");
+            return -1;
+        }
+        memcpy(home, vsfs_block(img, first_copy + i), BS);
+    }
+    vsfs_stats_bytes(0, count * BS);
+    if (image_fsync(img) < 0) {
+        return -1;
+    }
+
+    // Losing this write is harmless: replaying the same transaction again is idempotent
+    jh->state = JOURNAL_CLEAN;
+    journal_header_finalize(jh);
+    vsfs_stats_bytes(0, BS);
+    return 0;
+}
+
+int vsfs_journal_recover(vsfs_image_t *img) {
+    const superblock_t *sb = vsfs_sb(img);
+    if (sb->journal_blocks == 0) {
+        return 0;
+    }
+    journal_header_t *jh = journal_header(img);
+    if (!journal_header_valid(jh) || jh->state != JOURNAL_COMMITTED) {
+        return 0;
+    }
+    if (!img->writable) {
+        fprintf(stderr, "Error: Journal holds a committed transaction; open the image writable to replay it\n");
+        return -1;
+    }
+
+    if (journal_claim(img, 0) < 0) {
+        return -1;
+    }
+
+    // A commit record whose log does not match was never durable: nothing to replay
+    uint64_t log_blocks = journal_descriptor_blocks(jh->nblocks) + jh->nblocks;
+    if (jh->nblocks == 0 || jh->nblocks > vsfs_journal_capacity(img) ||
+        crc32_fast(vsfs_block(img, sb->journal_start + 1), log_blocks * BS) != jh->log_crc) {
+        jh->state = JOURNAL_CLEAN;
+        journal_header_finalize(jh);
+        return 0;
+    }
+
+    if (journal_checkpoint(img) < 0) {
+        return -1;
+    }
+    printf("Replayed journal transaction %lu (%lu blocks)\n", jh->sequence, jh->nblocks);
+    return 1;
+}
+
+int vsfs_journal_commit(vsfs_image_t *img, uint64_t count, const uint64_t *targets, uint8_t *const *blocks) {
+    const superblock_t *sb = vsfs_sb(img);
+    if (count == 0) {
+        return 0;
+    }
+    if (count > vsfs_journal_capacity(img)) {
+        fprintf(stderr, "Error: Transaction of %lu blocks exceeds the journal (%lu)\n", count, vsfs_journal_capacity(img));
+        return -1;
+    }
+
+    // Descriptor blocks, then the block copies, right after the header
+    uint64_t desc_blocks = journal_descriptor_blocks(count);
+    if (journal_claim(img, count) < 0) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (vsfs_overlay_claim(img, targets[i], 1, 0) < 0) {
+            perror("Failed to claim overlay blocks");
+            return -1;
+        }
+    }
+    uint8_t *log = vsfs_block(img, sb->journal_start + 1);
+    memset(log, 0, desc_blocks * BS);
+    memcpy(log, targets, count * sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; i++) {
+        memcpy(log + (desc_blocks + i) * BS, blocks[i], BS);
+    }
+    uint32_t log_crc = crc32_fast(log, (desc_blocks + count) * BS);
+    vsfs_stats_bytes(0, (desc_blocks + count + 1) * BS);   // the log and the commit record
+
+    // The log (and any file data already written) must be durable before the commit record
+    if (image_fsync(img) < 0) {
+        return -1;
+    }
+
+    journal_header_t *jh = journal_header(img);
+    uint64_t sequence = journal_header_valid(jh) ? jh->sequence + 1 : 1;
+    memset(jh, 0, BS);
+    jh->magic = JOURNAL_MAGIC;
+    jh->state = JOURNAL_COMMITTED;
+    jh->sequence = sequence;
+    jh->nblocks = count;
+    jh->log_crc = log_crc;
+    journal_header_finalize(jh);
+    if (image_fsync(img) < 0) {
+        return -1;
+    }
+
+    return journal_checkpoint(img);
+}
+
+int vsfs_commit_blocks(vsfs_image_t *img, uint64_t count, const uint64_t *targets, uint8_t *const *blocks) {
+    if (vsfs_sb(img)->journal_blocks == 0) {
+        for (uint64_t i = 0; i < count; i++) {
+            uint8_t *home = vsfs_block(img, targets[i]);
+            if (!home || vsfs_overlay_claim(img, targets[i], 1, 0) < 0) {
+                fprintf(stderr, "Error: Failed to write metadata block %lu\n", targets[i]);
+                return -1;
+            }
+            memcpy(home, blocks[i], BS);
+        }
+        vsfs_stats_bytes(0, count * BS);
+        if (vsfs_sync(img, 0, 0, 1) < 0) {
+            perror("Failed to sync image");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Splitting the change would expose a half-applied state after a crash
+    if (count > vsfs_journal_capacity(img)) {
+        fprintf(stderr, "Error: Change touches %lu metadata blocks but the journal holds %lu; "
+                "split it or build the image with a larger --journal-blocks\n", count, vsfs_journal_capacity(img));
+        return -1;
+    }
+    return vsfs_journal_commit(img, count, targets, blocks);
+}
+
+int vsfs_stream_read(const vsfs_image_t *img, const extent_t *extents, uint32_t extent_count,
+                     uint64_t off, void *buf, uint64_t len) {
+    uint8_t *dst = buf;
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < extent_count && len > 0; i++) {
+        uint64_t run = (uint64_t)extents[i].length * BS;
+        if (off < base + run) {
+            uint64_t skip = off - base;
+            uint64_t n = run - skip < len ? run - skip : len;
+            const uint8_t *src = vsfs_block(img, extents[i].start + skip / BS);
+            if (!src || !vsfs_block(img, extents[i].start + (skip + n - 1) / BS)) {
+                return -1;
+            }
+            memcpy(dst, src + skip % BS, n);
+            dst += n;
+            off += n;
+            len -= n;
+        }
+        base += run;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+int64_t vsfs_cluster_read(const vsfs_image_t *img, const extent_t *extents, uint32_t extent_count,
+                          uint64_t size, uint64_t c, uint8_t *out) {
+    uint64_t clusters = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    cluster_map_t map;
+    if (c >= clusters || vsfs_stream_read(img, extents, extent_count, 0, &map, sizeof(map)) < 0 ||
+        map.magic != CLUSTER_MAGIC || map.cluster_shift != CLUSTER_SHIFT || map.clusters != clusters) {
+        return -1;
+    }
+
+    // Cluster c spans [end[c - 1], end[c]); cluster 0 starts right after the map
+    uint64_t bounds[2];
+    uint64_t first = sizeof(map) + clusters * sizeof(uint64_t);
+    if (c == 0) {
+        bounds[0] = first;
+        if (vsfs_stream_read(img, extents, extent_count, sizeof(map), &bounds[1], sizeof(uint64_t)) < 0) {
+            return -1;
+        }
+    } else if (vsfs_stream_read(img, extents, extent_count, sizeof(map) + (c - 1) * sizeof(uint64_t),
+                                bounds, sizeof(bounds)) < 0) {
+        return -1;
+    }
+
+    uint64_t raw = size - c * CLUSTER_SIZE < CLUSTER_SIZE ? size - c * CLUSTER_SIZE : CLUSTER_SIZE;
+    if (bounds[0] < first || bounds[1] <= bounds[0] || bounds[1] - bounds[0] > raw) {
+        return -1;
+    }
+    uint64_t stored = bounds[1] - bounds[0];
+    if (stored == raw) {
+        return vsfs_stream_read(img, extents, extent_count, bounds[0], out, raw) < 0 ? -1 : (int64_t)raw;
+    }
+
+    uint8_t *packed = malloc(stored);
+    if (!packed) {
+        return -1;
+    }
+    int64_t n = -1;
+    if (vsfs_stream_read(img, extents, extent_count, bounds[0], packed, stored) == 0) {
+        n = lz_decompress(packed, stored, out, CLUSTER_SIZE);
+    }
+    free(packed);
+    return n == (int64_t)raw ? n : -1;
+}
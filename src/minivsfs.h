@@ -0,0 +1,386 @@
+// MiniVSFS on-disk format and the image access layer shared by the tools.
+// Everything here is built into libminivsfs.a.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define INODES_PER_BLOCK (BS / INODE_SIZE)
+#define ROOT_INO 1u
+#define FS_MAGIC 0x4D565346u
+#define FS_VERSION 10u                // 2: extent-mapped inodes, 3: hashed directories, 4: journal, 5: inline data, 6: shared blocks, 7: compression, 8: overlays, 9: free counts, 10: lazy inode table
+#define INODE_FL_EXTENTS 0x1u
+#define INODE_FL_HTREE 0x2u            // directory with a hashed index in block 0
+#define INODE_FL_INLINE 0x4u           // regular file stored in the extent slots, no data blocks
+#define INODE_FL_COMPRESSED 0x8u       // extents map a cluster map and LZ-compressed clusters
+#define INODE_EXTENTS 4                // extent slots inside the inode
+#define EXTENTS_PER_BLOCK (BS / sizeof(extent_t))
+#define BITS_PER_BLOCK (BS * 8u)
+#define DIRENT_FILE 1
+#define DIRENT_DIR 2
+#define REFCOUNTS_PER_BLOCK (BS / sizeof(uint16_t))
+#define SUMMARY_PER_BLOCK (BS / sizeof(uint32_t))
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint64_t journal_start;
+    uint64_t journal_blocks;     // 0: no journal
+    uint64_t refcount_start;
+    uint64_t refcount_blocks;    // 0: blocks are never shared
+    uint64_t free_inodes;
+    uint64_t free_blocks;        // in the data region
+    uint64_t summary_start;      // free-bit summary, one uint32 per bitmap block
+    uint64_t summary_blocks;
+    uint32_t summary_crc;        // crc32 of the summary blocks
+    uint64_t inode_table_init;   // inode table blocks written so far; later ones read as zero, whatever they hold
+    uint64_t overlay_start;      // overlays: block-presence bitmap, right after total_blocks
+    uint64_t overlay_blocks;     // 0: not an overlay
+    uint32_t base_checksum;      // overlays: superblock checksum of the base when the overlay was made
+    char base_image[256];        // overlays: absolute path of the read-only base
+
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 468, "superblock must fit in one block");
+
+// A run of physically contiguous blocks
+#pragma pack(push,1)
+typedef struct {
+    uint64_t start;
+    uint32_t length;
+} extent_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_t)==12, "extent size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    union {
+        uint32_t direct[12];                // version 1 block pointers
+        extent_t extents[INODE_EXTENTS];    // INODE_FL_EXTENTS: runs or index entries
+    };
+    uint32_t flags;                         // INODE_FL_* (reserved_0 in version 1)
+    uint32_t extent_count;                  // leaf extents in the file (reserved_1 in version 1)
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// Largest file kept inline
+#define INODE_INLINE_MAX sizeof(((inode_t *)0)->extents)
+
+// Compressed files: the blocks hold this header, the stream offset where each
+// cluster ends (one uint64 per cluster), then the clusters back to back. A
+// cluster whose stored length equals its raw length is stored uncompressed.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t cluster_shift;
+    uint64_t clusters;
+} cluster_map_t;
+#pragma pack(pop)
+
+#define CLUSTER_MAGIC 0x5A435356u
+#define CLUSTER_SHIFT 16u
+#define CLUSTER_SIZE (1u << CLUSTER_SHIFT)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define DIRENTS_PER_BLOCK ((int)(BS / sizeof(dirent64_t)))
+#define DIRENT_NAME_MAX (sizeof(((dirent64_t *)0)->name) - 1)
+
+// Hashed directory index: block 0 keeps "." and ".." and then the index root;
+// index nodes start with the header. Entries are sorted by name hash and
+// point at logical directory blocks.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint8_t levels;              // 0: entries point at leaves, 1: at index nodes
+    uint8_t reserved[3];
+    uint32_t count;
+    uint32_t limit;
+} dx_header_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t block;
+} dx_entry_t;
+#pragma pack(pop)
+
+#define DX_MAGIC 0x58445356u
+#define DX_ROOT_OFFSET (2 * sizeof(dirent64_t))
+#define DX_ROOT_LIMIT ((BS - DX_ROOT_OFFSET - sizeof(dx_header_t)) / sizeof(dx_entry_t))
+#define DX_NODE_LIMIT ((BS - sizeof(dx_header_t)) / sizeof(dx_entry_t))
+
+// Index header of a directory block: after "." and ".." in block 0, at the start of a node
+static inline dx_header_t *dx_header(uint8_t *block, uint64_t logical) {
+    return (dx_header_t *)(block + (logical == 0 ? DX_ROOT_OFFSET : 0));
+}
+
+static inline dx_entry_t *dx_entries(dx_header_t *hdr) {
+    return (dx_entry_t *)(hdr + 1);
+}
+
+// Index of the last entry whose hash is <= h (entry 0 covers everything below)
+static inline uint32_t dx_search(dx_header_t *hdr, uint32_t h) {
+    dx_entry_t *e = dx_entries(hdr);
+    uint32_t lo = 1, hi = hdr->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (e[mid].hash <= h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+// Metadata journal. Its first block holds the header; a committed transaction
+// follows as descriptor blocks (the home block number of each logged block)
+// and then the logged block copies, in the same order.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t state;              // JOURNAL_CLEAN or JOURNAL_COMMITTED
+    uint64_t sequence;           // of the last committed transaction
+    uint64_t nblocks;            // blocks logged by that transaction
+    uint32_t log_crc;            // crc32 over its descriptor and logged blocks
+    uint32_t checksum;           // crc32 of this header with checksum zeroed
+} journal_header_t;
+#pragma pack(pop)
+
+#define JOURNAL_MAGIC 0x4A535356u
+#define JOURNAL_CLEAN 0u
+#define JOURNAL_COMMITTED 1u
+#define JOURNAL_TARGETS_PER_BLOCK (BS / sizeof(uint64_t))
+
+// Image delta (mkfs_adder --delta, mkfs_apply): a header block, the run table,
+// then the new contents of every run back to back. The leading data_runs runs
+// hold file data and extent index blocks and are written straight home; the
+// rest are metadata blocks, one per run, committed through the journal.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;            // FS_VERSION of the base
+    uint64_t base_blocks;        // total_blocks of the base
+    uint32_t base_crc;           // vsfs_metadata_crc() of the base
+    uint32_t table_crc;          // crc32 of the run table blocks
+    uint64_t runs;
+    uint64_t data_runs;
+    uint64_t blocks;             // payload blocks
+    uint32_t checksum;           // crc32 of this header with checksum zeroed
+} delta_header_t;
+
+typedef struct {
+    uint64_t start;              // home block of the first block
+    uint32_t length;
+    uint32_t crc;                // crc32 of the run's payload
+} delta_run_t;
+#pragma pack(pop)
+
+#define DELTA_MAGIC 0x44535356u
+#define DELTA_RUNS_PER_BLOCK (BS / sizeof(delta_run_t))
+
+// Dedup index file kept beside the image (<image>.dedup): the header, then
+// one entry per indexed block. Only trusted while the image's superblock
+// checksum matches the one recorded when it was written.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t sb_checksum;
+    uint64_t count;
+} dedup_file_header_t;
+
+typedef struct {
+    uint64_t block;
+    uint32_t hash;
+} dedup_file_entry_t;
+#pragma pack(pop)
+
+#define DEDUP_MAGIC 0x44445356u
+
+// Reference CRC32 (byte-at-a-time table); crc32_fast() from crc32.h is bit-identical
+void crc32_init(void);
+uint32_t crc32(const void* data, size_t n);
+
+// Checksums; call after every other field has been finalized
+uint32_t superblock_crc_finalize(superblock_t *sb);   // sb must head a full BS-byte block
+void inode_crc_finalize(inode_t* ino);
+void dirent_checksum_finalize(dirent64_t* de);
+
+// FNV-1a over the NUL-terminated dirent name, as stored in the directory index
+uint32_t dirent_name_hash(const char *name);
+
+void set_bitmap_bit(uint8_t *bitmap, uint64_t bit_index);
+
+// A memory-mapped image. Blocks [0, nblocks) are addressable; pointers returned
+// by the accessors stay valid until vsfs_close().
+//
+// An overlay maps its base privately and, over it, the blocks its own file
+// holds, as the presence bitmap records. Reads are transparent; a block must
+// be claimed with vsfs_overlay_claim() before it is written.
+typedef struct {
+    int fd;
+    int owns_fd;
+    int writable;
+    uint8_t *base;
+    uint64_t nblocks;
+    int overlay;
+    int base_fd;                 // overlays: the base image, read-only
+} vsfs_image_t;
+
+// Opening and mapping a whole image file (read-only unless writable)
+int vsfs_open(vsfs_image_t *img, const char *path, int writable);
+
+// Mapping the first nblocks blocks of an already open fd (0: the whole file); fd stays the caller's.
+// An overlay is always mapped whole, over its base.
+int vsfs_map(vsfs_image_t *img, int fd, int writable, uint64_t nblocks);
+
+// Making blocks [start, start + count) of an overlay local before they are
+// written; copy brings their current contents along (for partial writes).
+// A no-op on ordinary images.
+int vsfs_overlay_claim(const vsfs_image_t *img, uint64_t start, uint64_t count, int copy);
+
+// Validating the superblock and that every region it describes is mapped; 0 if usable
+int vsfs_check(const vsfs_image_t *img);
+
+// Unmapping, and closing the fd if vsfs_open() opened it
+int vsfs_close(vsfs_image_t *img);
+
+// Flushing blocks [start, start + count) to the file (count 0: to the end); wait selects MS_SYNC
+int vsfs_sync(const vsfs_image_t *img, uint64_t start, uint64_t count, int wait);
+
+// madvise() over blocks [start, start + count), e.g. MADV_SEQUENTIAL or MADV_WILLNEED
+int vsfs_advise(const vsfs_image_t *img, uint64_t start, uint64_t count, int advice);
+
+// Copying len bytes of src_fd at src_off into the image at block_no, in the kernel when possible
+int vsfs_copy_in(const vsfs_image_t *img, uint64_t block_no, int src_fd, uint64_t src_off, uint64_t len);
+
+// crc32 of blocks [0, data_region_start): superblock, bitmaps, inode table,
+// journal and reference counts. Every change rewrites some of them, so it
+// names the base a delta was made against.
+uint32_t vsfs_metadata_crc(const vsfs_image_t *img);
+
+// Clear bits in block i of a bitmap describing nbits objects
+uint32_t vsfs_bitmap_block_free(const uint8_t *bitmap, uint64_t i, uint64_t nbits);
+
+// Recounting both bitmaps into the summary and the superblock's free counters,
+// then setting summary_crc (mkfs); the superblock checksum is left to the caller
+void vsfs_summary_build(vsfs_image_t *img);
+
+// Writing an empty journal header (mkfs)
+void vsfs_journal_format(vsfs_image_t *img);
+
+// Largest number of blocks one transaction can log; 0 without a journal
+uint64_t vsfs_journal_capacity(const vsfs_image_t *img);
+
+// 1 if the journal holds a committed transaction that is not checkpointed yet
+int vsfs_journal_pending(const vsfs_image_t *img);
+
+// Replaying a committed transaction to its home blocks; 1 if replayed, 0 if clean, -1 on error
+int vsfs_journal_recover(vsfs_image_t *img);
+
+// Atomically writing count blocks to their home locations: log, fsync, commit
+// record, fsync, checkpoint, fsync. Everything else written to the image fd
+// before the call (file data) is durable once the commit record is.
+int vsfs_journal_commit(vsfs_image_t *img, uint64_t count, const uint64_t *targets, uint8_t *const *blocks);
+
+// Writing a change's metadata blocks home, superblock last: as one journal
+// transaction, or straight through the mapping and synced on an image built
+// without a journal. A change larger than the journal is refused untouched.
+int vsfs_commit_blocks(vsfs_image_t *img, uint64_t count, const uint64_t *targets, uint8_t *const *blocks);
+
+// Reading len bytes at offset off of the block stream mapped by extents
+int vsfs_stream_read(const vsfs_image_t *img, const extent_t *extents, uint32_t extent_count,
+                     uint64_t off, void *buf, uint64_t len);
+
+// Decompressing cluster c of a compressed file of size bytes into out
+// (CLUSTER_SIZE bytes); its length, or -1 if the file is corrupt
+int64_t vsfs_cluster_read(const vsfs_image_t *img, const extent_t *extents, uint32_t extent_count,
+                          uint64_t size, uint64_t c, uint8_t *out);
+
+static inline uint8_t *vsfs_block(const vsfs_image_t *img, uint64_t block_no) {
+    return block_no < img->nblocks ? img->base + block_no * BS : NULL;
+}
+
+static inline superblock_t *vsfs_sb(const vsfs_image_t *img) {
+    return (superblock_t *)img->base;
+}
+
+static inline uint8_t *vsfs_inode_bitmap(const vsfs_image_t *img) {
+    return vsfs_block(img, vsfs_sb(img)->inode_bitmap_start);
+}
+
+static inline uint8_t *vsfs_data_bitmap(const vsfs_image_t *img) {
+    return vsfs_block(img, vsfs_sb(img)->data_bitmap_start);
+}
+
+// Reference-count table: one uint16 per data block counting the references
+// beyond the first, so 0 is right for every unshared or free block. NULL if
+// the image has no table.
+static inline uint16_t *vsfs_refcounts(const vsfs_image_t *img) {
+    const superblock_t *sb = vsfs_sb(img);
+    return sb->refcount_blocks ? (uint16_t *)vsfs_block(img, sb->refcount_start) : NULL;
+}
+
+// Free-bit summary: the clear bits of each inode bitmap block, then of each
+// data bitmap block, so a full block is skipped without reading it
+static inline uint32_t *vsfs_summary(const vsfs_image_t *img) {
+    return (uint32_t *)vsfs_block(img, vsfs_sb(img)->summary_start);
+}
+
+// 0 if inode_num lies past the inode table's high-water mark: a zero inode, not to be read
+static inline int vsfs_inode_initialized(const vsfs_image_t *img, uint32_t inode_num) {
+    return (inode_num - 1) / INODES_PER_BLOCK < vsfs_sb(img)->inode_table_init;
+}
+
+// Inode numbers are 1-based; the caller keeps inode_num within inode_count
+static inline inode_t *vsfs_inode(const vsfs_image_t *img, uint32_t inode_num) {
+    return (inode_t *)(vsfs_block(img, vsfs_sb(img)->inode_table_start) + (uint64_t)(inode_num - 1) * INODE_SIZE);
+}
+
+#endif
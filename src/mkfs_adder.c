@@ -1,4 +1,5 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,122 +10,225 @@
 #include <assert.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
+#include "aio.h"
+#include "bitmap.h"
+#include "crc32.h"
+#include "lz.h"
+#include "minivsfs.h"
+#include "stats.h"
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;              
-    uint32_t version;           
-    uint32_t block_size;          
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;  
-    uint64_t inode_bitmap_blocks; 
-    uint64_t data_bitmap_start;   
-    uint64_t data_bitmap_blocks; 
-    uint64_t inode_table_start;  
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;         
-    uint64_t mtime_epoch;
-    uint32_t flags;              
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;            
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;          
-    uint16_t links;        
-    uint32_t uid;           
-    uint32_t gid;           
-    uint64_t size_bytes;    
-    uint64_t atime;         
-    uint64_t mtime;         
-    uint64_t ctime;          
-    uint32_t direct[12];     
-    uint32_t reserved_0;     
-    uint32_t reserved_1;     
-    uint32_t reserved_2;    
-    uint32_t proj_id;       
-    uint32_t uid16_gid16;    
-    uint64_t xattr_ptr;     
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;   
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;      
-    uint8_t type;          
-    char name[58];           
-    uint8_t checksum;       
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+#define COPY_CHUNK (1u << 20)
+#define RUN_NONE UINT64_MAX
+#define DEDUP_NONE UINT64_MAX
+#define FILE_EXTENTS_MAX (INODE_EXTENTS * EXTENTS_PER_BLOCK)
+#define RUN_BUCKETS 64
+
+// Data block allocation policies
+enum {
+    ALLOC_BEST_FIT,              // smallest free run that holds the request, else fewest runs
+    ALLOC_FIRST_FIT,             // lowest free blocks, wherever they are
+};
 
 // Command line arguments structure
 typedef struct {
     char *input_name;
     char *output_name;
-    char *file_name;
+    char *manifest_name;
+    char *delta_name;            // --delta: the batch as a patch against the input
+    int in_place;
+    int alloc_policy;
+    int dedup;
+    int compress;
+    int io_backend;
+    int stats;                   // 1: text, 2: JSON
+    char **file_names;
+    uint32_t file_count;
+    uint32_t file_capacity;
 } cli_args_t;
 
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// A directory being read or extended; blocks are cached by logical number
+typedef struct {
+    uint32_t inode_num;
+    int htree;
+    uint64_t nblocks;            // including blocks added in this batch
+    uint64_t disk_nblocks;       // blocks that already have a physical location
+    uint64_t nalloc;
+    uint64_t cap;
+    uint64_t *phys;
+    uint8_t **blocks;
+    uint8_t *dirty;
+    extent_t *extents;
+    uint32_t extent_count;
+    uint32_t index_count;
+    uint32_t index_dirty;        // extent index blocks to rewrite on flush
+    uint64_t index_blocks[INODE_EXTENTS];
+    uint8_t *index_buf;          // index_dirty blocks built by dir_collect()
+} dir_t;
+
+// Dentry cache entry: a directory found or created under `parent`
+typedef struct dentry {
+    struct dentry *next;         // hash chain
+    uint32_t parent;
+    uint32_t inode_no;
+    uint32_t hash;
+    dir_t *dir;                  // opened on first descent
+    char name[58];
+} dentry_t;
+
+// A file scheduled for the current batch
+typedef struct {
+    const char *path;
+    uint64_t size;
+    uint32_t inode_num;
+    uint64_t block_count;
+    int inline_data;             // stored in the inode, no blocks
+    int compressed;              // blocks hold the cluster stream staged in the spill file
+    uint64_t stored_size;        // bytes of that stream
+    uint64_t spill_off;
+    extent_t *extents;           // data runs, in file order
+    uint8_t *fresh;              // per extent: 1 if this batch writes it, 0 if it shares existing blocks
+    uint64_t shared_blocks;
+    uint32_t extent_count;
+    uint32_t index_count;        // overflow blocks holding the extent list
+    uint64_t index_blocks[INODE_EXTENTS];
+} pending_file_t;
+
+// A data block that later blocks with the same contents can share
+typedef struct {
+    uint64_t block;
+    uint64_t next;               // hash chain
+    uint64_t src_off;
+    int32_t src_file;            // batch file still holding the data, -1 once it is in the image
+    uint32_t hash;
+} dedup_entry_t;
+
+// A free run of the data region for best-fit, linked into the bucket of
+// floor(log2(len)); runs only shrink while a batch is planned
+typedef struct {
+    uint64_t start;              // data region bit
+    uint64_t len;
+    uint64_t prev;
+    uint64_t next;
+} free_run_t;
+
+// In-memory copy of the image metadata touched while adding files; the
+// mapped image is only read until image_flush()
+typedef struct {
+    vsfs_image_t *img;
+    uint8_t *sb_block;
+    superblock_t *sb;
+    uint8_t *inode_bitmap;       // all inode_bitmap_blocks, contiguous
+    uint8_t *data_bitmap;        // all data_bitmap_blocks, contiguous
+    uint8_t *inode_bitmap_dirty;
+    uint8_t *data_bitmap_dirty;
+    uint32_t *summary;           // free bits per bitmap block, inode bitmap first
+    uint8_t *summary_dirty;
+    uint8_t **itable;            // inode table blocks, loaded on first use
+    uint8_t *itable_dirty;
+    dir_t **dirs;                // every directory opened or created; dirs[0] is root
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+    dentry_t **dcache;           // (parent inode, name) -> directory
+    uint64_t dcache_buckets;
+    uint64_t dcache_count;
+    uint64_t inode_hint;         // lowest inode bit that may still be free
+    uint64_t data_hint;          // lowest data bit that may still be free
+    uint64_t bits_scanned;       // bitmap bits the allocator passed over
+    int alloc_policy;
+    free_run_t *runs;            // best-fit free-run index, built on first allocation
+    uint64_t run_count;
+    uint64_t run_buckets[RUN_BUCKETS];
+    uint64_t cur_run;            // run the file being deduplicated is filling
+    int dedup;                   // sharing identical data blocks
+    int compress;                // storing files as LZ-compressed clusters when that saves blocks
+    uint16_t *shares;            // private copy of the reference-count table
+    uint8_t *shares_dirty;
+    dedup_entry_t *dedup_entries;
+    uint64_t dedup_count;
+    uint64_t dedup_capacity;
+    uint64_t *dedup_buckets;     // hash -> first entry
+    uint64_t dedup_nbuckets;
+    FILE *spill;                 // compressed streams waiting to be written
+    uint64_t spill_size;
+    const pending_file_t *pending;
+    int32_t src_file;            // batch file open as src_fd for comparisons
+    int src_fd;
+} fs_image_t;
+
+// Metadata blocks written by one batch, with their home block numbers
+typedef struct {
+    uint64_t *targets;
+    uint8_t **blocks;
+    uint64_t count;
+    uint64_t capacity;
+} block_list_t;
+
+
+// Queueing a file name for the batch
+int args_push_file(cli_args_t *args, const char *name) {
+    if (args->file_count == args->file_capacity) {
+        uint32_t cap = args->file_capacity ? args->file_capacity * 2 : 16;
+        char **names = realloc(args->file_names, cap * sizeof(char *));
+        if (!names) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        args->file_names = names;
+        args->file_capacity = cap;
     }
+    char *copy = strdup(name);
+    if (!copy) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    args->file_names[args->file_count++] = copy;
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
+// Reading file names from a manifest, one per line ("-" reads stdin)
+int read_manifest(cli_args_t *args, const char *manifest_name) {
+    FILE *manifest = strcmp(manifest_name, "-") == 0 ? stdin : fopen(manifest_name, "r");
+    if (!manifest) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int ret = 0;
+    while ((len = getline(&line, &line_cap, manifest)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        // Blank lines and comments are skipped
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        if (args_push_file(args, line) < 0) {
+            ret = -1;
+            break;
+        }
+    }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; 
-    memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; 
+    free(line);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+    return ret;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];  
-    de->checksum = x;
+void args_free(cli_args_t *args) {
+    for (uint32_t i = 0; i < args->file_count; i++) {
+        free(args->file_names[i]);
+    }
+    free(args->file_names);
 }
 
 // Parsing command line arguments
@@ -134,15 +238,21 @@ int parse_args(int argc, char *argv[], cli_args_t *args) {
         {"input", required_argument, 0, 'i'},
         {"output", required_argument, 0, 'o'},
         {"file", required_argument, 0, 'f'},
+        {"manifest", required_argument, 0, 'm'},
+        {"in-place", no_argument, 0, 'p'},
+        {"alloc", required_argument, 0, 'a'},
+        {"dedup", no_argument, 0, 'd'},
+        {"compress", no_argument, 0, 'z'},
+        {"io", required_argument, 0, 'I'},
+        {"stats", optional_argument, 0, 'S'},
+        {"delta", required_argument, 0, 'D'},
         {0, 0, 0, 0}
     };
-    
+
     // Initialize args
-    args->input_name = NULL;
-    args->output_name = NULL;
-    args->file_name = NULL;
-    
-    while ((opt = getopt_long(argc, argv, "i:o:f:", long_options, NULL)) != -1) {
+    memset(args, 0, sizeof(*args));
+
+    while ((opt = getopt_long(argc, argv, "i:o:f:m:pa:dzI:S::D:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
                 args->input_name = optarg;
@@ -151,456 +261,2382 @@ int parse_args(int argc, char *argv[], cli_args_t *args) {
                 args->output_name = optarg;
                 break;
             case 'f':
-                args->file_name = optarg;
+                if (args_push_file(args, optarg) < 0) {
+                    return -1;
+                }
+                break;
+            case 'm':
+                args->manifest_name = optarg;
+                break;
+            case 'p':
+                args->in_place = 1;
+                break;
+            case 'D':
+                args->delta_name = optarg;
+                break;
+            case 'a':
+                if (strcmp(optarg, "best-fit") == 0) {
+                    args->alloc_policy = ALLOC_BEST_FIT;
+                } else if (strcmp(optarg, "first-fit") == 0) {
+                    args->alloc_policy = ALLOC_FIRST_FIT;
+                } else {
+                    fprintf(stderr, "Error: Unknown allocation policy '%s' (best-fit or first-fit)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                args->dedup = 1;
+                break;
+            case 'z':
+                args->compress = 1;
+                break;
+            case 'I':
+                if (strcmp(optarg, "auto") == 0) {
+                    args->io_backend = VSFS_IO_AUTO;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    args->io_backend = VSFS_IO_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    args->io_backend = VSFS_IO_THREADS;
+                } else if (strcmp(optarg, "sync") == 0) {
+                    args->io_backend = VSFS_IO_SYNC;
+                } else {
+                    fprintf(stderr, "Error: Unknown I/O backend '%s' (auto, uring, threads or sync)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'S':
+                if (optarg && strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Error: Unknown stats format '%s' (only json)\n", optarg);
+                    return -1;
+                }
+                args->stats = optarg ? 2 : 1;
                 break;
             default:
                 return -1;
         }
     }
-    
+
+    if (args->manifest_name && read_manifest(args, args->manifest_name) < 0) {
+        return -1;
+    }
+
     // validating arguments
-    if (!args->input_name || !args->output_name || !args->file_name) {
-        fprintf(stderr, "Usage: mkfs_adder --input <file> --output <file> --file <file>\n");
+    if (!args->input_name || (!!args->output_name + args->in_place + !!args->delta_name) != 1 || args->file_count == 0) {
+        fprintf(stderr, "Usage: mkfs_adder --input <file> (--output <file> | --in-place | --delta <file>) "
+                        "--file <file> [--file <file> ...] [--manifest <list|->] [--alloc best-fit|first-fit] [--dedup | --compress] "
+                        "[--io auto|uring|threads|sync] [--stats[=json]]\n");
         return -1;
     }
-    
+
+    // Dedup compares raw file blocks, which compressed files do not store
+    if (args->dedup && args->compress) {
+        fprintf(stderr, "Error: --dedup and --compress cannot be combined\n");
+        return -1;
+    }
+
     return 0;
 }
 
-uint32_t find_free_inode(uint8_t *inode_bitmap, uint32_t max_inodes) {
-    for (uint32_t i = 0; i < max_inodes; i++) {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_offset = i % 8;
-        if (!(inode_bitmap[byte_index] & (1 << bit_offset))) {
-            return i + 1; 
+// Moving from past bitmap blocks the summary shows full, without reading them
+uint64_t summary_skip(const uint32_t *summary, uint64_t nbits, uint64_t from) {
+    while (from < nbits && summary[from / BITS_PER_BLOCK] == 0) {
+        from = (from / BITS_PER_BLOCK + 1) * BITS_PER_BLOCK;
+    }
+    return from < nbits ? from : nbits;
+}
+
+// Finding first free inode at or after *hint; every bit below the hint is known used
+uint32_t find_free_inode(uint8_t *inode_bitmap, uint64_t max_inodes, uint64_t *hint) {
+    uint64_t i = bitmap_find_clear(inode_bitmap, max_inodes, *hint);
+    *hint = i;
+    return i < max_inodes ? i + 1 : 0;
+}
+
+// Finding first free data block at or after *hint
+uint64_t find_free_data_block(uint8_t *data_bitmap, uint64_t max_blocks, uint64_t *hint) {
+    uint64_t i = bitmap_find_clear(data_bitmap, max_blocks, *hint);
+    *hint = i;
+    return i < max_blocks ? i : UINT64_MAX;
+}
+
+void dir_free(dir_t *dir);
+void dcache_free(fs_image_t *fs);
+
+// Block I/O helpers
+int pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        vsfs_stats_syscall(VSFS_SYS_READ);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        vsfs_stats_bytes(n, 0);
+        p += n;
+        len -= n;
+        offset += n;
     }
-    return 0; 
+    return 0;
 }
 
-// Finding first free data block
-uint32_t find_free_data_block(uint8_t *data_bitmap, uint32_t max_blocks) {
-    for (uint32_t i = 0; i < max_blocks; i++) {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_offset = i % 8;
-        if (!(data_bitmap[byte_index] & (1 << bit_offset))) {
-            return i; 
+int pwrite_full(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        vsfs_stats_syscall(VSFS_SYS_WRITE);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n < 0) {
+            return -1;
+        }
+        vsfs_stats_bytes(0, n);
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Copying blocks out of and into the mapped image; blocks past the image fail with ERANGE
+int read_block(const vsfs_image_t *img, uint64_t block_no, void *buf) {
+    const uint8_t *src = vsfs_block(img, block_no);
+    if (!src) {
+        errno = ERANGE;
+        return -1;
     }
-    return UINT32_MAX; 
+    memcpy(buf, src, BS);
+    vsfs_stats_bytes(BS, 0);
+    return 0;
 }
 
-// Bitmap editing
-void set_bitmap_bit(uint8_t *bitmap, uint32_t bit_index) {
-    uint32_t byte_index = bit_index / 8;
-    uint32_t bit_offset = bit_index % 8;
-    bitmap[byte_index] |= (1 << bit_offset);
+int write_block(const vsfs_image_t *img, uint64_t block_no, const void *buf) {
+    uint8_t *dst = vsfs_block(img, block_no);
+    if (!dst) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (vsfs_overlay_claim(img, block_no, 1, 0) < 0) {
+        return -1;
+    }
+    memcpy(dst, buf, BS);
+    vsfs_stats_bytes(0, BS);
+    return 0;
 }
 
-// Root directory entries
-uint32_t count_directory_entries(uint8_t *root_data_block) {
-    uint32_t count = 0;
-    dirent64_t *entries = (dirent64_t *)root_data_block;
-    
-    for (uint32_t i = 0; i < BS / sizeof(dirent64_t); i++) {
-        if (entries[i].inode_no != 0) {
-            count++;
-        } else {
-            break; 
+void image_free(fs_image_t *fs) {
+    if (fs->itable) {
+        for (uint64_t i = 0; i < fs->sb->inode_table_blocks; i++) {
+            free(fs->itable[i]);
         }
     }
-    return count;
+    free(fs->itable);
+    free(fs->itable_dirty);
+    free(fs->inode_bitmap);
+    free(fs->data_bitmap);
+    free(fs->inode_bitmap_dirty);
+    free(fs->data_bitmap_dirty);
+    free(fs->summary);
+    free(fs->summary_dirty);
+    for (uint32_t i = 0; i < fs->dir_count; i++) {
+        dir_free(fs->dirs[i]);
+        free(fs->dirs[i]);
+    }
+    free(fs->dirs);
+    dcache_free(fs);
+    free(fs->runs);
+    free(fs->shares);
+    free(fs->shares_dirty);
+    free(fs->dedup_entries);
+    free(fs->dedup_buckets);
+    if (fs->dedup && fs->src_fd >= 0) {
+        close(fs->src_fd);
+    }
+    if (fs->spill) {
+        fclose(fs->spill);
+    }
+    free(fs->sb_block);
+    memset(fs, 0, sizeof(*fs));
 }
 
-int find_free_dirent_slot(uint8_t *root_data_block) {
-    dirent64_t *entries = (dirent64_t *)root_data_block;
-    
-    for (uint32_t i = 0; i < BS / sizeof(dirent64_t); i++) {
-        if (entries[i].inode_no == 0) {
-            return i;
+// Returning a pointer to an inode inside its cached inode table block
+inode_t *image_inode(fs_image_t *fs, uint32_t inode_num, int for_write) {
+    uint64_t index = (uint64_t)(inode_num - 1) * INODE_SIZE;
+    uint64_t tblock = index / BS;
+
+    if (tblock >= fs->sb->inode_table_blocks) {
+        fprintf(stderr, "Error: Inode %u outside the inode table\n", inode_num);
+        return NULL;
+    }
+    // Blocks past the high-water mark were never written and start out zero
+    int initialized = tblock < fs->sb->inode_table_init;
+    if (!fs->itable[tblock]) {
+        fs->itable[tblock] = initialized ? malloc(BS) : calloc(1, BS);
+        if (!fs->itable[tblock]) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        if (initialized && read_block(fs->img, fs->sb->inode_table_start + tblock, fs->itable[tblock]) < 0) {
+            perror("Failed to read inode table");
+            free(fs->itable[tblock]);
+            fs->itable[tblock] = NULL;
+            return NULL;
+        }
+    }
+    if (for_write) {
+        // Raising the mark writes zeros over every block it passes
+        for (uint64_t t = fs->sb->inode_table_init; t < tblock; t++) {
+            if (!fs->itable[t] && !(fs->itable[t] = calloc(1, BS))) {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+            fs->itable_dirty[t] = 1;
         }
+        if (!initialized) {
+            fs->sb->inode_table_init = tblock + 1;
+        }
+        fs->itable_dirty[tblock] = 1;
     }
-    return -1; 
+    return (inode_t *)(fs->itable[tblock] + index % BS);
 }
 
-int main(int argc, char *argv[]) {
-    crc32_init();
-    
-    // Parsing command line arguments
-    cli_args_t args;
-    if (parse_args(argc, argv, &args) < 0) {
-        return 1;
+// Marking data bits [i, i + len) used and handing the run to emit
+void claim_run(fs_image_t *fs, uint64_t i, uint64_t len, void (*emit)(void *ctx, uint64_t start, uint64_t len), void *ctx) {
+    uint32_t *summary = fs->summary + fs->sb->inode_bitmap_blocks;
+    for (uint64_t b = i; b < i + len; b++) {
+        set_bitmap_bit(fs->data_bitmap, b);
+        summary[b / BITS_PER_BLOCK]--;
     }
-    
-    struct stat file_stat;
-    if (stat(args.file_name, &file_stat) != 0) {
-        fprintf(stderr, "Error: File '%s' not found in working directory\n", args.file_name);
-        return 1;
+    for (uint64_t blk = i / BITS_PER_BLOCK; blk <= (i + len - 1) / BITS_PER_BLOCK; blk++) {
+        fs->data_bitmap_dirty[blk] = 1;
+        fs->summary_dirty[(fs->sb->inode_bitmap_blocks + blk) / SUMMARY_PER_BLOCK] = 1;
     }
-    
-    // Checking file type
-    if (!S_ISREG(file_stat.st_mode)) {
-        fprintf(stderr, "Error: '%s' is not a regular file\n", args.file_name);
-        return 1;
+    fs->sb->free_blocks -= len;
+    emit(ctx, fs->sb->data_region_start + i, len);
+}
+
+// Collecting free data-region runs first-fit, marking them used
+uint64_t allocate_first_fit(fs_image_t *fs, uint64_t count, void (*emit)(void *ctx, uint64_t start, uint64_t len), void *ctx) {
+    uint64_t nbits = fs->sb->data_region_blocks;
+    uint32_t *summary = fs->summary + fs->sb->inode_bitmap_blocks;
+    uint64_t found = 0;
+    fs->data_hint = summary_skip(summary, nbits, fs->data_hint);
+    uint64_t from = fs->data_hint;
+    uint64_t i = find_free_data_block(fs->data_bitmap, nbits, &fs->data_hint);
+    fs->bits_scanned += fs->data_hint - from;
+
+    while (found < count && i != UINT64_MAX) {
+        uint64_t end = bitmap_find_set(fs->data_bitmap, nbits, i);
+        uint64_t len = end - i < count - found ? end - i : count - found;
+        fs->bits_scanned += end - i;
+        claim_run(fs, i, len, emit, ctx);
+        found += len;
+        uint64_t next = summary_skip(summary, nbits, i + len);
+        from = next;
+        i = find_free_data_block(fs->data_bitmap, nbits, &next);
+        fs->bits_scanned += next - from;
     }
-    
-    FILE *input_file = fopen(args.input_name, "rb");
-    if (!input_file) {
-        perror("Failed to open input image");
-        return 1;
+    return found;
+}
+
+uint32_t run_bucket(uint64_t len) {
+    return 63 - (uint32_t)__builtin_clzll(len);
+}
+
+void run_link(fs_image_t *fs, uint64_t r) {
+    free_run_t *run = &fs->runs[r];
+    uint64_t *head = &fs->run_buckets[run_bucket(run->len)];
+    run->prev = RUN_NONE;
+    run->next = *head;
+    if (*head != RUN_NONE) {
+        fs->runs[*head].prev = r;
     }
-    
-    // Reading superblock
-    uint8_t *block = calloc(1, BS);
-    if (!block) {
+    *head = r;
+}
+
+void run_unlink(fs_image_t *fs, uint64_t r) {
+    free_run_t *run = &fs->runs[r];
+    if (run->prev != RUN_NONE) {
+        fs->runs[run->prev].next = run->next;
+    } else {
+        fs->run_buckets[run_bucket(run->len)] = run->next;
+    }
+    if (run->next != RUN_NONE) {
+        fs->runs[run->next].prev = run->prev;
+    }
+}
+
+// Indexing every free run of the data bitmap by size
+int free_runs_build(fs_image_t *fs) {
+    uint64_t nbits = fs->sb->data_region_blocks;
+    uint64_t cap = 64;
+
+    fs->runs = malloc(cap * sizeof(free_run_t));
+    if (!fs->runs) {
         perror("Memory allocation failed");
-        fclose(input_file);
-        return 1;
+        return -1;
     }
-    
-    if (fread(block, BS, 1, input_file) != 1) {
-        perror("Failed to read superblock");
-        free(block);
-        fclose(input_file);
-        return 1;
+    for (int b = 0; b < RUN_BUCKETS; b++) {
+        fs->run_buckets[b] = RUN_NONE;
     }
-    
-    superblock_t *sb = (superblock_t *)block;
-    
-    // Magic number validation
-    if (sb->magic != 0x4D565346) {
-        fprintf(stderr, "Error: Invalid MiniVSFS image format\n");
-        free(block);
-        fclose(input_file);
-        return 1;
+    fs->bits_scanned += nbits;
+    for (uint64_t i = bitmap_find_clear(fs->data_bitmap, nbits, 0); i < nbits;) {
+        uint64_t end = bitmap_find_set(fs->data_bitmap, nbits, i);
+        if (fs->run_count == cap) {
+            free_run_t *grown = realloc(fs->runs, cap * 2 * sizeof(free_run_t));
+            if (!grown) {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            fs->runs = grown;
+            cap *= 2;
+        }
+        fs->runs[fs->run_count] = (free_run_t){i, end - i, RUN_NONE, RUN_NONE};
+        run_link(fs, fs->run_count++);
+        i = bitmap_find_clear(fs->data_bitmap, nbits, end);
+    }
+    return 0;
+}
+
+// Smallest run of at least count blocks: within count's own bucket some runs
+// are too short, any run of a higher bucket fits
+uint64_t run_best_fit(const fs_image_t *fs, uint64_t count) {
+    for (uint32_t b = run_bucket(count); b < RUN_BUCKETS; b++) {
+        uint64_t best = RUN_NONE;
+        for (uint64_t r = fs->run_buckets[b]; r != RUN_NONE; r = fs->runs[r].next) {
+            uint64_t len = fs->runs[r].len;
+            if (len >= count && (best == RUN_NONE || len < fs->runs[best].len)) {
+                best = r;
+                if (len == count) {
+                    break;
+                }
+            }
+        }
+        if (best != RUN_NONE) {
+            return best;
+        }
+    }
+    return RUN_NONE;
+}
+
+uint64_t run_largest(const fs_image_t *fs) {
+    for (int b = RUN_BUCKETS - 1; b >= 0; b--) {
+        uint64_t best = RUN_NONE;
+        for (uint64_t r = fs->run_buckets[b]; r != RUN_NONE; r = fs->runs[r].next) {
+            if (best == RUN_NONE || fs->runs[r].len > fs->runs[best].len) {
+                best = r;
+            }
+        }
+        if (best != RUN_NONE) {
+            return best;
+        }
     }
-    
-    printf("Loading MiniVSFS image: %lu blocks, %lu inodes\n", sb->total_blocks, sb->inode_count);
-    
-    // Reading inode bitmap
-    uint8_t *inode_bitmap = calloc(1, BS);
-    if (!inode_bitmap) {
+    return RUN_NONE;
+}
+
+// Allocating up to count blocks from the front of run r; the remainder moves to its new bucket
+uint64_t run_take(fs_image_t *fs, uint64_t r, uint64_t count, void (*emit)(void *ctx, uint64_t start, uint64_t len), void *ctx) {
+    free_run_t *run = &fs->runs[r];
+    uint64_t take = run->len < count ? run->len : count;
+    claim_run(fs, run->start, take, emit, ctx);
+    run_unlink(fs, r);
+    run->start += take;
+    run->len -= take;
+    if (run->len > 0) {
+        run_link(fs, r);
+    }
+    return take;
+}
+
+// Best-fit over free runs; without a single fitting run, the largest runs
+// are taken first so the request ends up in as few fragments as possible
+uint64_t allocate_best_fit(fs_image_t *fs, uint64_t count, void (*emit)(void *ctx, uint64_t start, uint64_t len), void *ctx) {
+    if (!fs->runs && free_runs_build(fs) < 0) {
+        return 0;
+    }
+
+    uint64_t found = 0;
+    while (found < count) {
+        uint64_t r = run_best_fit(fs, count - found);
+        if (r == RUN_NONE) {
+            r = run_largest(fs);
+        }
+        if (r == RUN_NONE) {
+            break;
+        }
+        found += run_take(fs, r, count - found, emit, ctx);
+    }
+    return found;
+}
+
+uint64_t allocate_blocks(fs_image_t *fs, uint64_t count, void (*emit)(void *ctx, uint64_t start, uint64_t len), void *ctx) {
+    if (count == 0) {
+        return 0;
+    }
+    if (fs->alloc_policy == ALLOC_FIRST_FIT) {
+        return allocate_first_fit(fs, count, emit, ctx);
+    }
+    return allocate_best_fit(fs, count, emit, ctx);
+}
+
+// Appending blocks to a file's extent list; shared and freshly written blocks never share an extent
+void file_add_run(pending_file_t *pf, uint64_t start, uint64_t len, uint8_t fresh) {
+    while (len > 0) {
+        extent_t *last = pf->extent_count ? &pf->extents[pf->extent_count - 1] : NULL;
+        if (last && last->start + last->length == start && last->length < UINT32_MAX &&
+            pf->fresh[pf->extent_count - 1] == fresh) {
+            uint64_t grow = UINT32_MAX - last->length < len ? UINT32_MAX - last->length : len;
+            last->length += grow;
+            start += grow;
+            len -= grow;
+            continue;
+        }
+        uint64_t take = len < UINT32_MAX ? len : UINT32_MAX;
+        pf->extents[pf->extent_count].start = start;
+        pf->extents[pf->extent_count].length = take;
+        pf->fresh[pf->extent_count] = fresh;
+        pf->extent_count++;
+        start += take;
+        len -= take;
+    }
+}
+
+void emit_extent_run(void *ctx, uint64_t start, uint64_t len) {
+    file_add_run(ctx, start, len, 1);
+}
+
+void emit_one_block(void *ctx, uint64_t start, uint64_t len) {
+    (void)len;
+    *(uint64_t *)ctx = start;
+}
+
+void emit_index_run(void *ctx, uint64_t start, uint64_t len) {
+    pending_file_t *pf = ctx;
+    for (uint64_t i = 0; i < len; i++) {
+        pf->index_blocks[pf->index_count++] = start + i;
+    }
+}
+
+// Reading an inode's full extent list, plus the index blocks holding it
+int inode_read_extents(const vsfs_image_t *img, const inode_t *ino, extent_t **out, uint32_t *count,
+                       uint64_t *index_blocks, uint32_t *index_count) {
+    *out = NULL;
+    *count = 0;
+    *index_count = 0;
+    if (ino->extent_count == 0) {
+        return 0;
+    }
+
+    extent_t *list = malloc(ino->extent_count * sizeof(extent_t));
+    if (!list) {
         perror("Memory allocation failed");
-        free(block);
-        fclose(input_file);
-        return 1;
+        return -1;
     }
-    
-    fseek(input_file, sb->inode_bitmap_start * BS, SEEK_SET);
-    if (fread(inode_bitmap, BS, 1, input_file) != 1) {
-        perror("Failed to read inode bitmap");
-        free(block);
-        free(inode_bitmap);
-        fclose(input_file);
-        return 1;
+
+    if (ino->extent_count <= INODE_EXTENTS) {
+        memcpy(list, ino->extents, ino->extent_count * sizeof(extent_t));
+    } else {
+        uint8_t block[BS];
+        uint32_t filled = 0;
+        for (uint32_t i = 0; i < INODE_EXTENTS && filled < ino->extent_count; i++) {
+            uint32_t n = ino->extents[i].length;
+            if (n > EXTENTS_PER_BLOCK || n > ino->extent_count - filled ||
+                read_block(img, ino->extents[i].start, block) < 0) {
+                fprintf(stderr, "Error: Unreadable extent index block %lu\n", ino->extents[i].start);
+                free(list);
+                return -1;
+            }
+            memcpy(&list[filled], block, n * sizeof(extent_t));
+            filled += n;
+            index_blocks[(*index_count)++] = ino->extents[i].start;
+        }
+        if (filled != ino->extent_count) {
+            fprintf(stderr, "Error: Extent index does not match extent count\n");
+            free(list);
+            return -1;
+        }
+    }
+    *out = list;
+    *count = ino->extent_count;
+    return 0;
+}
+
+int dirent_name_equals(const dirent64_t *de, const char *name) {
+    return strncmp(de->name, name, sizeof(de->name)) == 0;
+}
+
+void dir_free(dir_t *dir) {
+    for (uint64_t i = 0; i < dir->nblocks; i++) {
+        free(dir->blocks[i]);
+    }
+    free(dir->blocks);
+    free(dir->phys);
+    free(dir->dirty);
+    free(dir->extents);
+    free(dir->index_buf);
+    memset(dir, 0, sizeof(*dir));
+}
+
+int dir_reserve(dir_t *dir, uint64_t nblocks) {
+    if (nblocks <= dir->cap) {
+        return 0;
+    }
+    uint64_t cap = dir->cap ? dir->cap : 4;
+    while (cap < nblocks) {
+        cap *= 2;
+    }
+    uint8_t **blocks = realloc(dir->blocks, cap * sizeof(uint8_t *));
+    if (blocks) {
+        dir->blocks = blocks;
+    }
+    uint64_t *phys = realloc(dir->phys, cap * sizeof(uint64_t));
+    if (phys) {
+        dir->phys = phys;
     }
-    
-    // Reading data bitmap
-    uint8_t *data_bitmap = calloc(1, BS);
-    if (!data_bitmap) {
+    uint8_t *dirty = realloc(dir->dirty, cap);
+    if (dirty) {
+        dir->dirty = dirty;
+    }
+    if (!blocks || !phys || !dirty) {
         perror("Memory allocation failed");
-        free(block);
-        free(inode_bitmap);
-        fclose(input_file);
-        return 1;
+        return -1;
     }
-    
-    fseek(input_file, sb->data_bitmap_start * BS, SEEK_SET);
-    if (fread(data_bitmap, BS, 1, input_file) != 1) {
-        perror("Failed to read data bitmap");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        fclose(input_file);
-        return 1;
+    dir->cap = cap;
+    return 0;
+}
+
+// Loading a directory's block map; block contents are read on first use
+int dir_open(fs_image_t *fs, dir_t *dir, uint32_t inode_num) {
+    memset(dir, 0, sizeof(*dir));
+    dir->inode_num = inode_num;
+
+    inode_t *ino = image_inode(fs, inode_num, 0);
+    if (!ino) {
+        return -1;
     }
-    
-    // Reading root inode
-    inode_t root_inode;
-    fseek(input_file, sb->inode_table_start * BS, SEEK_SET);
-    if (fread(&root_inode, sizeof(inode_t), 1, input_file) != 1) {
-        perror("Failed to read root inode");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        fclose(input_file);
-        return 1;
+    if (!(ino->flags & INODE_FL_EXTENTS)) {
+        fprintf(stderr, "Error: Directory inode %u is not extent mapped\n", inode_num);
+        return -1;
+    }
+    dir->htree = (ino->flags & INODE_FL_HTREE) != 0;
+
+    if (inode_read_extents(fs->img, ino, &dir->extents, &dir->extent_count,
+                           dir->index_blocks, &dir->index_count) < 0) {
+        return -1;
+    }
+
+    uint64_t nblocks = 0;
+    for (uint32_t i = 0; i < dir->extent_count; i++) {
+        nblocks += dir->extents[i].length;
     }
-    
-    // Reading root directory data block
-    uint8_t *root_data_block = calloc(1, BS);
-    if (!root_data_block) {
+    if (nblocks == 0 || dir_reserve(dir, nblocks) < 0) {
+        if (nblocks == 0) {
+            fprintf(stderr, "Error: Directory inode %u has no blocks\n", inode_num);
+        }
+        dir_free(dir);
+        return -1;
+    }
+
+    uint64_t l = 0;
+    for (uint32_t i = 0; i < dir->extent_count; i++) {
+        for (uint32_t j = 0; j < dir->extents[i].length; j++, l++) {
+            dir->phys[l] = dir->extents[i].start + j;
+            dir->blocks[l] = NULL;
+            dir->dirty[l] = 0;
+        }
+    }
+    dir->nblocks = nblocks;
+    dir->disk_nblocks = nblocks;
+    return 0;
+}
+
+// Returning a directory block, reading it from the image on first use
+uint8_t *dir_block(fs_image_t *fs, dir_t *dir, uint64_t logical, int for_write) {
+    if (logical >= dir->nblocks) {
+        fprintf(stderr, "Error: Directory block %lu out of range\n", logical);
+        return NULL;
+    }
+    if (!dir->blocks[logical]) {
+        dir->blocks[logical] = malloc(BS);
+        if (!dir->blocks[logical]) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        if (read_block(fs->img, dir->phys[logical], dir->blocks[logical]) < 0) {
+            perror("Failed to read directory block");
+            free(dir->blocks[logical]);
+            dir->blocks[logical] = NULL;
+            return NULL;
+        }
+    }
+    if (for_write) {
+        dir->dirty[logical] = 1;
+    }
+    return dir->blocks[logical];
+}
+
+// Appending an empty block; its physical location is chosen by dir_finalize()
+int64_t dir_new_block(dir_t *dir) {
+    if (dir->nblocks >= UINT32_MAX || dir_reserve(dir, dir->nblocks + 1) < 0) {
+        return -1;
+    }
+    uint64_t l = dir->nblocks;
+    dir->blocks[l] = calloc(1, BS);
+    if (!dir->blocks[l]) {
         perror("Memory allocation failed");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        fclose(input_file);
-        return 1;
+        return -1;
     }
-    
-    fseek(input_file, root_inode.direct[0] * BS, SEEK_SET);
-    if (fread(root_data_block, BS, 1, input_file) != 1) {
-        perror("Failed to read root directory data");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+    dir->phys[l] = 0;
+    dir->dirty[l] = 1;
+    dir->nblocks++;
+    return (int64_t)l;
+}
+
+// Walking the index from the root to the leaf that covers hash h
+int dx_find_leaf(fs_image_t *fs, dir_t *dir, uint32_t h, uint64_t *leaf, uint64_t *parent) {
+    uint8_t *root = dir_block(fs, dir, 0, 0);
+    if (!root) {
+        return -1;
     }
-    
-    uint32_t new_inode_num = find_free_inode(inode_bitmap, sb->inode_count);
-    if (new_inode_num == 0) {
-        fprintf(stderr, "Error: No free inodes available\n");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+    dx_header_t *hdr = dx_header(root, 0);
+    if (hdr->magic != DX_MAGIC || hdr->count == 0) {
+        fprintf(stderr, "Error: Corrupt directory index in inode %u\n", dir->inode_num);
+        return -1;
     }
-    
-    // Calculating required blocks
-    uint64_t file_size = file_stat.st_size;
-    uint32_t blocks_needed = (file_size + BS - 1) / BS; 
-    
-    if (blocks_needed > DIRECT_MAX) {
-        fprintf(stderr, "Error: File too large (requires %u blocks, max %d supported)\n", 
-                blocks_needed, DIRECT_MAX);
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+    *parent = 0;
+    *leaf = dx_entries(hdr)[dx_search(hdr, h)].block;
+
+    if (hdr->levels == 1) {
+        uint8_t *node = dir_block(fs, dir, *leaf, 0);
+        if (!node) {
+            return -1;
+        }
+        dx_header_t *nhdr = dx_header(node, *leaf);
+        if (nhdr->magic != DX_MAGIC || nhdr->count == 0) {
+            fprintf(stderr, "Error: Corrupt directory index node in inode %u\n", dir->inode_num);
+            return -1;
+        }
+        *parent = *leaf;
+        *leaf = dx_entries(nhdr)[dx_search(nhdr, h)].block;
     }
-    
-    uint32_t data_blocks[DIRECT_MAX];
-    uint32_t found_blocks = 0;
-    
-    for (uint32_t i = 0; i < sb->data_region_blocks && found_blocks < blocks_needed; i++) {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_offset = i % 8;
-        if (!(data_bitmap[byte_index] & (1 << bit_offset))) {
-            data_blocks[found_blocks++] = i;
-        }
-    }
-    
-    if (found_blocks < blocks_needed) {
-        fprintf(stderr, "Error: Not enough free data blocks (need %u, found %u)\n", 
-                blocks_needed, found_blocks);
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+    return 0;
+}
+
+// Looking a name up: returns its inode number, 0 if absent, -1 on error
+int64_t dir_lookup(fs_image_t *fs, dir_t *dir, const char *name, uint8_t *type) {
+    uint64_t first = 0, last = 0;
+
+    if (dir->htree) {
+        uint64_t parent;
+        if (dx_find_leaf(fs, dir, dirent_name_hash(name), &first, &parent) < 0) {
+            return -1;
+        }
+        last = first;
+    } else {
+        last = dir->nblocks - 1;
     }
-    
-    int free_dirent_slot = find_free_dirent_slot(root_data_block);
-    if (free_dirent_slot == -1) {
-        fprintf(stderr, "Error: No free directory entry slots in root directory\n");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+
+    for (uint64_t l = first; l <= last; l++) {
+        dirent64_t *entries = (dirent64_t *)dir_block(fs, dir, l, 0);
+        if (!entries) {
+            return -1;
+        }
+        for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no != 0 && dirent_name_equals(&entries[i], name)) {
+                if (type) {
+                    *type = entries[i].type;
+                }
+                return entries[i].inode_no;
+            }
+        }
     }
-    
-    FILE *add_file = fopen(args.file_name, "rb");
-    if (!add_file) {
-        perror("Failed to open file to add");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(input_file);
-        return 1;
+    return 0;
+}
+
+// Inserting (hash, block) into an index block, splitting or deepening as needed
+int dx_insert(fs_image_t *fs, dir_t *dir, uint64_t index_logical, uint32_t h, uint32_t block) {
+    uint8_t *ib = dir_block(fs, dir, index_logical, 1);
+    if (!ib) {
+        return -1;
     }
-    
-    fclose(input_file);
-    
-struct stat out_stat;
-if (stat(args.output_name, &out_stat) == 0) {
-    fprintf(stderr, "Error: output image '%s' already exists. Choose a different name or remove it.\n", args.output_name);
-    free(block);
-    free(inode_bitmap);
-    free(data_bitmap);
-    free(root_data_block);
-    fclose(add_file);
-    fclose(input_file);
-    return 1;
-}
-    FILE *output_file = fopen(args.output_name, "wb");
-    if (!output_file) {
-        perror("Failed to create output image");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(add_file);
-        return 1;
+    dx_header_t *hdr = dx_header(ib, index_logical);
+    dx_entry_t *e = dx_entries(hdr);
+
+    if (hdr->count == hdr->limit) {
+        if (index_logical == 0 && hdr->levels == 0) {
+            // Root is full of leaf pointers: push them down into a new index node
+            int64_t node = dir_new_block(dir);
+            if (node < 0) {
+                return -1;
+            }
+            uint8_t *nb = dir->blocks[node];
+            ib = dir->blocks[0];
+            hdr = dx_header(ib, 0);
+            e = dx_entries(hdr);
+            dx_header_t *nhdr = dx_header(nb, node);
+            nhdr->magic = DX_MAGIC;
+            nhdr->levels = 0;
+            nhdr->count = hdr->count;
+            nhdr->limit = DX_NODE_LIMIT;
+            memcpy(dx_entries(nhdr), e, hdr->count * sizeof(dx_entry_t));
+            hdr->levels = 1;
+            hdr->count = 1;
+            e[0].hash = 0;
+            e[0].block = (uint32_t)node;
+            return dx_insert(fs, dir, node, h, block);
+        }
+        if (index_logical == 0) {
+            fprintf(stderr, "Error: Directory index of inode %u is full\n", dir->inode_num);
+            return -1;
+        }
+
+        // Splitting a full index node in half and linking the upper half from the root
+        int64_t sib = dir_new_block(dir);
+        if (sib < 0) {
+            return -1;
+        }
+        ib = dir->blocks[index_logical];
+        hdr = dx_header(ib, index_logical);
+        e = dx_entries(hdr);
+        dx_header_t *shdr = dx_header(dir->blocks[sib], sib);
+        uint32_t keep = hdr->count / 2;
+        shdr->magic = DX_MAGIC;
+        shdr->levels = 0;
+        shdr->count = hdr->count - keep;
+        shdr->limit = DX_NODE_LIMIT;
+        memcpy(dx_entries(shdr), &e[keep], shdr->count * sizeof(dx_entry_t));
+        hdr->count = keep;
+        uint32_t sib_hash = dx_entries(shdr)[0].hash;
+        if (dx_insert(fs, dir, 0, sib_hash, (uint32_t)sib) < 0) {
+            return -1;
+        }
+        return dx_insert(fs, dir, h >= sib_hash ? (uint64_t)sib : index_logical, h, block);
     }
-    
-    input_file = fopen(args.input_name, "rb");
-    if (!input_file) {
-        perror("Failed to reopen input image");
-        free(block);
-        free(inode_bitmap);
-        free(data_bitmap);
-        free(root_data_block);
-        fclose(add_file);
-        fclose(output_file);
-        return 1;
+
+    uint32_t pos = hdr->count;
+    while (pos > 0 && e[pos - 1].hash > h) {
+        e[pos] = e[pos - 1];
+        pos--;
     }
-    
-    uint8_t *copy_buffer = malloc(BS);
-    for (uint64_t i = 0; i < sb->total_blocks; i++) {
-        if (fread(copy_buffer, BS, 1, input_file) != 1) {
-            perror("Failed to read block during copy");
-            free(block);
-            free(inode_bitmap);
-            free(data_bitmap);
-            free(root_data_block);
-            free(copy_buffer);
-            fclose(add_file);
-            fclose(input_file);
-            fclose(output_file);
-            return 1;
-        }
-        if (fwrite(copy_buffer, BS, 1, output_file) != 1) {
-            perror("Failed to write block during copy");
-            free(block);
-            free(inode_bitmap);
-            free(data_bitmap);
-            free(root_data_block);
-            free(copy_buffer);
-            fclose(add_file);
-            fclose(input_file);
-            fclose(output_file);
-            return 1;
-        }
-    }
-    free(copy_buffer);
-    fclose(input_file);
-    
-    // Output image modification
-    
-    // Updating output inode bitmap
-    set_bitmap_bit(inode_bitmap, new_inode_num - 1); 
-    fseek(output_file, sb->inode_bitmap_start * BS, SEEK_SET);
-    fwrite(inode_bitmap, BS, 1, output_file);
-    
-    // Updating output data bitmap
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        set_bitmap_bit(data_bitmap, data_blocks[i]);
-    }
-    fseek(output_file, sb->data_bitmap_start * BS, SEEK_SET);
-    fwrite(data_bitmap, BS, 1, output_file);
-    
-    // Creating new inodes
-    inode_t new_inode;
-    memset(&new_inode, 0, sizeof(inode_t));
-    
-    new_inode.mode = 0100000;
-    new_inode.links = 1;
-    new_inode.uid = 0;
-    new_inode.gid = 0;
-    new_inode.size_bytes = file_size;
-    
-    time_t now = time(NULL);
-    new_inode.atime = now;
-    new_inode.mtime = now;
-    new_inode.ctime = now;
-    
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        new_inode.direct[i] = sb->data_region_start + data_blocks[i];
-    }
-    for (uint32_t i = blocks_needed; i < DIRECT_MAX; i++) {
-        new_inode.direct[i] = 0;
-    }
-    
-    new_inode.reserved_0 = 0;
-    new_inode.reserved_1 = 0;
-    new_inode.reserved_2 = 0;
-    new_inode.proj_id = 1;
-    new_inode.uid16_gid16 = 0;
-    new_inode.xattr_ptr = 0;
-    
-    inode_crc_finalize(&new_inode);
-    
-    // Writing new inode to inode table
-    uint64_t inode_offset = sb->inode_table_start * BS + (new_inode_num - 1) * sizeof(inode_t);
-    fseek(output_file, inode_offset, SEEK_SET);
-    fwrite(&new_inode, sizeof(inode_t), 1, output_file);
-    
-    // Updating root directory entry count
-    root_inode.links++;
-    root_inode.size_bytes += sizeof(dirent64_t);
-    root_inode.mtime = now;
-    inode_crc_finalize(&root_inode);
-    
-    // Writing updated root inode
-    fseek(output_file, sb->inode_table_start * BS, SEEK_SET);
-    fwrite(&root_inode, sizeof(inode_t), 1, output_file);
-    
-    // Adding directory entry for new file
-    dirent64_t *entries = (dirent64_t *)root_data_block;
-    entries[free_dirent_slot].inode_no = new_inode_num;
-    entries[free_dirent_slot].type = 1;
-    strncpy(entries[free_dirent_slot].name, args.file_name, 57);
-    entries[free_dirent_slot].name[57] = '\0';
-    dirent_checksum_finalize(&entries[free_dirent_slot]);
-    
-    // Writing updated root directory data
-    fseek(output_file, root_inode.direct[0] * BS, SEEK_SET);
-    fwrite(root_data_block, BS, 1, output_file);
-    
-    // Writing file data blocks
-    uint8_t *file_buffer = malloc(BS);
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        memset(file_buffer, 0, BS);
-        
-        size_t bytes_to_read = BS;
-        if (i == blocks_needed - 1) {
-            bytes_to_read = file_size - (i * BS);
-        }
-        
-        size_t bytes_read = fread(file_buffer, 1, bytes_to_read, add_file);
-        if (bytes_read != bytes_to_read) {
-            perror("Failed to read file data");
-            free(block);
-            free(inode_bitmap);
-            free(data_bitmap);
-            free(root_data_block);
-            free(file_buffer);
-            fclose(add_file);
-            fclose(output_file);
-            return 1;
-        }
-        
-        fseek(output_file, (sb->data_region_start + data_blocks[i]) * BS, SEEK_SET);
-        fwrite(file_buffer, BS, 1, output_file);
-    }
-    
-// Updating superblock mtime and checksum after modifications
-sb->mtime_epoch = now;
-superblock_crc_finalize(sb);
-fseek(output_file, 0, SEEK_SET);
-fwrite(block, BS, 1, output_file);
-
-    free(block);
-    free(inode_bitmap);
-    free(data_bitmap);
-    free(root_data_block);
-    free(file_buffer);
-    fclose(add_file);
-    fclose(output_file);
-    
-    printf("File '%s' added successfully to MiniVSFS image\n", args.file_name);
-    printf("Allocated inode: %u\n", new_inode_num);
-    printf("Allocated %u data blocks\n", blocks_needed);
-    
+    e[pos].hash = h;
+    e[pos].block = block;
+    hdr->count++;
     return 0;
-}
\ No newline at end of file
+}
+
+int dirent_hash_cmp(const void *a, const void *b) {
+    uint32_t ha = dirent_name_hash(((const dirent64_t *)a)->name);
+    uint32_t hb = dirent_name_hash(((const dirent64_t *)b)->name);
+    return ha < hb ? -1 : ha > hb;
+}
+
+// Spreading entries over two leaves by hash; returns the lowest hash of the upper leaf
+int dx_split_entries(dirent64_t *entries, uint32_t n, dirent64_t *lower, dirent64_t *upper, uint32_t *split_hash) {
+    qsort(entries, n, sizeof(dirent64_t), dirent_hash_cmp);
+
+    // Entries sharing a hash must stay in one leaf
+    uint32_t mid = n / 2;
+    while (mid < n && dirent_name_hash(entries[mid].name) == dirent_name_hash(entries[mid - 1].name)) {
+        mid++;
+    }
+    if (mid == n) {
+        mid = n / 2;
+        while (mid > 0 && dirent_name_hash(entries[mid].name) == dirent_name_hash(entries[mid - 1].name)) {
+            mid--;
+        }
+        if (mid == 0) {
+            fprintf(stderr, "Error: Too many directory entries share one name hash\n");
+            return -1;
+        }
+    }
+
+    memcpy(lower, entries, mid * sizeof(dirent64_t));
+    memcpy(upper, &entries[mid], (n - mid) * sizeof(dirent64_t));
+    *split_hash = dirent_name_hash(entries[mid].name);
+    return 0;
+}
+
+// Turning a full single-block directory into a hashed one with two leaves
+int dir_make_htree(fs_image_t *fs, dir_t *dir) {
+    uint8_t *b0 = dir_block(fs, dir, 0, 1);
+    if (!b0) {
+        return -1;
+    }
+    dirent64_t moved[DIRENTS_PER_BLOCK];
+    uint32_t n = 0;
+    dirent64_t *entries = (dirent64_t *)b0;
+    for (int i = 2; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no != 0) {
+            moved[n++] = entries[i];
+        }
+    }
+
+    int64_t l1 = dir_new_block(dir);
+    int64_t l2 = dir_new_block(dir);
+    if (l1 < 0 || l2 < 0) {
+        return -1;
+    }
+
+    uint32_t split_hash;
+    if (dx_split_entries(moved, n, (dirent64_t *)dir->blocks[l1], (dirent64_t *)dir->blocks[l2], &split_hash) < 0) {
+        return -1;
+    }
+
+    // Block 0 keeps "." and ".." followed by the index root
+    b0 = dir->blocks[0];
+    memset(b0 + DX_ROOT_OFFSET, 0, BS - DX_ROOT_OFFSET);
+    dx_header_t *hdr = dx_header(b0, 0);
+    hdr->magic = DX_MAGIC;
+    hdr->levels = 0;
+    hdr->count = 2;
+    hdr->limit = DX_ROOT_LIMIT;
+    dx_entries(hdr)[0].hash = 0;
+    dx_entries(hdr)[0].block = (uint32_t)l1;
+    dx_entries(hdr)[1].hash = split_hash;
+    dx_entries(hdr)[1].block = (uint32_t)l2;
+
+    inode_t *ino = image_inode(fs, dir->inode_num, 1);
+    if (!ino) {
+        return -1;
+    }
+    ino->flags |= INODE_FL_HTREE;
+    inode_crc_finalize(ino);
+    dir->htree = 1;
+    return 0;
+}
+
+// Adding a finalized dirent; the caller has already checked for duplicates
+int dir_add(fs_image_t *fs, dir_t *dir, const dirent64_t *de) {
+    for (;;) {
+        uint64_t leaf = 0, parent = 0;
+        if (dir->htree && dx_find_leaf(fs, dir, dirent_name_hash(de->name), &leaf, &parent) < 0) {
+            return -1;
+        }
+
+        dirent64_t *entries = (dirent64_t *)dir_block(fs, dir, leaf, 0);
+        if (!entries) {
+            return -1;
+        }
+        for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) {
+                entries[i] = *de;
+                dir->dirty[leaf] = 1;
+                return 0;
+            }
+        }
+
+        if (!dir->htree) {
+            if (dir_make_htree(fs, dir) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Leaf full: move the upper half (by hash) to a new leaf, then retry
+        int64_t sib = dir_new_block(dir);
+        if (sib < 0) {
+            return -1;
+        }
+        dirent64_t all[DIRENTS_PER_BLOCK];
+        memcpy(all, dir->blocks[leaf], BS);
+        memset(dir->blocks[leaf], 0, BS);
+        uint32_t split_hash;
+        if (dx_split_entries(all, DIRENTS_PER_BLOCK, (dirent64_t *)dir->blocks[leaf],
+                             (dirent64_t *)dir->blocks[sib], &split_hash) < 0) {
+            return -1;
+        }
+        dir->dirty[leaf] = 1;
+        if (dx_insert(fs, dir, parent, split_hash, (uint32_t)sib) < 0) {
+            return -1;
+        }
+    }
+}
+
+void emit_dir_run(void *ctx, uint64_t start, uint64_t len) {
+    dir_t *dir = ctx;
+    for (uint64_t i = 0; i < len; i++) {
+        dir->phys[dir->nalloc++] = start + i;
+    }
+}
+
+void emit_dir_index_run(void *ctx, uint64_t start, uint64_t len) {
+    dir_t *dir = ctx;
+    for (uint64_t i = 0; i < len; i++) {
+        dir->index_blocks[dir->index_count++] = start + i;
+    }
+}
+
+// Placing blocks added during planning and rebuilding the directory's extent map
+int dir_finalize(fs_image_t *fs, dir_t *dir) {
+    if (dir->nblocks == dir->disk_nblocks) {
+        return 0;
+    }
+
+    dir->nalloc = dir->disk_nblocks;
+    uint64_t need = dir->nblocks - dir->disk_nblocks;
+    if (allocate_blocks(fs, need, emit_dir_run, dir) < need) {
+        fprintf(stderr, "Error: Not enough free data blocks to grow directory inode %u\n", dir->inode_num);
+        return -1;
+    }
+
+    // Worst case every block is its own run
+    extent_t *list = realloc(dir->extents, dir->nblocks * sizeof(extent_t));
+    if (!list) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    dir->extents = list;
+    dir->extent_count = 0;
+    for (uint64_t l = 0; l < dir->nblocks; l++) {
+        extent_t *last = dir->extent_count ? &dir->extents[dir->extent_count - 1] : NULL;
+        if (last && dir->phys[l] == last->start + last->length && last->length < UINT32_MAX) {
+            last->length++;
+        } else {
+            dir->extents[dir->extent_count].start = dir->phys[l];
+            dir->extents[dir->extent_count].length = 1;
+            dir->extent_count++;
+        }
+    }
+
+    uint32_t index_needed = 0;
+    if (dir->extent_count > INODE_EXTENTS) {
+        index_needed = (dir->extent_count + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+        if (index_needed > INODE_EXTENTS) {
+            fprintf(stderr, "Error: Directory inode %u too fragmented (%u extents)\n",
+                    dir->inode_num, dir->extent_count);
+            return -1;
+        }
+        // Existing index blocks are reused, extra ones allocated
+        if (index_needed > dir->index_count &&
+            allocate_blocks(fs, index_needed - dir->index_count, emit_dir_index_run, dir) <
+                index_needed - dir->index_count) {
+            fprintf(stderr, "Error: Not enough free data blocks for the extent index\n");
+            return -1;
+        }
+    }
+
+    inode_t *ino = image_inode(fs, dir->inode_num, 1);
+    if (!ino) {
+        return -1;
+    }
+    memset(ino->extents, 0, sizeof(ino->extents));
+    ino->extent_count = dir->extent_count;
+    if (index_needed == 0) {
+        memcpy(ino->extents, dir->extents, dir->extent_count * sizeof(extent_t));
+    } else {
+        for (uint32_t i = 0; i < index_needed; i++) {
+            uint32_t remaining = dir->extent_count - i * EXTENTS_PER_BLOCK;
+            ino->extents[i].start = dir->index_blocks[i];
+            ino->extents[i].length = remaining < EXTENTS_PER_BLOCK ? remaining : EXTENTS_PER_BLOCK;
+        }
+    }
+    inode_crc_finalize(ino);
+    dir->index_dirty = index_needed;
+    dir->disk_nblocks = dir->nblocks;
+    return 0;
+}
+
+int block_list_push(block_list_t *list, uint64_t target, uint8_t *block) {
+    if (list->count == list->capacity) {
+        uint64_t cap = list->capacity ? list->capacity * 2 : 64;
+        uint64_t *targets = realloc(list->targets, cap * sizeof(uint64_t));
+        if (targets) {
+            list->targets = targets;
+        }
+        uint8_t **blocks = realloc(list->blocks, cap * sizeof(uint8_t *));
+        if (blocks) {
+            list->blocks = blocks;
+        }
+        if (!targets || !blocks) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        list->capacity = cap;
+    }
+    list->targets[list->count] = target;
+    list->blocks[list->count] = block;
+    list->count++;
+    return 0;
+}
+
+void block_list_free(block_list_t *list) {
+    free(list->targets);
+    free(list->blocks);
+    memset(list, 0, sizeof(*list));
+}
+
+// Queueing changed directory blocks and, if it grew, its rebuilt extent index
+int dir_collect(dir_t *dir, block_list_t *list) {
+    for (uint64_t l = 0; l < dir->nblocks; l++) {
+        if (dir->dirty[l] && block_list_push(list, dir->phys[l], dir->blocks[l]) < 0) {
+            return -1;
+        }
+    }
+
+    if (dir->index_dirty == 0) {
+        return 0;
+    }
+    dir->index_buf = calloc(dir->index_dirty, BS);
+    if (!dir->index_buf) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    for (uint32_t i = 0; i < dir->index_dirty; i++) {
+        uint32_t first = i * EXTENTS_PER_BLOCK;
+        uint32_t n = dir->extent_count - first < EXTENTS_PER_BLOCK ? dir->extent_count - first : EXTENTS_PER_BLOCK;
+        uint8_t *block = dir->index_buf + (uint64_t)i * BS;
+        memcpy(block, &dir->extents[first], n * sizeof(extent_t));
+        if (block_list_push(list, dir->index_blocks[i], block) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t dcache_bucket(const fs_image_t *fs, uint32_t parent, uint32_t hash) {
+    return (hash ^ parent * 0x9E3779B1u) & (fs->dcache_buckets - 1);
+}
+
+dentry_t *dcache_find(fs_image_t *fs, uint32_t parent, const char *name) {
+    if (fs->dcache_count == 0) {
+        return NULL;
+    }
+    uint32_t h = dirent_name_hash(name);
+    for (dentry_t *d = fs->dcache[dcache_bucket(fs, parent, h)]; d; d = d->next) {
+        if (d->hash == h && d->parent == parent && strncmp(d->name, name, sizeof(d->name)) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Caching a directory entry, doubling the bucket array once it averages one entry per bucket
+dentry_t *dcache_insert(fs_image_t *fs, uint32_t parent, const char *name, uint32_t inode_no) {
+    if (fs->dcache_count >= fs->dcache_buckets) {
+        uint64_t old_buckets = fs->dcache_buckets;
+        dentry_t **old = fs->dcache;
+        uint64_t buckets = old_buckets ? old_buckets * 2 : 256;
+        dentry_t **table = calloc(buckets, sizeof(dentry_t *));
+        if (!table) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        fs->dcache = table;
+        fs->dcache_buckets = buckets;
+        for (uint64_t b = 0; b < old_buckets; b++) {
+            while (old[b]) {
+                dentry_t *d = old[b];
+                old[b] = d->next;
+                uint64_t nb = dcache_bucket(fs, d->parent, d->hash);
+                d->next = table[nb];
+                table[nb] = d;
+            }
+        }
+        free(old);
+    }
+
+    dentry_t *d = calloc(1, sizeof(*d));
+    if (!d) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    d->parent = parent;
+    d->inode_no = inode_no;
+    d->hash = dirent_name_hash(name);
+    strncpy(d->name, name, sizeof(d->name) - 1);
+    uint64_t b = dcache_bucket(fs, parent, d->hash);
+    d->next = fs->dcache[b];
+    fs->dcache[b] = d;
+    fs->dcache_count++;
+    return d;
+}
+
+void dcache_free(fs_image_t *fs) {
+    for (uint64_t b = 0; b < fs->dcache_buckets; b++) {
+        while (fs->dcache[b]) {
+            dentry_t *d = fs->dcache[b];
+            fs->dcache[b] = d->next;
+            free(d);
+        }
+    }
+    free(fs->dcache);
+    fs->dcache = NULL;
+    fs->dcache_buckets = 0;
+    fs->dcache_count = 0;
+}
+
+// Registering a directory handle so it is finalized, flushed and freed with the image
+dir_t *image_track_dir(fs_image_t *fs) {
+    if (fs->dir_count == fs->dir_capacity) {
+        uint32_t cap = fs->dir_capacity ? fs->dir_capacity * 2 : 8;
+        dir_t **dirs = realloc(fs->dirs, cap * sizeof(dir_t *));
+        if (!dirs) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        fs->dirs = dirs;
+        fs->dir_capacity = cap;
+    }
+    dir_t *dir = calloc(1, sizeof(dir_t));
+    if (!dir) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    fs->dirs[fs->dir_count++] = dir;
+    return dir;
+}
+
+dir_t *image_open_dir(fs_image_t *fs, uint32_t inode_num) {
+    dir_t *dir = image_track_dir(fs);
+    if (!dir) {
+        return NULL;
+    }
+    if (dir_open(fs, dir, inode_num) < 0) {
+        return NULL;
+    }
+    return dir;
+}
+
+// Linking inode_num into dir under name; the parent counts one more link and entry
+int dir_link(fs_image_t *fs, dir_t *dir, const char *name, uint32_t inode_num, uint8_t type, time_t now) {
+    inode_t *parent = image_inode(fs, dir->inode_num, 1);
+    if (!parent) {
+        return -1;
+    }
+    parent->links++;
+    parent->size_bytes += sizeof(dirent64_t);
+    parent->mtime = now;
+    inode_crc_finalize(parent);
+
+    dirent64_t de;
+    memset(&de, 0, sizeof(de));
+    de.inode_no = inode_num;
+    de.type = type;
+    strncpy(de.name, name, sizeof(de.name) - 1);
+    dirent_checksum_finalize(&de);
+    return dir_add(fs, dir, &de);
+}
+
+// Allocating an inode with the bitmap hint and marking it used
+uint32_t image_alloc_inode(fs_image_t *fs) {
+    fs->inode_hint = summary_skip(fs->summary, fs->sb->inode_count, fs->inode_hint);
+    uint64_t from = fs->inode_hint;
+    uint32_t inode_num = find_free_inode(fs->inode_bitmap, fs->sb->inode_count, &fs->inode_hint);
+    fs->bits_scanned += fs->inode_hint - from;
+    if (inode_num == 0) {
+        fprintf(stderr, "Error: No free inodes available\n");
+        return 0;
+    }
+    set_bitmap_bit(fs->inode_bitmap, inode_num - 1);
+    fs->inode_bitmap_dirty[(inode_num - 1) / BITS_PER_BLOCK] = 1;
+    fs->summary[(inode_num - 1) / BITS_PER_BLOCK]--;
+    fs->summary_dirty[(inode_num - 1) / BITS_PER_BLOCK / SUMMARY_PER_BLOCK] = 1;
+    fs->sb->free_inodes--;
+    return inode_num;
+}
+
+// Creating an empty directory under parent; its block is placed by dir_finalize()
+dir_t *dir_mkdir(fs_image_t *fs, dir_t *parent, const char *name, time_t now) {
+    uint32_t inode_num = image_alloc_inode(fs);
+    if (inode_num == 0) {
+        return NULL;
+    }
+    inode_t *ino = image_inode(fs, inode_num, 1);
+    dir_t *dir = ino ? image_track_dir(fs) : NULL;
+    if (!dir) {
+        return NULL;
+    }
+
+    memset(ino, 0, sizeof(inode_t));
+    ino->mode = 0040000;
+    ino->links = 2;
+    ino->size_bytes = 2 * sizeof(dirent64_t);
+    ino->atime = now;
+    ino->mtime = now;
+    ino->ctime = now;
+    ino->flags = INODE_FL_EXTENTS;
+    ino->proj_id = 1;
+    inode_crc_finalize(ino);
+
+    dir->inode_num = inode_num;
+    if (dir_new_block(dir) < 0) {
+        return NULL;
+    }
+    dirent64_t *entries = (dirent64_t *)dir->blocks[0];
+    entries[0].inode_no = inode_num;
+    entries[0].type = DIRENT_DIR;
+    strcpy(entries[0].name, ".");
+    entries[1].inode_no = parent->inode_num;
+    entries[1].type = DIRENT_DIR;
+    strcpy(entries[1].name, "..");
+    dirent_checksum_finalize(&entries[0]);
+    dirent_checksum_finalize(&entries[1]);
+
+    if (dir_link(fs, parent, name, inode_num, DIRENT_DIR, now) < 0) {
+        return NULL;
+    }
+    return dir;
+}
+
+// Descending one path component from dir, through the dentry cache, creating it if missing
+dir_t *dir_walk(fs_image_t *fs, dir_t *dir, const char *name, const char *path, time_t now) {
+    dentry_t *d = dcache_find(fs, dir->inode_num, name);
+    if (d) {
+        if (!d->dir) {
+            d->dir = image_open_dir(fs, d->inode_no);
+        }
+        return d->dir;
+    }
+
+    uint8_t type = 0;
+    int64_t found = dir_lookup(fs, dir, name, &type);
+    if (found < 0) {
+        return NULL;
+    }
+    dir_t *child;
+    if (found == 0) {
+        child = dir_mkdir(fs, dir, name, now);
+    } else if (type != DIRENT_DIR) {
+        fprintf(stderr, "Error: '%s' in '%s' is not a directory\n", name, path);
+        return NULL;
+    } else {
+        child = image_open_dir(fs, (uint32_t)found);
+    }
+    if (!child) {
+        return NULL;
+    }
+
+    d = dcache_insert(fs, dir->inode_num, name, child->inode_num);
+    if (!d) {
+        return NULL;
+    }
+    d->dir = child;
+    return child;
+}
+
+// Resolving every directory component of path (mkdir on demand); *leaf points at the last one
+dir_t *resolve_parent(fs_image_t *fs, const char *path, char *buf, const char **leaf, time_t now) {
+    strcpy(buf, path);
+    dir_t *dir = fs->dirs[0];
+    char *name = NULL;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(buf, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+        if (strcmp(tok, ".") == 0) {
+            continue;
+        }
+        if (strcmp(tok, "..") == 0) {
+            fprintf(stderr, "Error: '..' is not allowed in '%s'\n", path);
+            return NULL;
+        }
+        if (strlen(tok) >= sizeof(((dirent64_t *)0)->name)) {
+            fprintf(stderr, "Error: Name '%s' in '%s' is longer than %zu bytes\n",
+                    tok, path, sizeof(((dirent64_t *)0)->name) - 1);
+            return NULL;
+        }
+        // The previous component was a directory
+        if (name && !(dir = dir_walk(fs, dir, name, path, now))) {
+            return NULL;
+        }
+        name = tok;
+    }
+
+    if (!name) {
+        fprintf(stderr, "Error: '%s' does not name a file\n", path);
+        return NULL;
+    }
+    *leaf = name;
+    return dir;
+}
+
+// Reading superblock, bitmaps and root directory once per batch
+int image_load(fs_image_t *fs, vsfs_image_t *img) {
+    memset(fs, 0, sizeof(*fs));
+    fs->img = img;
+
+    if (vsfs_check(img) < 0) {
+        return -1;
+    }
+
+    // Finishing an interrupted in-place batch before any metadata is read
+    if (img->writable && vsfs_journal_recover(img) < 0) {
+        return -1;
+    }
+    if (!img->writable && vsfs_journal_pending(img)) {
+        fprintf(stderr, "Error: Input image has an unreplayed journal; add with --in-place or run mkfs_fsck --replay first\n");
+        return -1;
+    }
+
+    // Private copies: nothing in the image changes until the whole batch is planned
+    fs->sb_block = malloc(BS);
+    if (!fs->sb_block) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    memcpy(fs->sb_block, vsfs_block(img, 0), BS);
+    fs->sb = (superblock_t *)fs->sb_block;
+
+    fs->inode_bitmap = malloc(fs->sb->inode_bitmap_blocks * BS);
+    fs->data_bitmap = malloc(fs->sb->data_bitmap_blocks * BS);
+    fs->inode_bitmap_dirty = calloc(fs->sb->inode_bitmap_blocks, 1);
+    fs->data_bitmap_dirty = calloc(fs->sb->data_bitmap_blocks, 1);
+    fs->summary = malloc(fs->sb->summary_blocks * BS);
+    fs->summary_dirty = calloc(fs->sb->summary_blocks, 1);
+    fs->itable = calloc(fs->sb->inode_table_blocks, sizeof(uint8_t *));
+    fs->itable_dirty = calloc(fs->sb->inode_table_blocks, 1);
+    if (!fs->inode_bitmap || !fs->data_bitmap || !fs->inode_bitmap_dirty ||
+        !fs->data_bitmap_dirty || !fs->summary || !fs->summary_dirty || !fs->itable || !fs->itable_dirty) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    printf("Loading MiniVSFS image: %lu blocks, %lu inodes\n", fs->sb->total_blocks, fs->sb->inode_count);
+
+    memcpy(fs->inode_bitmap, vsfs_inode_bitmap(img), fs->sb->inode_bitmap_blocks * BS);
+    memcpy(fs->data_bitmap, vsfs_data_bitmap(img), fs->sb->data_bitmap_blocks * BS);
+    memcpy(fs->summary, vsfs_summary(img), fs->sb->summary_blocks * BS);
+
+    if (!image_open_dir(fs, ROOT_INO)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reading block `off` of a file, zero padded past its end as on disk
+int read_file_block(int fd, uint64_t size, uint64_t off, uint8_t *buf) {
+    uint64_t n = size - off < BS ? size - off : BS;
+    memset(buf + n, 0, BS - n);
+    return pread_full(fd, buf, n, off);
+}
+
+char *dedup_index_path(const char *image_name) {
+    char *path = malloc(strlen(image_name) + sizeof(".dedup"));
+    if (!path) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    strcpy(path, image_name);
+    strcat(path, ".dedup");
+    return path;
+}
+
+uint64_t dedup_bucket(const fs_image_t *fs, uint32_t hash) {
+    return hash & (fs->dedup_nbuckets - 1);
+}
+
+// Indexing a block by content hash, doubling the buckets once they average one entry each
+int dedup_insert(fs_image_t *fs, uint32_t hash, uint64_t block, int32_t src_file, uint64_t src_off) {
+    if (fs->dedup_count == fs->dedup_capacity) {
+        uint64_t cap = fs->dedup_capacity ? fs->dedup_capacity * 2 : 1024;
+        dedup_entry_t *grown = realloc(fs->dedup_entries, cap * sizeof(dedup_entry_t));
+        if (!grown) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        fs->dedup_entries = grown;
+        fs->dedup_capacity = cap;
+    }
+    if (fs->dedup_count >= fs->dedup_nbuckets) {
+        uint64_t nbuckets = fs->dedup_nbuckets ? fs->dedup_nbuckets * 2 : 1024;
+        uint64_t *table = malloc(nbuckets * sizeof(uint64_t));
+        if (!table) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        free(fs->dedup_buckets);
+        fs->dedup_buckets = table;
+        fs->dedup_nbuckets = nbuckets;
+        for (uint64_t b = 0; b < nbuckets; b++) {
+            table[b] = DEDUP_NONE;
+        }
+        // Relinking oldest first keeps the newest entry at the head of each chain
+        for (uint64_t i = 0; i < fs->dedup_count; i++) {
+            uint64_t b = dedup_bucket(fs, fs->dedup_entries[i].hash);
+            fs->dedup_entries[i].next = table[b];
+            table[b] = i;
+        }
+    }
+
+    uint64_t b = dedup_bucket(fs, hash);
+    fs->dedup_entries[fs->dedup_count] = (dedup_entry_t){block, fs->dedup_buckets[b], src_off, src_file, hash};
+    fs->dedup_buckets[b] = fs->dedup_count++;
+    return 0;
+}
+
+// Comparing a candidate byte for byte: the hash only picks candidates
+int dedup_matches(fs_image_t *fs, const dedup_entry_t *e, const uint8_t *buf) {
+    if (e->src_file < 0) {
+        return memcmp(vsfs_block(fs->img, e->block), buf, BS) == 0;
+    }
+
+    // Written by this batch: the data is still only in the source file
+    const pending_file_t *src = &fs->pending[e->src_file];
+    if (fs->src_file != e->src_file) {
+        if (fs->src_fd >= 0) {
+            close(fs->src_fd);
+        }
+        fs->src_file = e->src_file;
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+        fs->src_fd = open(src->path, O_RDONLY);
+    }
+    uint8_t other[BS];
+    return fs->src_fd >= 0 && read_file_block(fs->src_fd, src->size, e->src_off, other) == 0 &&
+           memcmp(other, buf, BS) == 0;
+}
+
+// A block with these contents that can take one more reference, or 0
+uint64_t dedup_find(fs_image_t *fs, uint32_t hash, const uint8_t *buf) {
+    if (fs->dedup_count == 0) {
+        return 0;
+    }
+    for (uint64_t i = fs->dedup_buckets[dedup_bucket(fs, hash)]; i != DEDUP_NONE; i = fs->dedup_entries[i].next) {
+        const dedup_entry_t *e = &fs->dedup_entries[i];
+        if (e->hash == hash && fs->shares[e->block - fs->sb->data_region_start] < UINT16_MAX &&
+            dedup_matches(fs, e, buf)) {
+            return e->block;
+        }
+    }
+    return 0;
+}
+
+// Loading the reference counts and, if it still describes this image, the index beside it
+int dedup_load(fs_image_t *fs, const char *image_name, const pending_file_t *pending) {
+    const superblock_t *sb = fs->sb;
+    if (sb->refcount_blocks == 0) {
+        fprintf(stderr, "Error: Image has no reference-count table; create it with mkfs_builder --dedup\n");
+        return -1;
+    }
+    fs->dedup = 1;
+    fs->pending = pending;
+    fs->src_file = -1;
+    fs->src_fd = -1;
+    fs->shares = malloc(sb->refcount_blocks * BS);
+    fs->shares_dirty = calloc(sb->refcount_blocks, 1);
+    if (!fs->shares || !fs->shares_dirty) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    memcpy(fs->shares, vsfs_refcounts(fs->img), sb->refcount_blocks * BS);
+
+    char *path = dedup_index_path(image_name);
+    if (!path) {
+        return -1;
+    }
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) {
+        return 0;
+    }
+
+    dedup_file_header_t hdr;
+    dedup_file_entry_t entry;
+    int ret = 0;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != DEDUP_MAGIC || hdr.sb_checksum != sb->checksum) {
+        fprintf(stderr, "Warning: dedup index does not match the image; starting a new one\n");
+        fclose(f);
+        return 0;
+    }
+    for (uint64_t i = 0; i < hdr.count && fread(&entry, sizeof(entry), 1, f) == 1; i++) {
+        uint64_t bit = entry.block - sb->data_region_start;
+        // Only blocks that are still allocated can be shared
+        if (entry.block >= sb->data_region_start && bit < sb->data_region_blocks &&
+            (fs->data_bitmap[bit / 8] >> (bit % 8) & 1) &&
+            dedup_insert(fs, entry.hash, entry.block, -1, 0) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// Rewriting the index beside the image once the batch is on disk
+int dedup_save(const fs_image_t *fs, const char *image_name) {
+    char *path = dedup_index_path(image_name);
+    char *tmp = path ? malloc(strlen(path) + sizeof(".tmp")) : NULL;
+    if (!tmp) {
+        free(path);
+        perror("Memory allocation failed");
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    int ok = f != NULL;
+    dedup_file_header_t hdr = {DEDUP_MAGIC, fs->sb->checksum, fs->dedup_count};
+    ok = ok && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (uint64_t i = 0; ok && i < fs->dedup_count; i++) {
+        dedup_file_entry_t entry = {fs->dedup_entries[i].block, fs->dedup_entries[i].hash};
+        ok = fwrite(&entry, sizeof(entry), 1, f) == 1;
+    }
+    if (f && fclose(f) != 0) {
+        ok = 0;
+    }
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        perror("Failed to write dedup index");
+        unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    return ok ? 0 : -1;
+}
+
+// One block for a deduplicated file: best-fit places the file's first fresh
+// block, the following ones continue that run while it lasts
+uint64_t dedup_alloc_block(fs_image_t *fs, uint64_t remaining) {
+    uint64_t block = 0;
+    if (fs->alloc_policy == ALLOC_FIRST_FIT) {
+        allocate_first_fit(fs, 1, emit_one_block, &block);
+        return block;
+    }
+    if (!fs->runs && free_runs_build(fs) < 0) {
+        return 0;
+    }
+    uint64_t r = fs->cur_run;
+    if (r == RUN_NONE || fs->runs[r].len == 0) {
+        r = run_best_fit(fs, remaining);
+        r = r == RUN_NONE ? run_largest(fs) : r;
+        fs->cur_run = r;
+    }
+    if (r != RUN_NONE) {
+        run_take(fs, r, 1, emit_one_block, &block);
+    }
+    return block;
+}
+
+// Hashing each block of the file: identical blocks already in the image or in
+// this batch gain a reference, the rest are allocated; returns blocks mapped
+uint64_t dedup_plan_file(fs_image_t *fs, pending_file_t *pf) {
+    if (pf->block_count == 0) {
+        return 0;
+    }
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int fd = open(pf->path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file to add");
+        return 0;
+    }
+
+    int32_t file_index = (int32_t)(pf - fs->pending);
+    uint8_t buf[BS];
+    uint64_t b;
+    fs->cur_run = RUN_NONE;
+    for (b = 0; b < pf->block_count; b++) {
+        // Every shared block can cost an extent; near the limit the rest is stored unshared
+        if (pf->extent_count >= FILE_EXTENTS_MAX - INODE_EXTENTS) {
+            b += allocate_blocks(fs, pf->block_count - b, emit_extent_run, pf);
+            break;
+        }
+        if (read_file_block(fd, pf->size, b * BS, buf) < 0) {
+            perror("Failed to read file to add");
+            break;
+        }
+        uint32_t hash = crc32_fast(buf, BS);
+        uint64_t block = dedup_find(fs, hash, buf);
+        if (block) {
+            uint64_t bit = block - fs->sb->data_region_start;
+            fs->shares[bit]++;
+            fs->shares_dirty[bit / REFCOUNTS_PER_BLOCK] = 1;
+            file_add_run(pf, block, 1, 0);
+            pf->shared_blocks++;
+            continue;
+        }
+
+        block = dedup_alloc_block(fs, pf->block_count - b);
+        if (block == 0 || dedup_insert(fs, hash, block, file_index, b * BS) < 0) {
+            break;
+        }
+        file_add_run(pf, block, 1, 1);
+    }
+    close(fd);
+    return b;
+}
+
+// Compressing a file cluster by cluster into the spill file, behind its
+// cluster map; kept only if the stream needs fewer blocks than the raw data
+int compress_plan(fs_image_t *fs, pending_file_t *pf) {
+    if (!fs->spill && !(fs->spill = tmpfile())) {
+        perror("Failed to create spill file");
+        return -1;
+    }
+
+    uint64_t clusters = (pf->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    uint64_t map_bytes = sizeof(cluster_map_t) + clusters * sizeof(uint64_t);
+    uint64_t *map = malloc(map_bytes);
+    uint8_t *raw = malloc(CLUSTER_SIZE);
+    uint8_t *packed = malloc(CLUSTER_SIZE);
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int fd = open(pf->path, O_RDONLY);
+    int spill_fd = fileno(fs->spill);
+    int ret = -1;
+    if (!map || !raw || !packed || fd < 0) {
+        perror(fd < 0 ? "Failed to open file to add" : "Memory allocation failed");
+        goto out;
+    }
+
+    cluster_map_t *hdr = (cluster_map_t *)map;
+    uint64_t *ends = (uint64_t *)(hdr + 1);
+    uint64_t pos = map_bytes;
+    uint64_t c;
+    for (c = 0; c < clusters; c++) {
+        uint64_t len = pf->size - c * CLUSTER_SIZE < CLUSTER_SIZE ? pf->size - c * CLUSTER_SIZE : CLUSTER_SIZE;
+        if (pread_full(fd, raw, len, c * CLUSTER_SIZE) < 0) {
+            perror("Failed to read file to add");
+            goto out;
+        }
+        // Anything not strictly smaller is stored raw
+        size_t n = lz_compress(raw, len, packed, len - 1);
+        if (pwrite_full(spill_fd, n ? packed : raw, n ? n : len, fs->spill_size + pos) < 0) {
+            perror("Failed to write spill file");
+            goto out;
+        }
+        pos += n ? n : len;
+        ends[c] = pos;
+        if ((pos + BS - 1) / BS >= pf->block_count) {
+            break;
+        }
+    }
+
+    if (c == clusters) {
+        hdr->magic = CLUSTER_MAGIC;
+        hdr->cluster_shift = CLUSTER_SHIFT;
+        hdr->clusters = clusters;
+        if (pwrite_full(spill_fd, map, map_bytes, fs->spill_size) < 0) {
+            perror("Failed to write spill file");
+            goto out;
+        }
+        pf->compressed = 1;
+        pf->stored_size = pos;
+        pf->spill_off = fs->spill_size;
+        pf->block_count = (pos + BS - 1) / BS;
+        fs->spill_size += pos;
+    }
+    ret = 0;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(map);
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+// Allocating inode, data blocks and directory entry for one file in memory
+int plan_file(fs_image_t *fs, pending_file_t *pf, const char *file_name, time_t now) {
+    memset(pf, 0, sizeof(*pf));
+    pf->path = file_name;
+
+    struct stat file_stat;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (stat(file_name, &file_stat) != 0) {
+        fprintf(stderr, "Error: File '%s' not found in working directory\n", file_name);
+        return -1;
+    }
+
+    // Checking file type
+    if (!S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", file_name);
+        return -1;
+    }
+
+    // Failing fast on a full image; only sharing or compression could make a file take fewer blocks
+    uint64_t need = (uint64_t)file_stat.st_size <= INODE_INLINE_MAX ? 0 : ((uint64_t)file_stat.st_size + BS - 1) / BS;
+    if (!fs->dedup && !fs->compress && need > fs->sb->free_blocks) {
+        fprintf(stderr, "Error: Not enough free data blocks for '%s' (need %lu, image has %lu)\n",
+                file_name, need, fs->sb->free_blocks);
+        return -1;
+    }
+
+    // Walking (and creating) the parent directories, then rejecting duplicate names
+    char *path_buf = malloc(strlen(file_name) + 1);
+    if (!path_buf) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    const char *leaf = NULL;
+    dir_t *parent = resolve_parent(fs, file_name, path_buf, &leaf, now);
+    int64_t existing = parent ? dir_lookup(fs, parent, leaf, NULL) : -1;
+    if (existing != 0) {
+        if (existing > 0) {
+            fprintf(stderr, "Error: '%s' already exists in the image\n", file_name);
+        }
+        free(path_buf);
+        return -1;
+    }
+
+    // Calculating required blocks; tiny files need none
+    pf->size = file_stat.st_size;
+    pf->inline_data = pf->size <= INODE_INLINE_MAX;
+    pf->block_count = pf->inline_data ? 0 : (pf->size + BS - 1) / BS;
+    if (fs->compress && !pf->inline_data && compress_plan(fs, pf) < 0) {
+        free(path_buf);
+        return -1;
+    }
+
+    int ret = -1;
+    pf->inode_num = image_alloc_inode(fs);
+    if (pf->inode_num == 0) {
+        goto out;
+    }
+
+    // Worst case every block is its own run
+    if (pf->block_count > 0) {
+        pf->extents = malloc(pf->block_count * sizeof(extent_t));
+        pf->fresh = malloc(pf->block_count);
+        if (!pf->extents || !pf->fresh) {
+            perror("Memory allocation failed");
+            goto out;
+        }
+    }
+
+    uint64_t found_blocks = fs->dedup ? dedup_plan_file(fs, pf) : allocate_blocks(fs, pf->block_count, emit_extent_run, pf);
+    if (found_blocks < pf->block_count) {
+        fprintf(stderr, "Error: Not enough free data blocks (need %lu, found %lu)\n",
+                pf->block_count, found_blocks);
+        goto out;
+    }
+
+    // Extent lists that do not fit in the inode spill into index blocks
+    if (pf->extent_count > INODE_EXTENTS) {
+        uint32_t index_needed = (pf->extent_count + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+        if (index_needed > INODE_EXTENTS) {
+            fprintf(stderr, "Error: File '%s' too fragmented (%u extents, max %lu supported)\n",
+                    file_name, pf->extent_count, INODE_EXTENTS * EXTENTS_PER_BLOCK);
+            goto out;
+        }
+        if (allocate_blocks(fs, index_needed, emit_index_run, pf) < index_needed) {
+            fprintf(stderr, "Error: Not enough free data blocks for the extent index\n");
+            goto out;
+        }
+    }
+
+    inode_t *new_inode = image_inode(fs, pf->inode_num, 1);
+    if (!new_inode) {
+        goto out;
+    }
+
+    // Creating new inode
+    memset(new_inode, 0, sizeof(inode_t));
+    new_inode->mode = 0100000;
+    new_inode->links = 1;
+    new_inode->uid = 0;
+    new_inode->gid = 0;
+    new_inode->size_bytes = pf->size;
+    new_inode->atime = now;
+    new_inode->mtime = now;
+    new_inode->ctime = now;
+
+    if (pf->inline_data) {
+        // Read now: the inode is the only place the data goes
+        new_inode->flags = INODE_FL_INLINE;
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+        int add_fd = open(file_name, O_RDONLY);
+        if (add_fd < 0 || pread_full(add_fd, new_inode->direct, pf->size, 0) < 0) {
+            perror("Failed to read file to add");
+            if (add_fd >= 0) {
+                close(add_fd);
+            }
+            goto out;
+        }
+        close(add_fd);
+    } else if (pf->index_count == 0) {
+        new_inode->flags = INODE_FL_EXTENTS;
+        new_inode->extent_count = pf->extent_count;
+        memcpy(new_inode->extents, pf->extents, pf->extent_count * sizeof(extent_t));
+    } else {
+        new_inode->flags = INODE_FL_EXTENTS;
+        new_inode->extent_count = pf->extent_count;
+        for (uint32_t i = 0; i < pf->index_count; i++) {
+            uint32_t remaining = pf->extent_count - i * EXTENTS_PER_BLOCK;
+            new_inode->extents[i].start = pf->index_blocks[i];
+            new_inode->extents[i].length = remaining < EXTENTS_PER_BLOCK ? remaining : EXTENTS_PER_BLOCK;
+        }
+    }
+
+    if (pf->compressed) {
+        new_inode->flags |= INODE_FL_COMPRESSED;
+    }
+    new_inode->proj_id = 1;
+    inode_crc_finalize(new_inode);
+
+    // Adding directory entry for new file
+    ret = dir_link(fs, parent, leaf, pf->inode_num, DIRENT_FILE, now);
+out:
+    free(path_buf);
+    return ret;
+}
+
+// Cloning the input image: reflink first, then in-kernel copy, then writes straight from the mapping
+int copy_image(const vsfs_image_t *in, int output_fd, uint64_t total_blocks) {
+    uint64_t image_bytes = total_blocks * BS;
+    int input_fd = in->fd;
+
+    vsfs_stats_syscall(VSFS_SYS_COPY);
+    if (ioctl(output_fd, FICLONE, input_fd) == 0) {
+        return 0;
+    }
+
+    uint64_t copied = 0;
+    while (copied < image_bytes) {
+        loff_t in_off = copied, out_off = copied;
+        ssize_t n = copy_file_range(input_fd, &in_off, output_fd, &out_off, image_bytes - copied, 0);
+        vsfs_stats_syscall(VSFS_SYS_COPY);
+        if (n <= 0) {
+            break;
+        }
+        vsfs_stats_bytes(n, n);
+        copied += n;
+    }
+    if (copied == image_bytes) {
+        return 0;
+    }
+
+    // Sizing first so the output can be mapped even if the copy fell short
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (ftruncate(output_fd, image_bytes) != 0) {
+        perror("Failed to size output image");
+        return -1;
+    }
+    while (copied < image_bytes) {
+        size_t chunk = image_bytes - copied < COPY_CHUNK ? image_bytes - copied : COPY_CHUNK;
+        if (pwrite_full(output_fd, in->base + copied, chunk, copied) < 0) {
+            perror("Failed to write output image during copy");
+            return -1;
+        }
+        copied += chunk;
+    }
+    return 0;
+}
+
+// Queueing file data for its mapped extents, and writing any extent index blocks
+int write_file_data(const vsfs_image_t *out, vsfs_aio_t *aio, const pending_file_t *pf, FILE *spill) {
+    if (pf->inline_data) {
+        return 0;
+    }
+    // Compressed streams come from the spill file, everything else from the file itself
+    if (!pf->compressed) {
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+    }
+    int add_fd = pf->compressed ? fileno(spill) : open(pf->path, O_RDONLY);
+    if (add_fd < 0) {
+        perror("Failed to open file to add");
+        return -1;
+    }
+    uint64_t src_base = pf->compressed ? pf->spill_off : 0;
+    uint64_t total = pf->compressed ? pf->stored_size : pf->size;
+
+    uint64_t file_off = 0;
+    for (uint32_t e = 0; e < pf->extent_count; e++) {
+        uint64_t run_bytes = (uint64_t)pf->extents[e].length * BS;
+        uint64_t data = total - file_off < run_bytes ? total - file_off : run_bytes;
+        uint8_t *dst = vsfs_block(out, pf->extents[e].start);
+
+        // Shared blocks already hold these bytes
+        if (!pf->fresh[e]) {
+            file_off += data;
+            continue;
+        }
+        // Overlays take the run into their own file first; every byte of it is written below
+        if (vsfs_overlay_claim(out, pf->extents[e].start, pf->extents[e].length, 0) < 0) {
+            perror("Failed to claim overlay blocks");
+            if (!pf->compressed) {
+                vsfs_aio_close(aio, add_fd);
+            }
+            return -1;
+        }
+        // The tail of the last block is zero padded
+        memset(dst + data, 0, run_bytes - data);
+        if (vsfs_aio_copy_in(aio, pf->extents[e].start, add_fd, src_base + file_off, data) < 0) {
+            perror("Failed to copy file data");
+            if (!pf->compressed) {
+                vsfs_aio_close(aio, add_fd);
+            }
+            return -1;
+        }
+        file_off += data;
+    }
+    // The copies still in flight keep it open
+    if (!pf->compressed) {
+        vsfs_aio_close(aio, add_fd);
+    }
+
+    for (uint32_t i = 0; i < pf->index_count; i++) {
+        uint32_t first = i * EXTENTS_PER_BLOCK;
+        uint32_t n = pf->extent_count - first < EXTENTS_PER_BLOCK ? pf->extent_count - first : EXTENTS_PER_BLOCK;
+        uint8_t *block = vsfs_block(out, pf->index_blocks[i]);
+        if (vsfs_overlay_claim(out, pf->index_blocks[i], 1, 0) < 0) {
+            perror("Failed to claim overlay blocks");
+            return -1;
+        }
+        memset(block, 0, BS);
+        memcpy(block, &pf->extents[first], n * sizeof(extent_t));
+    }
+    return 0;
+}
+
+// Queueing every modified metadata block exactly once, the superblock last
+int image_collect(fs_image_t *fs, block_list_t *list, time_t now) {
+    superblock_t *sb = fs->sb;
+
+    for (uint64_t i = 0; i < sb->inode_table_blocks; i++) {
+        if (fs->itable_dirty[i] && block_list_push(list, sb->inode_table_start + i, fs->itable[i]) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < fs->dir_count; i++) {
+        if (dir_collect(fs->dirs[i], list) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint64_t i = 0; i < sb->inode_bitmap_blocks; i++) {
+        if (fs->inode_bitmap_dirty[i] &&
+            block_list_push(list, sb->inode_bitmap_start + i, fs->inode_bitmap + i * BS) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint64_t i = 0; i < sb->data_bitmap_blocks; i++) {
+        if (fs->data_bitmap_dirty[i] &&
+            block_list_push(list, sb->data_bitmap_start + i, fs->data_bitmap + i * BS) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint64_t i = 0; fs->dedup && i < sb->refcount_blocks; i++) {
+        if (fs->shares_dirty[i] &&
+            block_list_push(list, sb->refcount_start + i, (uint8_t *)fs->shares + i * BS) < 0) {
+            return -1;
+        }
+    }
+
+    // The free counters were kept up to date by the allocators
+    for (uint64_t i = 0; i < sb->summary_blocks; i++) {
+        if (fs->summary_dirty[i] &&
+            block_list_push(list, sb->summary_start + i, (uint8_t *)fs->summary + i * BS) < 0) {
+            return -1;
+        }
+    }
+    sb->summary_crc = crc32_fast(fs->summary, sb->summary_blocks * BS);
+
+    // Updating superblock mtime and checksum after modifications
+    sb->mtime_epoch = now;
+    superblock_crc_finalize(sb);
+    return block_list_push(list, 0, fs->sb_block);
+}
+
+// Writing the batch's metadata; through the journal when in place, so a crash
+// leaves either the old or the new image and the whole batch costs one commit.
+// A batch the journal cannot hold fails with the input unchanged.
+int image_flush(fs_image_t *fs, vsfs_image_t *out, time_t now, int journal) {
+    block_list_t list = {0};
+    int ret = -1;
+
+    if (image_collect(fs, &list, now) < 0) {
+        goto out;
+    }
+
+    if (journal) {
+        ret = vsfs_commit_blocks(out, list.count, list.targets, list.blocks);
+        goto out;
+    }
+    for (uint64_t i = 0; i < list.count; i++) {
+        if (write_block(out, list.targets[i], list.blocks[i]) < 0) {
+            perror("Failed to write metadata block");
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    block_list_free(&list);
+    return ret;
+}
+
+// Appending a run to a delta's run table
+int delta_push(delta_run_t **runs, uint64_t *count, uint64_t *cap, uint64_t start, uint32_t length) {
+    if (*count == *cap) {
+        uint64_t n = *cap ? *cap * 2 : 64;
+        delta_run_t *grown = realloc(*runs, n * sizeof(delta_run_t));
+        if (!grown) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        *runs = grown;
+        *cap = n;
+    }
+    (*runs)[(*count)++] = (delta_run_t){start, length, 0};
+    return 0;
+}
+
+int delta_run_cmp(const void *a, const void *b) {
+    uint64_t x = ((const delta_run_t *)a)->start, y = ((const delta_run_t *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+// Writing the batch as a delta against the input: the file data staged in
+// scratch (a sparse image the size of the input) and the metadata blocks
+int delta_write(fs_image_t *fs, const vsfs_image_t *scratch, const pending_file_t *pending,
+                uint32_t file_count, time_t now, const char *delta_name) {
+    block_list_t list = {0};
+    delta_run_t *runs = NULL;
+    uint64_t nruns = 0, cap = 0;
+    uint8_t *table = NULL;
+    int fd = -1;
+    int created = 0;
+    int ret = -1;
+
+    // File data and extent index blocks, merged into runs in block order
+    for (uint32_t i = 0; i < file_count; i++) {
+        const pending_file_t *pf = &pending[i];
+        for (uint32_t e = 0; !pf->inline_data && e < pf->extent_count; e++) {
+            if (pf->fresh[e] && delta_push(&runs, &nruns, &cap, pf->extents[e].start, pf->extents[e].length) < 0) {
+                goto out;
+            }
+        }
+        for (uint32_t e = 0; e < pf->index_count; e++) {
+            if (delta_push(&runs, &nruns, &cap, pf->index_blocks[e], 1) < 0) {
+                goto out;
+            }
+        }
+    }
+    qsort(runs, nruns, sizeof(delta_run_t), delta_run_cmp);
+    uint64_t data_runs = 0;
+    for (uint64_t r = 0; r < nruns; r++) {
+        delta_run_t *last = data_runs ? &runs[data_runs - 1] : NULL;
+        if (last && last->start + last->length == runs[r].start &&
+            (uint64_t)last->length + runs[r].length <= UINT32_MAX) {
+            last->length += runs[r].length;
+        } else {
+            runs[data_runs++] = runs[r];
+        }
+    }
+    nruns = data_runs;
+
+    // Then every metadata block, each from its own buffer, the superblock last
+    if (image_collect(fs, &list, now) < 0) {
+        goto out;
+    }
+    for (uint64_t i = 0; i < list.count; i++) {
+        if (delta_push(&runs, &nruns, &cap, list.targets[i], 1) < 0) {
+            goto out;
+        }
+    }
+
+    uint64_t table_blocks = (nruns + DELTA_RUNS_PER_BLOCK - 1) / DELTA_RUNS_PER_BLOCK;
+    uint64_t payload = 0;
+    for (uint64_t r = 0; r < nruns; r++) {
+        const uint8_t *src = r < data_runs ? vsfs_block(scratch, runs[r].start) : list.blocks[r - data_runs];
+        runs[r].crc = crc32_fast(src, (uint64_t)runs[r].length * BS);
+        payload += runs[r].length;
+    }
+    table = calloc(table_blocks ? table_blocks : 1, BS);
+    if (!table) {
+        perror("Memory allocation failed");
+        goto out;
+    }
+    memcpy(table, runs, nruns * sizeof(delta_run_t));
+
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    fd = open(delta_name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (errno == EEXIST) {
+            fprintf(stderr, "Error: delta '%s' already exists. Choose a different name or remove it.\n", delta_name);
+        } else {
+            perror("Failed to create delta");
+        }
+        goto out;
+    }
+    created = 1;
+
+    uint8_t header_block[BS] = {0};
+    delta_header_t *hdr = (delta_header_t *)header_block;
+    hdr->magic = DELTA_MAGIC;
+    hdr->version = FS_VERSION;
+    hdr->base_blocks = fs->sb->total_blocks;
+    hdr->base_crc = vsfs_metadata_crc(fs->img);
+    hdr->table_crc = crc32_fast(table, table_blocks * BS);
+    hdr->runs = nruns;
+    hdr->data_runs = data_runs;
+    hdr->blocks = payload;
+    hdr->checksum = crc32_fast(hdr, sizeof(*hdr) - sizeof(hdr->checksum));
+
+    uint64_t off = (1 + table_blocks) * BS;
+    for (uint64_t r = 0; r < nruns; r++) {
+        const uint8_t *src = r < data_runs ? vsfs_block(scratch, runs[r].start) : list.blocks[r - data_runs];
+        if (pwrite_full(fd, src, (uint64_t)runs[r].length * BS, off) < 0) {
+            perror("Failed to write delta");
+            goto out;
+        }
+        off += (uint64_t)runs[r].length * BS;
+    }
+    if (pwrite_full(fd, table, table_blocks * BS, BS) < 0 || pwrite_full(fd, header_block, BS, 0) < 0) {
+        perror("Failed to write delta");
+        goto out;
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        perror("Failed to close delta");
+        goto out;
+    }
+    fd = -1;
+    printf("Delta '%s': %lu runs, %lu blocks (%lu of file data)\n", delta_name, nruns, payload,
+           payload - (nruns - data_runs));
+    ret = 0;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    // Not leaving a partial delta behind
+    if (ret != 0 && created) {
+        unlink(delta_name);
+    }
+    free(table);
+    free(runs);
+    block_list_free(&list);
+    return ret;
+}
+
+// Fragmentation of the batch and of the free space it leaves behind
+void print_alloc_stats(const fs_image_t *fs, const pending_file_t *pending, uint32_t file_count) {
+    uint64_t extents = 0, fragmented = 0, inlined = 0, blocks = 0, shared = 0;
+    uint64_t compressed = 0, raw_bytes = 0, stored_bytes = 0;
+    for (uint32_t i = 0; i < file_count; i++) {
+        extents += pending[i].extent_count;
+        fragmented += pending[i].extent_count > 1;
+        inlined += pending[i].inline_data;
+        blocks += pending[i].block_count;
+        shared += pending[i].shared_blocks;
+        if (pending[i].compressed) {
+            compressed++;
+            raw_bytes += pending[i].size;
+            stored_bytes += pending[i].stored_size;
+        }
+    }
+
+    uint64_t nbits = fs->sb->data_region_blocks;
+    uint64_t free_blocks = 0, free_runs = 0, largest = 0;
+    for (uint64_t i = bitmap_find_clear(fs->data_bitmap, nbits, 0); i < nbits;) {
+        uint64_t end = bitmap_find_set(fs->data_bitmap, nbits, i);
+        free_blocks += end - i;
+        free_runs++;
+        largest = end - i > largest ? end - i : largest;
+        i = bitmap_find_clear(fs->data_bitmap, nbits, end);
+    }
+
+    printf("Allocator %s: %u files in %lu extents, %lu fragmented, %lu inline\n",
+           fs->alloc_policy == ALLOC_FIRST_FIT ? "first-fit" : "best-fit", file_count, extents, fragmented, inlined);
+    printf("Free space: %lu blocks in %lu runs, largest %lu\n", free_blocks, free_runs, largest);
+    if (fs->compress) {
+        printf("Compression: %lu files, %lu bytes stored as %lu\n", compressed, raw_bytes, stored_bytes);
+    }
+    if (fs->dedup) {
+        printf("Dedup: %lu of %lu data blocks shared, %lu written\n", shared, blocks, blocks - shared);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+    crc32_fast_init();
+
+    // Parsing command line arguments
+    cli_args_t args;
+    if (parse_args(argc, argv, &args) < 0) {
+        args_free(&args);
+        return 1;
+    }
+
+    // Timed phases for --stats; the marks cost one clock_gettime each
+    vsfs_stats_t stats;
+    vsfs_stats_start(&stats);
+
+    vsfs_image_t in;
+    if (vsfs_open(&in, args.input_name, args.in_place) < 0) {
+        args_free(&args);
+        return 1;
+    }
+
+    fs_image_t fs = {0};
+    vsfs_image_t out_map = {0};
+    vsfs_image_t *out = &in;
+    pending_file_t *pending = calloc(args.file_count, sizeof(pending_file_t));
+    vsfs_aio_t *aio = NULL;
+    int output_fd = -1;
+    int created_output = 0;
+    FILE *scratch = NULL;
+    int ret = 1;
+
+    if (!pending) {
+        perror("Memory allocation failed");
+        goto out;
+    }
+
+    if (image_load(&fs, &in) < 0) {
+        goto out;
+    }
+    fs.alloc_policy = args.alloc_policy;
+    fs.compress = args.compress;
+    if (args.dedup && dedup_load(&fs, args.input_name, pending) < 0) {
+        goto out;
+    }
+    vsfs_stats_phase(&stats, "load");
+
+    // Every file takes an inode; a full image is refused before anything is planned
+    if (fs.sb->free_inodes < args.file_count) {
+        fprintf(stderr, "Error: Not enough free inodes (need %u, image has %lu)\n", args.file_count, fs.sb->free_inodes);
+        goto out;
+    }
+
+    // Planning every allocation before the output image is touched
+    time_t now = time(NULL);
+    for (uint32_t i = 0; i < args.file_count; i++) {
+        if (plan_file(&fs, &pending[i], args.file_names[i], now) < 0) {
+            goto out;
+        }
+    }
+    for (uint32_t i = 0; i < fs.dir_count; i++) {
+        if (dir_finalize(&fs, fs.dirs[i]) < 0) {
+            goto out;
+        }
+    }
+    vsfs_stats_phase(&stats, "plan");
+
+    // In place, only the touched blocks of the input mapping are rewritten
+    if (args.delta_name) {
+        // A delta stages file data in a sparse scratch image; the input is only read
+        scratch = tmpfile();
+        if (!scratch || ftruncate(fileno(scratch), fs.sb->total_blocks * BS) != 0) {
+            perror("Failed to create scratch image");
+            goto out;
+        }
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+        if (vsfs_map(&out_map, fileno(scratch), 1, fs.sb->total_blocks) < 0) {
+            goto out;
+        }
+        out = &out_map;
+    } else if (!args.in_place) {
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+        output_fd = open(args.output_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (output_fd < 0) {
+            if (errno == EEXIST) {
+                fprintf(stderr, "Error: output image '%s' already exists. Choose a different name or remove it.\n", args.output_name);
+            } else {
+                perror("Failed to create output image");
+            }
+            goto out;
+        }
+        created_output = 1;
+
+        // An overlay's presence bitmap lies past total_blocks and is copied along
+        if (copy_image(&in, output_fd, in.nblocks) < 0 ||
+            vsfs_map(&out_map, output_fd, 1, fs.sb->total_blocks) < 0) {
+            goto out;
+        }
+        out = &out_map;
+        vsfs_stats_phase(&stats, "image_copy");
+    }
+
+    // File data is pipelined across the whole batch and lands before any metadata
+    aio = vsfs_aio_start(out, args.io_backend, AIO_DEPTH);
+    if (!aio) {
+        perror("Failed to start file data copy");
+        goto out;
+    }
+    const char *io_backend = vsfs_aio_backend(aio);
+    for (uint32_t i = 0; i < args.file_count; i++) {
+        if (write_file_data(out, aio, &pending[i], fs.spill) < 0) {
+            goto out;
+        }
+    }
+    int aio_ret = vsfs_aio_finish(aio);
+    aio = NULL;
+    if (aio_ret < 0) {
+        perror("Failed to copy file data");
+        goto out;
+    }
+    vsfs_stats_phase(&stats, "data");
+
+    if (args.delta_name) {
+        if (delta_write(&fs, out, pending, args.file_count, now, args.delta_name) < 0) {
+            goto out;
+        }
+    } else if (image_flush(&fs, out, now, args.in_place) < 0) {
+        goto out;
+    }
+
+    // A lost index only costs sharing opportunities, never correctness; a delta's target is not here to index
+    if (fs.dedup && !args.delta_name) {
+        dedup_save(&fs, args.in_place ? args.input_name : args.output_name);
+    }
+    vsfs_stats_phase(&stats, "metadata");
+
+    if (args.output_name) {
+        int close_ret = vsfs_close(&out_map);
+        if (close(output_fd) != 0 || close_ret != 0) {
+            output_fd = -1;
+            perror("Failed to close output image");
+            goto out;
+        }
+        output_fd = -1;
+        vsfs_stats_phase(&stats, "close");
+    }
+
+    for (uint32_t i = 0; i < args.file_count; i++) {
+        printf("File '%s' added successfully to MiniVSFS image\n", pending[i].path);
+        printf("Allocated inode: %u\n", pending[i].inode_num);
+        if (pending[i].inline_data) {
+            printf("Stored %lu bytes inline in the inode\n", pending[i].size);
+        } else if (pending[i].compressed) {
+            printf("Allocated %lu data blocks in %u extents (compressed to %lu bytes)\n",
+                   pending[i].block_count, pending[i].extent_count, pending[i].stored_size);
+        } else {
+            printf("Allocated %lu data blocks in %u extents\n", pending[i].block_count, pending[i].extent_count);
+        }
+    }
+    print_alloc_stats(&fs, pending, args.file_count);
+    printf("File data I/O: %s\n", io_backend);
+    if (args.stats) {
+        vsfs_stats_value(&stats, "bits_scanned", fs.bits_scanned);
+        vsfs_stats_value(&stats, "free_inodes", fs.sb->free_inodes);
+        vsfs_stats_value(&stats, "free_blocks", fs.sb->free_blocks);
+        vsfs_stats_print(&stats, stdout, "mkfs_adder", args.stats == 2);
+    }
+    ret = 0;
+
+out:
+    if (aio) {
+        vsfs_aio_finish(aio);
+    }
+    vsfs_close(&out_map);
+    if (scratch) {
+        fclose(scratch);
+    }
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+    // Not leaving a half-written image behind
+    if (ret != 0 && created_output) {
+        unlink(args.output_name);
+    }
+    image_free(&fs);
+    for (uint32_t i = 0; pending && i < args.file_count; i++) {
+        free(pending[i].extents);
+        free(pending[i].fresh);
+    }
+    free(pending);
+    vsfs_close(&in);
+    args_free(&args);
+    return ret;
+}
@@ -0,0 +1,183 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "minivsfs.h"
+
+// Command line arguments structure
+typedef struct {
+    char *image_name;
+    char *delta_name;
+} cli_args_t;
+
+int parse_args(int argc, char *argv[], cli_args_t *args) {
+    int opt;
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"delta", required_argument, 0, 'd'},
+        {0, 0, 0, 0}
+    };
+
+    memset(args, 0, sizeof(*args));
+    while ((opt = getopt_long(argc, argv, "i:d:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                args->image_name = optarg;
+                break;
+            case 'd':
+                args->delta_name = optarg;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (!args->image_name || !args->delta_name) {
+        fprintf(stderr, "Usage: mkfs_apply --image <file> --delta <file>\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Checking the delta's header, run table and payload against the base it patches
+int delta_verify(const vsfs_image_t *img, const vsfs_image_t *delta) {
+    const superblock_t *sb = vsfs_sb(img);
+    const delta_header_t *hdr = (const delta_header_t *)vsfs_block(delta, 0);
+    if (!hdr || hdr->magic != DELTA_MAGIC ||
+        hdr->checksum != crc32_fast(hdr, sizeof(*hdr) - sizeof(hdr->checksum))) {
+        fprintf(stderr, "Error: Not a MiniVSFS delta\n");
+        return -1;
+    }
+    if (hdr->version != sb->version || hdr->base_blocks != sb->total_blocks ||
+        hdr->base_crc != vsfs_metadata_crc(img)) {
+        fprintf(stderr, "Error: Delta was made against a different base image\n");
+        return -1;
+    }
+
+    uint64_t table_blocks = (hdr->runs + DELTA_RUNS_PER_BLOCK - 1) / DELTA_RUNS_PER_BLOCK;
+    if (hdr->data_runs > hdr->runs || table_blocks > delta->nblocks - 1 ||
+        hdr->blocks > delta->nblocks - 1 - table_blocks ||
+        hdr->table_crc != crc32_fast(vsfs_block(delta, 1), table_blocks * BS)) {
+        fprintf(stderr, "Error: Delta run table is corrupt\n");
+        return -1;
+    }
+
+    // File data goes to the data region; metadata blocks are logged one at a time
+    const delta_run_t *runs = (const delta_run_t *)vsfs_block(delta, 1);
+    uint64_t next = 1 + table_blocks, end = 1 + table_blocks + hdr->blocks;
+    for (uint64_t r = 0; r < hdr->runs; r++) {
+        int data = r < hdr->data_runs;
+        if (runs[r].length == 0 || runs[r].length > end - next ||
+            runs[r].start >= sb->total_blocks || runs[r].length > sb->total_blocks - runs[r].start ||
+            (data && runs[r].start < sb->data_region_start) || (!data && runs[r].length != 1)) {
+            fprintf(stderr, "Error: Delta run %lu is out of range\n", r);
+            return -1;
+        }
+        if (runs[r].crc != crc32_fast(vsfs_block(delta, next), (uint64_t)runs[r].length * BS)) {
+            fprintf(stderr, "Error: Delta run %lu has a bad checksum\n", r);
+            return -1;
+        }
+        next += runs[r].length;
+    }
+    if (next != end) {
+        fprintf(stderr, "Error: Delta payload does not match its run table\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Writing file data home, then committing the metadata blocks as one journal
+// transaction: a crash leaves either the base or the patched image, and a
+// delta the journal cannot hold is refused with the base unchanged
+int delta_apply(vsfs_image_t *img, const vsfs_image_t *delta) {
+    const delta_header_t *hdr = (const delta_header_t *)vsfs_block(delta, 0);
+    const delta_run_t *runs = (const delta_run_t *)vsfs_block(delta, 1);
+    uint64_t next = 1 + (hdr->runs + DELTA_RUNS_PER_BLOCK - 1) / DELTA_RUNS_PER_BLOCK;
+
+    for (uint64_t r = 0; r < hdr->data_runs; r++) {
+        if (vsfs_overlay_claim(img, runs[r].start, runs[r].length, 0) < 0) {
+            perror("Failed to claim overlay blocks");
+            return -1;
+        }
+        if (vsfs_copy_in(img, runs[r].start, delta->fd, next * BS, (uint64_t)runs[r].length * BS) < 0) {
+            perror("Failed to write file data");
+            return -1;
+        }
+        next += runs[r].length;
+    }
+
+    uint64_t count = hdr->runs - hdr->data_runs;
+    uint64_t *targets = malloc((count ? count : 1) * sizeof(uint64_t));
+    uint8_t **blocks = malloc((count ? count : 1) * sizeof(uint8_t *));
+    if (!targets || !blocks) {
+        perror("Memory allocation failed");
+        free(targets);
+        free(blocks);
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        targets[i] = runs[hdr->data_runs + i].start;
+        blocks[i] = vsfs_block(delta, next + i);
+    }
+
+    // The superblock is the delta's last block, so it lands last
+    int ret = vsfs_commit_blocks(img, count, targets, blocks);
+    free(targets);
+    free(blocks);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+    crc32_fast_init();
+
+    cli_args_t args;
+    if (parse_args(argc, argv, &args) < 0) {
+        return 1;
+    }
+
+    vsfs_image_t img = {0}, delta = {0};
+    int ret = 1;
+    if (vsfs_open(&img, args.image_name, 1) < 0) {
+        return 1;
+    }
+    // An interrupted batch or apply is finished before the base is compared
+    if (vsfs_check(&img) < 0 || vsfs_journal_recover(&img) < 0) {
+        goto out;
+    }
+
+    int delta_fd = open(args.delta_name, O_RDONLY);
+    if (delta_fd < 0) {
+        perror("Failed to open delta");
+        goto out;
+    }
+    if (vsfs_map(&delta, delta_fd, 0, 0) < 0) {
+        close(delta_fd);
+        goto out;
+    }
+    delta.owns_fd = 1;
+
+    if (delta_verify(&img, &delta) < 0 || delta_apply(&img, &delta) < 0) {
+        goto out;
+    }
+
+    const delta_header_t *hdr = (const delta_header_t *)vsfs_block(&delta, 0);
+    printf("Delta '%s' applied to '%s': %lu runs, %lu blocks\n", args.delta_name, args.image_name,
+           hdr->runs, hdr->blocks);
+    ret = 0;
+
+out:
+    vsfs_close(&delta);
+    if (vsfs_close(&img) != 0) {
+        ret = 1;
+    }
+    return ret;
+}
@@ -1,5 +1,6 @@
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,123 +10,54 @@
 #include <time.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
-#define BS 4096u               
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "aio.h"
+#include "bitmap.h"
+#include "crc32.h"
+#include "minivsfs.h"
+#include "stats.h"
 
-uint64_t g_random_seed = 0; 
+// Limits: extents carry 64-bit block numbers; 1 PiB keeps size arithmetic far from overflow
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB (1ull << 40)
+#define MIN_INODES 128ull
+#define MAX_INODES (1ull << 30)
 
+// Default journal: 1/64 of the image, at least enough for a small batch, at most 64 MiB
+#define MIN_JOURNAL_BLOCKS 16ull
+#define MAX_JOURNAL_BLOCKS 16384ull
+#define JOURNAL_DEFAULT UINT64_MAX
+
+uint64_t g_random_seed = 0; 
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;              
-    uint32_t version;          
-    uint32_t block_size;        
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start; 
-    uint64_t inode_bitmap_blocks; 
-    uint64_t data_bitmap_start;  
-    uint64_t data_bitmap_blocks;  
-    uint64_t inode_table_start;   
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;       
-    uint64_t mtime_epoch;
-    uint32_t flags;             
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;           
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;          
-    uint16_t links;        
-    uint32_t uid;            
-    uint32_t gid;            
-    uint64_t size_bytes;    
-    uint64_t atime;        
-    uint64_t mtime;        
-    uint64_t ctime;          
-    uint32_t direct[12];     
-    uint32_t reserved_0;    
-    uint32_t reserved_1;    
-    uint32_t reserved_2;    
-    uint32_t proj_id;       
-    uint32_t uid16_gid16;  
-    uint64_t xattr_ptr;     
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;  
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;     
-    uint8_t type;           
-    char name[58];         
-    uint8_t checksum;     
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
 
 // Command line arguments 
 typedef struct {
     char *image_name;
-    uint32_t size_kib;
-    uint32_t inode_count;
+    uint64_t size_kib;
+    uint64_t inode_count;
+    uint64_t journal_blocks;
+    int preallocate;
+    int dedup;
+    int stats;                   // 1: text, 2: JSON
+    char *from_dir;              // host directory to import, or NULL
+    char *base_name;             // --base: create an overlay of this image instead
+    int io_backend;
 } cli_args_t;
 
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// Parsing a non-negative decimal number; 0 on malformed input
+uint64_t parse_u64(const char *str) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || str[0] == '-') {
+        return 0;
     }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; 
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   
-    de->checksum = x;
+    return v;
 }
 
 // Command line arguments parsing
@@ -135,42 +67,113 @@ int parse_args(int argc, char *argv[], cli_args_t *args) {
         {"image", required_argument, 0, 'i'},
         {"size-kib", required_argument, 0, 's'},
         {"inodes", required_argument, 0, 'n'},
+        {"preallocate", no_argument, 0, 'p'},
+        {"journal-blocks", required_argument, 0, 'j'},
+        {"dedup", no_argument, 0, 'd'},
+        {"stats", optional_argument, 0, 'S'},
+        {"from-dir", required_argument, 0, 'D'},
+        {"io", required_argument, 0, 'I'},
+        {"base", required_argument, 0, 'B'},
         {0, 0, 0, 0}
     };
     
     args->image_name = NULL;
     args->size_kib = 0;
     args->inode_count = 0;
+    args->preallocate = 0;
+    args->journal_blocks = JOURNAL_DEFAULT;
+    args->dedup = 0;
+    args->stats = 0;
+    args->from_dir = NULL;
+    args->base_name = NULL;
+    args->io_backend = VSFS_IO_AUTO;
     
-    while ((opt = getopt_long(argc, argv, "i:s:n:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:s:n:pj:dS::D:I:B:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
                 args->image_name = optarg;
                 break;
             case 's':
-                args->size_kib = atoi(optarg);
+                args->size_kib = parse_u64(optarg);
                 break;
             case 'n':
-                args->inode_count = atoi(optarg);
+                args->inode_count = parse_u64(optarg);
+                break;
+            case 'p':
+                args->preallocate = 1;
+                break;
+            case 'j':
+                args->journal_blocks = strcmp(optarg, "0") == 0 ? 0 : parse_u64(optarg);
+                if (args->journal_blocks == 0 && strcmp(optarg, "0") != 0) {
+                    args->journal_blocks = 1; // rejected below
+                }
+                break;
+            case 'd':
+                args->dedup = 1;
+                break;
+            case 'S':
+                if (optarg && strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Error: Unknown stats format '%s' (only json)\n", optarg);
+                    return -1;
+                }
+                args->stats = optarg ? 2 : 1;
+                break;
+            case 'D':
+                args->from_dir = optarg;
+                break;
+            case 'B':
+                args->base_name = optarg;
+                break;
+            case 'I':
+                if (strcmp(optarg, "auto") == 0) {
+                    args->io_backend = VSFS_IO_AUTO;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    args->io_backend = VSFS_IO_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    args->io_backend = VSFS_IO_THREADS;
+                } else if (strcmp(optarg, "sync") == 0) {
+                    args->io_backend = VSFS_IO_SYNC;
+                } else {
+                    fprintf(stderr, "Error: Unknown I/O backend '%s' (auto, uring, threads or sync)\n", optarg);
+                    return -1;
+                }
                 break;
             default:
                 return -1;
         }
     }
     
+    // An overlay takes its geometry from the base
+    if (args->image_name && args->base_name) {
+        if (args->from_dir || args->dedup) {
+            fprintf(stderr, "Error: --base cannot be combined with --from-dir or --dedup\n");
+            return -1;
+        }
+        return 0;
+    }
+    
     // Validation
     if (!args->image_name || args->size_kib == 0 || args->inode_count == 0) {
-        fprintf(stderr, "Usage: mkfs_builder --image <file> --size-kib <180..4096> --inodes <128..512>\n");
+        fprintf(stderr, "Usage: mkfs_builder --image <file> --size-kib <%llu..%llu> --inodes <%llu..%llu> [--preallocate] [--journal-blocks <n>] [--dedup] [--from-dir <dir>] [--io auto|uring|threads|sync] [--stats[=json]]\n"
+                        "       mkfs_builder --image <file> --base <image> [--preallocate] [--stats[=json]]\n",
+                MIN_SIZE_KIB, (unsigned long long)MAX_SIZE_KIB, MIN_INODES, MAX_INODES);
+        return -1;
+    }
+    
+    if (args->size_kib < MIN_SIZE_KIB || args->size_kib > MAX_SIZE_KIB || args->size_kib % 4 != 0) {
+        fprintf(stderr, "Error: size-kib must be between %llu-%llu and multiple of 4\n",
+                MIN_SIZE_KIB, (unsigned long long)MAX_SIZE_KIB);
         return -1;
     }
     
-    if (args->size_kib < 180 || args->size_kib > 4096 || args->size_kib % 4 != 0) {
-        fprintf(stderr, "Error: size-kib must be between 180-4096 and multiple of 4\n");
+    if (args->inode_count < MIN_INODES || args->inode_count > MAX_INODES) {
+        fprintf(stderr, "Error: inode count must be between %llu-%llu\n", MIN_INODES, MAX_INODES);
         return -1;
     }
     
-    if (args->inode_count < 128 || args->inode_count > 512) {
-        fprintf(stderr, "Error: inode count must be between 128-512\n");
+    // A header, a descriptor and one logged block at the very least; 0 disables the journal
+    if (args->journal_blocks != JOURNAL_DEFAULT && args->journal_blocks != 0 && args->journal_blocks < 3) {
+        fprintf(stderr, "Error: journal-blocks must be 0 or at least 3\n");
         return -1;
     }
     
@@ -178,25 +181,55 @@ int parse_args(int argc, char *argv[], cli_args_t *args) {
 }
 
 // Superblock creation
-void create_superblock(superblock_t *sb, uint32_t size_kib, uint32_t inode_count) {
+void create_superblock(superblock_t *sb, uint64_t size_kib, uint64_t inode_count, uint64_t journal_blocks, int dedup) {
     memset(sb, 0, sizeof(superblock_t));
     
     uint64_t total_blocks = (size_kib * 1024) / BS;
+    uint64_t inode_bitmap_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
     uint64_t inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS; 
+    if (journal_blocks == JOURNAL_DEFAULT) {
+        journal_blocks = total_blocks / 64;
+        journal_blocks = journal_blocks < MIN_JOURNAL_BLOCKS ? MIN_JOURNAL_BLOCKS : journal_blocks;
+        journal_blocks = journal_blocks > MAX_JOURNAL_BLOCKS ? MAX_JOURNAL_BLOCKS : journal_blocks;
+    }
+    
+    // One reference count per data block, sized by the whole image (slight overestimate)
+    uint64_t refcount_blocks = dedup ? (total_blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK : 0;
     
-    sb->magic = 0x4D565346;
-    sb->version = 1;
+    // One summary entry per bitmap block, the data bitmap sized by the whole image (slight overestimate)
+    uint64_t summary_entries = inode_bitmap_blocks + (total_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t summary_blocks = (summary_entries + SUMMARY_PER_BLOCK - 1) / SUMMARY_PER_BLOCK;
+    
+    // Data bitmap sized for every block left after the fixed metadata (slight overestimate)
+    uint64_t fixed_blocks = 1 + inode_bitmap_blocks + inode_table_blocks + journal_blocks + refcount_blocks + summary_blocks;
+    uint64_t data_bitmap_blocks = 1;
+    if (total_blocks > fixed_blocks) {
+        data_bitmap_blocks = (total_blocks - fixed_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    }
+    uint64_t data_region_start = fixed_blocks + data_bitmap_blocks;
+    
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
     sb->block_size = BS;
     sb->total_blocks = total_blocks;
     sb->inode_count = inode_count;
     sb->inode_bitmap_start = 1;
-    sb->inode_bitmap_blocks = 1;
-    sb->data_bitmap_start = 2;
-    sb->data_bitmap_blocks = 1;
-    sb->inode_table_start = 3;
+    sb->inode_bitmap_blocks = inode_bitmap_blocks;
+    sb->data_bitmap_start = 1 + inode_bitmap_blocks;
+    sb->data_bitmap_blocks = data_bitmap_blocks;
+    sb->inode_table_start = sb->data_bitmap_start + data_bitmap_blocks;
     sb->inode_table_blocks = inode_table_blocks;
-    sb->data_region_start = 3 + inode_table_blocks;
-    sb->data_region_blocks = total_blocks - (3 + inode_table_blocks);
+    // The journal sits between the inode table and the data region
+    sb->journal_start = journal_blocks ? sb->inode_table_start + inode_table_blocks : 0;
+    sb->journal_blocks = journal_blocks;
+    // Then the reference-count table, all zeros: no block is shared yet
+    sb->refcount_start = refcount_blocks ? sb->inode_table_start + inode_table_blocks + journal_blocks : 0;
+    sb->refcount_blocks = refcount_blocks;
+    // Then the free-bit summary, filled in once the bitmaps are written
+    sb->summary_start = sb->inode_table_start + inode_table_blocks + journal_blocks + refcount_blocks;
+    sb->summary_blocks = summary_blocks;
+    sb->data_region_start = data_region_start;
+    sb->data_region_blocks = total_blocks > data_region_start ? total_blocks - data_region_start : 0;
     sb->root_inode = ROOT_INO;
     sb->mtime_epoch = time(NULL);
     sb->flags = 0;
@@ -218,15 +251,13 @@ void create_root_inode(inode_t *root_inode, uint64_t data_region_start, uint32_t
     root_inode->ctime = now;
     
     // Root directory first block assignment
-    root_inode->direct[0] = data_region_start;
-    for (int i = 1; i < 12; i++) {
-        root_inode->direct[i] = 0; 
-    }
+    root_inode->extents[0].start = data_region_start;
+    root_inode->extents[0].length = 1;
     
-    root_inode->reserved_0 = 0;
-    root_inode->reserved_1 = 0;
+    root_inode->flags = INODE_FL_EXTENTS;
+    root_inode->extent_count = 1;
     root_inode->reserved_2 = 0;
-    root_inode->proj_id = 1;
+    root_inode->proj_id = proj_id;
     root_inode->uid16_gid16 = 0;
     root_inode->xattr_ptr = 0;
 }
@@ -236,136 +267,727 @@ void create_root_directory_entries(dirent64_t *entries) {
     // Create . entry
     memset(&entries[0], 0, sizeof(dirent64_t));
     entries[0].inode_no = ROOT_INO;
-    entries[0].type = 2; 
+    entries[0].type = DIRENT_DIR;
     strcpy(entries[0].name, ".");
     
     memset(&entries[1], 0, sizeof(dirent64_t));
     entries[1].inode_no = ROOT_INO;
-    entries[1].type = 2;
+    entries[1].type = DIRENT_DIR;
     strcpy(entries[1].name, "..");
     
     dirent_checksum_finalize(&entries[0]);
     dirent_checksum_finalize(&entries[1]);
 }
 
-// Bitmap set
-void set_bitmap_bit(uint8_t *bitmap, uint32_t bit_index) {
-    uint32_t byte_index = bit_index / 8;
-    uint32_t bit_offset = bit_index % 8;
-    bitmap[byte_index] |= (1 << bit_offset);
+// --from-dir: the host tree is walked and laid out in full, then written in
+// one pass. Nodes are in breadth-first order with each directory's children
+// sorted by name, so node i is inode i + 1 and siblings are adjacent.
+typedef struct {
+    char *path;                  // host path
+    char name[DIRENT_NAME_MAX + 1];
+    uint64_t parent;             // node index; the root is its own parent
+    int is_dir;
+    uint64_t size;               // regular files
+    uint64_t mtime;
+    uint64_t first_child;        // directories: children are [first_child, first_child + nchildren)
+    uint64_t nchildren;
+    uint64_t start;              // first data block; 0 if none
+    uint64_t nblocks;
+} tree_node_t;
+
+typedef struct {
+    tree_node_t *nodes;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;              // file data
+    uint64_t used_blocks;        // data blocks, from the start of the data region
+} tree_t;
+
+// A child of a hashed directory, in hash order
+typedef struct {
+    uint32_t hash;
+    uint64_t node;
+} dx_child_t;
+
+int tree_name_cmp(const void *a, const void *b) {
+    return strcmp(((const tree_node_t *)a)->name, ((const tree_node_t *)b)->name);
+}
+
+int dx_child_cmp(const void *a, const void *b) {
+    const dx_child_t *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+int tree_push(tree_t *t, const tree_node_t *node) {
+    if (t->count == t->cap) {
+        uint64_t cap = t->cap ? t->cap * 2 : 256;
+        tree_node_t *nodes = realloc(t->nodes, cap * sizeof(tree_node_t));
+        if (!nodes) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        t->nodes = nodes;
+        t->cap = cap;
+    }
+    t->nodes[t->count++] = *node;
+    return 0;
+}
+
+void tree_free(tree_t *t) {
+    for (uint64_t i = 0; i < t->count; i++) {
+        free(t->nodes[i].path);
+    }
+    free(t->nodes);
+}
+
+// Appending one directory's regular files and subdirectories as its children
+int tree_scan_dir(tree_t *t, uint64_t dir_index) {
+    const char *dir_path = t->nodes[dir_index].path;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    DIR *d = opendir(dir_path);
+    if (!d) {
+        fprintf(stderr, "Error: Cannot open directory '%s': %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t first = t->count;
+    int ret = 0;
+    for (;;) {
+        errno = 0;
+        struct dirent *de = readdir(d);
+        if (!de) {
+            if (errno != 0) {
+                fprintf(stderr, "Error: Cannot read directory '%s': %s\n", dir_path, strerror(errno));
+                ret = -1;
+            }
+            break;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t len = strlen(dir_path) + strlen(de->d_name) + 2;
+        char *path = malloc(len);
+        if (!path) {
+            perror("Memory allocation failed");
+            ret = -1;
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir_path, de->d_name);
+
+        struct stat st;
+        vsfs_stats_syscall(VSFS_SYS_OTHER);
+        if (lstat(path, &st) != 0) {
+            fprintf(stderr, "Error: Cannot stat '%s': %s\n", path, strerror(errno));
+            free(path);
+            ret = -1;
+            break;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Warning: Skipping '%s': not a regular file or directory\n", path);
+            free(path);
+            continue;
+        }
+        if (strlen(de->d_name) > DIRENT_NAME_MAX) {
+            fprintf(stderr, "Error: Name of '%s' is longer than %zu bytes\n", path, DIRENT_NAME_MAX);
+            free(path);
+            ret = -1;
+            break;
+        }
+
+        tree_node_t node;
+        memset(&node, 0, sizeof(node));
+        node.path = path;
+        strcpy(node.name, de->d_name);
+        node.parent = dir_index;
+        node.is_dir = S_ISDIR(st.st_mode);
+        node.size = node.is_dir ? 0 : (uint64_t)st.st_size;
+        node.mtime = st.st_mtime;
+        if (tree_push(t, &node) < 0) {
+            free(path);
+            ret = -1;
+            break;
+        }
+    }
+    closedir(d);
+
+    qsort(&t->nodes[first], t->count - first, sizeof(tree_node_t), tree_name_cmp);
+    t->nodes[dir_index].first_child = first;
+    t->nodes[dir_index].nchildren = t->count - first;
+    return ret;
+}
+
+// Walking the host tree under root breadth-first
+int tree_walk(tree_t *t, const char *root) {
+    memset(t, 0, sizeof(*t));
+    struct stat st;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a directory\n", root);
+        return -1;
+    }
+
+    tree_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.path = strdup(root);
+    node.is_dir = 1;
+    node.mtime = st.st_mtime;
+    if (!node.path || tree_push(t, &node) < 0) {
+        free(node.path);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < t->count; i++) {
+        if (!t->nodes[i].is_dir) {
+            t->files++;
+            t->bytes += t->nodes[i].size;
+        } else if (t->dirs++, tree_scan_dir(t, i) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The children of a directory in hash order; NULL on error
+dx_child_t *dir_hash_order(const tree_t *t, uint64_t d) {
+    const tree_node_t *dir = &t->nodes[d];
+    dx_child_t *order = malloc(dir->nchildren * sizeof(dx_child_t));
+    if (!order) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    for (uint64_t c = 0; c < dir->nchildren; c++) {
+        order[c].node = dir->first_child + c;
+        order[c].hash = dirent_name_hash(t->nodes[dir->first_child + c].name);
+    }
+    qsort(order, dir->nchildren, sizeof(dx_child_t), dx_child_cmp);
+    return order;
+}
+
+// Packing hash-ordered entries into full leaves without splitting a run of
+// equal hashes; records where each leaf starts (if starts) and returns the count
+int64_t dx_pack_leaves(const dx_child_t *order, uint64_t n, uint64_t *starts) {
+    uint64_t leaves = 0;
+    for (uint64_t i = 0; i < n;) {
+        uint64_t end = n - i > DIRENTS_PER_BLOCK ? i + DIRENTS_PER_BLOCK : n;
+        while (end < n && end > i && order[end].hash == order[end - 1].hash) {
+            end--;
+        }
+        if (end == i) {
+            fprintf(stderr, "Error: Too many directory entries share one name hash\n");
+            return -1;
+        }
+        if (starts) {
+            starts[leaves] = i;
+        }
+        leaves++;
+        i = end;
+    }
+    return leaves;
+}
+
+// Index nodes under the root for a hashed directory with leaves leaves
+uint64_t dx_index_nodes(uint64_t leaves) {
+    return leaves <= DX_ROOT_LIMIT ? 0 : (leaves + DX_NODE_LIMIT - 1) / DX_NODE_LIMIT;
+}
+
+// Blocks of a directory: one linear block, or the index root, index nodes and full leaves
+int64_t dir_blocks(const tree_t *t, uint64_t d) {
+    const tree_node_t *dir = &t->nodes[d];
+    if (dir->nchildren + 2 <= DIRENTS_PER_BLOCK) {
+        return 1;
+    }
+    dx_child_t *order = dir_hash_order(t, d);
+    if (!order) {
+        return -1;
+    }
+    int64_t leaves = dx_pack_leaves(order, dir->nchildren, NULL);
+    free(order);
+    if (leaves < 0) {
+        return -1;
+    }
+    uint64_t nodes = dx_index_nodes(leaves);
+    if (nodes > DX_ROOT_LIMIT) {
+        fprintf(stderr, "Error: Directory '%s' has too many entries\n", dir->path);
+        return -1;
+    }
+    return 1 + nodes + leaves;
+}
+
+// Placing every node's blocks back to back from the start of the data region
+int tree_layout(tree_t *t, const superblock_t *sb) {
+    if (t->count > sb->inode_count) {
+        fprintf(stderr, "Error: '%s' holds %lu files and directories, the image has %lu inodes\n",
+                t->nodes[0].path, t->count, sb->inode_count);
+        return -1;
+    }
+
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < t->count; i++) {
+        tree_node_t *node = &t->nodes[i];
+        int64_t blocks;
+        if (node->is_dir) {
+            blocks = dir_blocks(t, i);
+            if (blocks < 0) {
+                return -1;
+            }
+        } else {
+            // Small files stay inline; larger ones get one contiguous run
+            blocks = node->size <= INODE_INLINE_MAX ? 0 : (int64_t)((node->size + BS - 1) / BS);
+            if ((uint64_t)blocks > (uint64_t)INODE_EXTENTS * UINT32_MAX) {
+                fprintf(stderr, "Error: '%s' is too large\n", node->path);
+                return -1;
+            }
+        }
+        if ((uint64_t)blocks > sb->data_region_blocks - next) {
+            fprintf(stderr, "Error: '%s' does not fit: the image has %lu data blocks\n",
+                    node->path, sb->data_region_blocks);
+            return -1;
+        }
+        node->start = blocks ? sb->data_region_start + next : 0;
+        node->nblocks = blocks;
+        next += blocks;
+    }
+    t->used_blocks = next;
+    return 0;
+}
+
+void dirent_fill(dirent64_t *de, uint32_t inode_no, uint8_t type, const char *name) {
+    memset(de, 0, sizeof(dirent64_t));
+    de->inode_no = inode_no;
+    de->type = type;
+    strcpy(de->name, name);
+    dirent_checksum_finalize(de);
+}
+
+void dirent_fill_child(dirent64_t *de, const tree_t *t, uint64_t node) {
+    dirent_fill(de, (uint32_t)(node + 1), t->nodes[node].is_dir ? DIRENT_DIR : DIRENT_FILE, t->nodes[node].name);
+}
+
+// Writing a directory's blocks
+int tree_write_dir(vsfs_image_t *img, const tree_t *t, uint64_t d) {
+    const tree_node_t *dir = &t->nodes[d];
+    uint8_t *b0 = vsfs_block(img, dir->start);
+    if (!b0) {
+        fprintf(stderr, "Error: Directory block %lu is not mapped\n", dir->start);
+        return -1;
+    }
+    dirent64_t *dots = (dirent64_t *)b0;
+    dirent_fill(&dots[0], (uint32_t)(d + 1), DIRENT_DIR, ".");
+    dirent_fill(&dots[1], (uint32_t)(dir->parent + 1), DIRENT_DIR, "..");
+    if (dir->nblocks == 1) {
+        for (uint64_t c = 0; c < dir->nchildren; c++) {
+            dirent_fill_child(&dots[2 + c], t, dir->first_child + c);
+        }
+        return 0;
+    }
+
+    dx_child_t *order = dir_hash_order(t, d);
+    uint64_t *starts = order ? malloc(dir->nchildren * sizeof(uint64_t)) : NULL;
+    int64_t leaves = starts ? dx_pack_leaves(order, dir->nchildren, starts) : -1;
+    if (leaves < 0) {
+        free(order);
+        free(starts);
+        return -1;
+    }
+    uint64_t nodes = dx_index_nodes(leaves);
+
+    // Leaves follow the index nodes
+    for (int64_t l = 0; l < leaves; l++) {
+        dirent64_t *leaf = (dirent64_t *)vsfs_block(img, dir->start + 1 + nodes + l);
+        uint64_t end = l + 1 < leaves ? starts[l + 1] : dir->nchildren;
+        for (uint64_t j = starts[l]; j < end; j++) {
+            dirent_fill_child(&leaf[j - starts[l]], t, order[j].node);
+        }
+    }
+
+    // Each index entry carries the lowest hash below it; entry 0 covers everything lower
+    dx_header_t *root = dx_header(b0, 0);
+    root->magic = DX_MAGIC;
+    root->levels = nodes ? 1 : 0;
+    root->limit = DX_ROOT_LIMIT;
+    if (nodes == 0) {
+        root->count = (uint32_t)leaves;
+        for (int64_t l = 0; l < leaves; l++) {
+            dx_entries(root)[l].hash = l ? order[starts[l]].hash : 0;
+            dx_entries(root)[l].block = (uint32_t)(1 + l);
+        }
+    } else {
+        root->count = (uint32_t)nodes;
+        for (uint64_t m = 0; m < nodes; m++) {
+            uint64_t first = m * DX_NODE_LIMIT;
+            uint64_t count = leaves - first < DX_NODE_LIMIT ? leaves - first : DX_NODE_LIMIT;
+            dx_header_t *hdr = dx_header(vsfs_block(img, dir->start + 1 + m), 1 + m);
+            hdr->magic = DX_MAGIC;
+            hdr->levels = 0;
+            hdr->count = (uint32_t)count;
+            hdr->limit = DX_NODE_LIMIT;
+            for (uint64_t k = 0; k < count; k++) {
+                dx_entries(hdr)[k].hash = first + k ? order[starts[first + k]].hash : 0;
+                dx_entries(hdr)[k].block = (uint32_t)(1 + nodes + first + k);
+            }
+            dx_entries(root)[m].hash = dx_entries(hdr)[0].hash;
+            dx_entries(root)[m].block = (uint32_t)(1 + m);
+        }
+    }
+    free(order);
+    free(starts);
+    return 0;
+}
+
+// Marking bits [0, count) of a bitmap
+void set_bitmap_prefix(uint8_t *bitmap, uint64_t count) {
+    memset(bitmap, 0xFF, count / 8);
+    for (uint64_t b = count / 8 * 8; b < count; b++) {
+        set_bitmap_bit(bitmap, b);
+    }
+}
+
+// Writing the inodes, bitmaps and directories, and queueing file data
+int tree_write(vsfs_image_t *img, vsfs_aio_t *aio, const tree_t *t) {
+    set_bitmap_prefix(vsfs_inode_bitmap(img), t->count);
+    set_bitmap_prefix(vsfs_data_bitmap(img), t->used_blocks);
+
+    time_t now = time(NULL);
+    for (uint64_t i = 0; i < t->count; i++) {
+        const tree_node_t *node = &t->nodes[i];
+        inode_t *ino = vsfs_inode(img, (uint32_t)(i + 1));
+        memset(ino, 0, sizeof(inode_t));
+        ino->atime = now;
+        ino->mtime = node->mtime;
+        ino->ctime = now;
+
+        if (node->is_dir) {
+            // As mkfs_adder counts them: one link and one entry per child
+            ino->mode = 0040000;
+            ino->links = node->nchildren + 2 < UINT16_MAX ? (uint16_t)(node->nchildren + 2) : UINT16_MAX;
+            ino->size_bytes = (node->nchildren + 2) * sizeof(dirent64_t);
+            ino->flags = INODE_FL_EXTENTS | (node->nblocks > 1 ? INODE_FL_HTREE : 0);
+            ino->extent_count = 1;
+            ino->extents[0].start = node->start;
+            ino->extents[0].length = (uint32_t)node->nblocks;
+            ino->proj_id = 1;
+            inode_crc_finalize(ino);
+            if (tree_write_dir(img, t, i) < 0) {
+                return -1;
+            }
+            vsfs_stats_bytes(0, node->nblocks * BS);
+            continue;
+        }
+
+        ino->mode = 0100000;
+        ino->links = 1;
+        ino->size_bytes = node->size;
+        if (node->nblocks == 0) {
+            ino->flags = INODE_FL_INLINE;
+        } else {
+            ino->flags = INODE_FL_EXTENTS;
+            for (uint64_t done = 0; done < node->nblocks; ino->extent_count++) {
+                uint64_t run = node->nblocks - done < UINT32_MAX ? node->nblocks - done : UINT32_MAX;
+                ino->extents[ino->extent_count].start = node->start + done;
+                ino->extents[ino->extent_count].length = (uint32_t)run;
+                done += run;
+            }
+        }
+
+        if (node->size > 0) {
+            vsfs_stats_syscall(VSFS_SYS_OTHER);
+            int fd = open(node->path, O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "Error: Cannot open '%s': %s\n", node->path, strerror(errno));
+                return -1;
+            }
+            if (node->nblocks == 0) {
+                // Read now: the inode is the only place the data goes
+                ssize_t got = pread(fd, ino->direct, node->size, 0);
+                vsfs_stats_syscall(VSFS_SYS_READ);
+                close(fd);
+                if (got != (ssize_t)node->size) {
+                    fprintf(stderr, "Error: Cannot read '%s'\n", node->path);
+                    return -1;
+                }
+                vsfs_stats_bytes(node->size, 0);
+            } else {
+                // Blocks ascend with the node order, so the copies sweep the image front to back
+                if (vsfs_aio_copy_in(aio, node->start, fd, 0, node->size) < 0) {
+                    fprintf(stderr, "Error: Cannot copy '%s': %s\n", node->path, strerror(errno));
+                    vsfs_aio_close(aio, fd);
+                    return -1;
+                }
+                vsfs_aio_close(aio, fd);
+            }
+        }
+        inode_crc_finalize(ino);
+    }
+    // The inode table blocks holding the tree
+    vsfs_stats_bytes(0, (t->count * INODE_SIZE + BS - 1) / BS * BS);
+    return 0;
+}
+
+// Creating an overlay of a base image: the base's superblock with the overlay
+// fields set and a presence bitmap holding only block 0. Every other block is
+// read from the base until something writes it.
+int create_overlay(const cli_args_t *args, vsfs_stats_t *stats) {
+    char *base_path = realpath(args->base_name, NULL);
+    if (!base_path) {
+        fprintf(stderr, "Error: Cannot find base image '%s': %s\n", args->base_name, strerror(errno));
+        return -1;
+    }
+    vsfs_image_t base;
+    if (vsfs_open(&base, base_path, 0) < 0) {
+        free(base_path);
+        return -1;
+    }
+
+    int ret = -1;
+    int img_fd = -1;
+    const superblock_t *bsb = vsfs_sb(&base);
+    if (vsfs_check(&base) < 0) {
+        goto out;
+    }
+    if (base.overlay) {
+        fprintf(stderr, "Error: Base image '%s' is itself an overlay\n", base_path);
+        goto out;
+    }
+    if (vsfs_journal_pending(&base)) {
+        fprintf(stderr, "Error: Base image has an unreplayed journal; run mkfs_fsck --replay first\n");
+        goto out;
+    }
+    uint8_t block[BS];
+    superblock_t *sb = (superblock_t *)block;
+    if (strlen(base_path) >= sizeof(sb->base_image)) {
+        fprintf(stderr, "Error: Base image path '%s' is too long\n", base_path);
+        goto out;
+    }
+    vsfs_stats_phase(stats, "layout");
+
+    uint64_t total = bsb->total_blocks;
+    uint64_t presence_blocks = (total + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    img_fd = open(args->image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img_fd < 0) {
+        perror("Failed to create image file");
+        goto out;
+    }
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int size_ret = args->preallocate ? posix_fallocate(img_fd, 0, (total + presence_blocks) * BS)
+                                     : (ftruncate(img_fd, (total + presence_blocks) * BS) == 0 ? 0 : errno);
+    if (size_ret != 0) {
+        errno = size_ret;
+        perror(args->preallocate ? "Failed to preallocate image" : "Failed to size image");
+        goto out;
+    }
+    vsfs_stats_phase(stats, "create");
+
+    memcpy(block, vsfs_block(&base, 0), BS);
+    sb->overlay_start = total;
+    sb->overlay_blocks = presence_blocks;
+    sb->base_checksum = bsb->checksum;
+    strcpy(sb->base_image, base_path);
+    sb->mtime_epoch = time(NULL);
+    superblock_crc_finalize(sb);
+    uint8_t present = 1;
+    vsfs_stats_syscall(VSFS_SYS_WRITE);
+    vsfs_stats_syscall(VSFS_SYS_WRITE);
+    if (pwrite(img_fd, block, BS, 0) != BS || pwrite(img_fd, &present, 1, total * BS) != 1) {
+        perror("Failed to write overlay");
+        goto out;
+    }
+    vsfs_stats_bytes(0, BS + 1);
+    vsfs_stats_phase(stats, "format");
+
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    if (close(img_fd) != 0) {
+        img_fd = -1;
+        perror("Failed to close image file");
+        goto out;
+    }
+    img_fd = -1;
+    vsfs_stats_phase(stats, "close");
+
+    printf("MiniVSFS overlay '%s' created over base '%s'\n", args->image_name, base_path);
+    printf("Size: %lu KiB (%lu blocks)\n", total * BS / 1024, total);
+    printf("Inodes: %lu\n", bsb->inode_count);
+    if (args->stats) {
+        vsfs_stats_value(stats, "free_inodes", bsb->free_inodes);
+        vsfs_stats_value(stats, "free_blocks", bsb->free_blocks);
+        vsfs_stats_print(stats, stdout, "mkfs_builder", args->stats == 2);
+    }
+    ret = 0;
+
+out:
+    if (img_fd >= 0) {
+        close(img_fd);
+        unlink(args->image_name);
+    }
+    vsfs_close(&base);
+    free(base_path);
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
     crc32_init();
+    crc32_fast_init();
     
     // Command line parsing
     cli_args_t args;
     if (parse_args(argc, argv, &args) < 0) {
         return 1;
     }
+    vsfs_stats_t stats;
+    vsfs_stats_start(&stats);
+    if (args.base_name) {
+        return create_overlay(&args, &stats) < 0 ? 1 : 0;
+    }
+    
+    // Walking the source tree before anything is created
+    tree_t tree;
+    memset(&tree, 0, sizeof(tree));
+    if (args.from_dir) {
+        if (tree_walk(&tree, args.from_dir) < 0) {
+            tree_free(&tree);
+            return 1;
+        }
+        vsfs_stats_phase(&stats, "walk");
+    }
     
     // Calculating filesystem parameters
-    uint64_t total_blocks = (args.size_kib * 1024) / BS;
-    uint64_t inode_table_blocks = (args.inode_count * INODE_SIZE + BS - 1) / BS;
-    uint64_t data_region_start = 3 + inode_table_blocks;
+    superblock_t layout;
+    create_superblock(&layout, args.size_kib, args.inode_count, args.journal_blocks, args.dedup);
+    uint64_t total_blocks = layout.total_blocks;
+    uint64_t data_region_start = layout.data_region_start;
     
     // Size validation
     if (data_region_start >= total_blocks) {
         fprintf(stderr, "Error: Filesystem too small for given parameters\n");
+        tree_free(&tree);
         return 1;
     } 
-    FILE *img_file = fopen(args.image_name, "wb");
-    if (!img_file) {
-        perror("Failed to create image file");
-        return 1;
-    }
     
-    // Superblock writing
-    uint8_t *block = calloc(1, BS);
-    if (!block) {
-        perror("Memory allocation failed");
-        fclose(img_file);
+    // Every inode number and block of the tree is fixed before the first write
+    if (args.from_dir && tree_layout(&tree, &layout) < 0) {
+        tree_free(&tree);
         return 1;
     }
-    
-    superblock_t *sb = (superblock_t *)block;
-    create_superblock(sb, args.size_kib, args.inode_count);
-    superblock_crc_finalize(sb);
-    
-    if (fwrite(block, BS, 1, img_file) != 1) {
-        perror("Failed to write superblock");
-        free(block);
-        fclose(img_file);
+    uint64_t used_blocks = args.from_dir ? tree.used_blocks : 1;
+    // Only the inode table blocks holding used inodes are ever written; the rest need not even be zero
+    uint64_t used_inodes = args.from_dir ? tree.count : 1;
+    layout.inode_table_init = (used_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    vsfs_stats_phase(&stats, "layout");
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int img_fd = open(args.image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img_fd < 0) {
+        perror("Failed to create image file");
+        tree_free(&tree);
         return 1;
     }
     
-    // Inode bitmap creation
-    memset(block, 0, BS);
-    set_bitmap_bit(block, 0); 
+    // Sizing the image up front; untouched blocks stay holes and read as zero
+    vsfs_stats_syscall(VSFS_SYS_OTHER);
+    int size_ret = args.preallocate ? posix_fallocate(img_fd, 0, total_blocks * BS)
+                                    : (ftruncate(img_fd, total_blocks * BS) == 0 ? 0 : errno);
+    if (size_ret != 0) {
+        errno = size_ret;
+        perror(args.preallocate ? "Failed to preallocate image" : "Failed to size image");
+        goto fail;
+    }
+    vsfs_stats_phase(&stats, "create");
     
-    if (fwrite(block, BS, 1, img_file) != 1) {
-        perror("Failed to write inode bitmap");
-        free(block);
-        fclose(img_file);
-        return 1;
+    // Mapping only the metadata and the blocks in use; the rest of the data region stays untouched
+    vsfs_image_t img;
+    if (vsfs_map(&img, img_fd, 1, data_region_start + used_blocks) < 0) {
+        goto fail;
     }
     
-    // Data bitmap creation
-    memset(block, 0, BS);
-    set_bitmap_bit(block, 0); 
+    // Superblock writing
+    superblock_t *sb = vsfs_sb(&img);
+    memcpy(sb, &layout, sizeof(superblock_t));
     
-    if (fwrite(block, BS, 1, img_file) != 1) {
-        perror("Failed to write data bitmap");
-        free(block);
-        fclose(img_file);
-        return 1;
-    }
+    // Empty journal: only its header block is non-zero
+    vsfs_journal_format(&img);
     
-    // Inode table creation
-    for (uint64_t i = 0; i < inode_table_blocks; i++) {
-        memset(block, 0, BS);
-        
-        if (i == 0) {
-            inode_t *root_inode = (inode_t *)block;
-            create_root_inode(root_inode, data_region_start, 1);
-            inode_crc_finalize(root_inode);
+    const char *io_backend = NULL;
+    if (args.from_dir) {
+        // One pass front to back: metadata through the mapping, file data read in parallel
+        vsfs_aio_t *aio = vsfs_aio_start(&img, args.io_backend, AIO_DEPTH);
+        if (!aio) {
+            vsfs_close(&img);
+            goto fail;
         }
-
-        // Zero filling
-        
-        if (fwrite(block, BS, 1, img_file) != 1) {
-            perror("Failed to write inode table");
-            free(block);
-            fclose(img_file);
-            return 1;
+        io_backend = vsfs_aio_backend(aio);
+        int write_ret = tree_write(&img, aio, &tree);
+        vsfs_stats_bytes(0, 3 * BS);
+        vsfs_stats_phase(&stats, "format");
+        if (vsfs_aio_finish(aio) < 0) {
+            perror("Failed to copy file data");
+            write_ret = -1;
+        }
+        vsfs_stats_phase(&stats, "data");
+        if (write_ret < 0) {
+            vsfs_close(&img);
+            goto fail;
         }
+    } else {
+        // Bitmaps: only the first block of each is non-zero
+        set_bitmap_bit(vsfs_inode_bitmap(&img), 0);
+        set_bitmap_bit(vsfs_data_bitmap(&img), 0);
+        
+        // Inode table: only the block holding the root inode is non-zero
+        inode_t *root_inode = vsfs_inode(&img, ROOT_INO);
+        create_root_inode(root_inode, data_region_start, 1);
+        inode_crc_finalize(root_inode);
+        
+        // Data block root directory entries
+        dirent64_t *entries = (dirent64_t *)vsfs_block(&img, data_region_start);
+        create_root_directory_entries(entries);
+        // Superblock, both bitmaps, the root inode's block, the root directory and the summary (the journal counts itself)
+        vsfs_stats_bytes(0, 6 * BS);
+        vsfs_stats_phase(&stats, "format");
     }
     
-    // Data block writing
-    uint64_t data_region_blocks = total_blocks - data_region_start;
+    // Free counters and the summary come from the finished bitmaps; the checksum covers them
+    vsfs_summary_build(&img);
+    superblock_crc_finalize(sb);
+    vsfs_stats_bytes(0, (layout.summary_blocks - 1) * BS);
+    uint64_t free_inodes = sb->free_inodes, free_blocks = sb->free_blocks;
     
-    for (uint64_t i = 0; i < data_region_blocks; i++) {
-        memset(block, 0, BS);
-        
-        if (i == 0) {
-            // Data block root directory entries
-            dirent64_t *entries = (dirent64_t *)block;
-            create_root_directory_entries(entries);
-        }
-        if (fwrite(block, BS, 1, img_file) != 1) {
-            perror("Failed to write data block");
-            free(block);
-            fclose(img_file);
-            return 1;
-        }
+    int close_ret = vsfs_close(&img);
+    if (close(img_fd) != 0 || close_ret != 0) {
+        perror("Failed to close image file");
+        img_fd = -1;
+        goto fail;
     }
-    
-    free(block);
-    fclose(img_file);
+    vsfs_stats_phase(&stats, "close");
     
     printf("MiniVSFS image '%s' created successfully\n", args.image_name);
-    printf("Size: %u KiB (%lu blocks)\n", args.size_kib, total_blocks);
-    printf("Inodes: %u\n", args.inode_count);
+    printf("Size: %lu KiB (%lu blocks)\n", args.size_kib, total_blocks);
+    printf("Inodes: %lu\n", args.inode_count);
+    printf("Journal: %lu blocks\n", layout.journal_blocks);
+    if (args.from_dir) {
+        printf("Imported '%s': %lu files, %lu directories, %lu bytes in %lu data blocks\n",
+               args.from_dir, tree.files, tree.dirs, tree.bytes, tree.used_blocks);
+        printf("File data I/O: %s\n", io_backend);
+    }
+    if (args.stats) {
+        vsfs_stats_value(&stats, "free_inodes", free_inodes);
+        vsfs_stats_value(&stats, "free_blocks", free_blocks);
+        vsfs_stats_print(&stats, stdout, "mkfs_builder", args.stats == 2);
+    }
+    tree_free(&tree);
     
     return 0;
-}
\ No newline at end of file
+
+fail:
+    // No half-built image is left behind
+    if (img_fd >= 0) {
+        close(img_fd);
+    }
+    unlink(args.image_name);
+    tree_free(&tree);
+    return 1;
+}
@@ -0,0 +1,718 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "crc32.h"
+#include "minivsfs.h"
+
+#define MAX_THREADS 256
+#define INODE_CHUNK 4096u              // inodes per unit of work
+#define MAX_REPORTED 100               // problems printed; the rest are only counted
+
+// Command line arguments structure
+typedef struct {
+    char *image_name;
+    int threads;
+    int replay;
+} cli_args_t;
+
+// State shared by the workers; the reference maps are updated with atomics
+typedef struct {
+    vsfs_image_t img;
+    const superblock_t *sb;
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    uint64_t *block_refs;              // bit i: data block data_region_start + i is referenced
+    const uint16_t *refcounts;         // the image's reference-count table, if it has one
+    uint16_t *extra_refs;              // references beyond the first, with a refcount table
+    uint16_t *inode_refs;              // directory entries naming inode i + 1 (saturating)
+    uint64_t next_chunk;               // work queue cursor, in INODE_CHUNK units
+    uint64_t problems;
+    uint64_t inodes_used;
+    uint64_t blocks_used;
+    pthread_mutex_t report_lock;
+} fsck_t;
+
+typedef struct {
+    fsck_t *ck;
+    int index;
+    int nthreads;
+} worker_t;
+
+// Counting a problem, printing only the first MAX_REPORTED
+__attribute__((format(printf, 2, 3)))
+void report(fsck_t *ck, const char *fmt, ...) {
+    uint64_t n = __atomic_add_fetch(&ck->problems, 1, __ATOMIC_RELAXED);
+    if (n > MAX_REPORTED) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&ck->report_lock);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    if (n == MAX_REPORTED) {
+        fprintf(stderr, "(further problems are counted but not listed)\n");
+    }
+    pthread_mutex_unlock(&ck->report_lock);
+    va_end(ap);
+}
+
+int parse_args(int argc, char *argv[], cli_args_t *args) {
+    int opt;
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"threads", required_argument, 0, 't'},
+        {"replay", no_argument, 0, 'r'},
+        {0, 0, 0, 0}
+    };
+
+    memset(args, 0, sizeof(*args));
+    while ((opt = getopt_long(argc, argv, "i:t:r", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                args->image_name = optarg;
+                break;
+            case 't':
+                args->threads = atoi(optarg);
+                break;
+            case 'r':
+                args->replay = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (!args->image_name || args->threads < 0 || args->threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: mkfs_fsck --image <file> [--threads <1..%d>] [--replay]\n", MAX_THREADS);
+        return -1;
+    }
+    if (args->threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        args->threads = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : (int)n;
+    }
+    return 0;
+}
+
+int inode_in_use(const fsck_t *ck, uint32_t inode_num) {
+    return (ck->inode_bitmap[(inode_num - 1) / 8] >> ((inode_num - 1) % 8)) & 1;
+}
+
+// Marking a run of data blocks as referenced by inode_num; overlaps are double allocations
+void mark_run(fsck_t *ck, uint32_t inode_num, uint64_t start, uint64_t len) {
+    const superblock_t *sb = ck->sb;
+    if (len == 0 || start < sb->data_region_start || start >= sb->total_blocks ||
+        len > sb->total_blocks - start) {
+        report(ck, "inode %u: blocks %lu+%lu outside the data region", inode_num, start, len);
+        return;
+    }
+
+    uint64_t bit = start - sb->data_region_start;
+    uint64_t end = bit + len;
+    while (bit < end) {
+        uint64_t word = bit / 64;
+        uint64_t lo = bit % 64;
+        uint64_t n = end - bit < 64 - lo ? end - bit : 64 - lo;
+        uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << lo;
+        uint64_t old = __atomic_fetch_or(&ck->block_refs[word], mask, __ATOMIC_RELAXED);
+        // Shared blocks are legal where the table says so; compare_worker checks the counts
+        if ((old & mask) && ck->extra_refs) {
+            for (uint64_t dup = old & mask; dup; dup &= dup - 1) {
+                __atomic_add_fetch(&ck->extra_refs[word * 64 + (uint64_t)__builtin_ctzll(dup)], 1, __ATOMIC_RELAXED);
+            }
+        } else if (old & mask) {
+            uint64_t first = word * 64 + (uint64_t)__builtin_ctzll(old & mask);
+            report(ck, "block %lu is allocated more than once (again by inode %u)",
+                   sb->data_region_start + first, inode_num);
+        }
+        bit += n;
+    }
+}
+
+// Returning the inode's leaf extents (zero-copy: in the inode or an index block), NULL if malformed
+const extent_t *inode_extent_list(fsck_t *ck, uint32_t inode_num, const inode_t *ino, extent_t **owned) {
+    *owned = NULL;
+    if (ino->extent_count <= INODE_EXTENTS) {
+        return ino->extents;
+    }
+
+    uint32_t index_blocks = (ino->extent_count + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    if (index_blocks > INODE_EXTENTS) {
+        report(ck, "inode %u: %u extents exceed the index capacity", inode_num, ino->extent_count);
+        return NULL;
+    }
+    extent_t *list = malloc(ino->extent_count * sizeof(extent_t));
+    if (!list) {
+        report(ck, "inode %u: out of memory reading %u extents", inode_num, ino->extent_count);
+        return NULL;
+    }
+
+    uint32_t filled = 0;
+    for (uint32_t i = 0; i < index_blocks; i++) {
+        uint32_t n = ino->extents[i].length;
+        const uint8_t *block = vsfs_block(&ck->img, ino->extents[i].start);
+        if (n == 0 || n > EXTENTS_PER_BLOCK || n > ino->extent_count - filled || !block) {
+            report(ck, "inode %u: bad extent index entry %u", inode_num, i);
+            free(list);
+            return NULL;
+        }
+        mark_run(ck, inode_num, ino->extents[i].start, 1);
+        memcpy(&list[filled], block, n * sizeof(extent_t));
+        filled += n;
+    }
+    if (filled != ino->extent_count) {
+        report(ck, "inode %u: extent index holds %u of %u extents", inode_num, filled, ino->extent_count);
+        free(list);
+        return NULL;
+    }
+    *owned = list;
+    return list;
+}
+
+// Physical block of each logical directory block, or NULL
+uint64_t *dir_block_map(const extent_t *extents, uint32_t count, uint64_t nblocks) {
+    uint64_t *phys = malloc(nblocks * sizeof(uint64_t));
+    if (!phys) {
+        return NULL;
+    }
+    uint64_t l = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < extents[i].length; j++) {
+            phys[l++] = extents[i].start + j;
+        }
+    }
+    return phys;
+}
+
+int dirent_name_cmp(const void *a, const void *b) {
+    return strncmp(((const dirent64_t *)a)->name, ((const dirent64_t *)b)->name, sizeof(((dirent64_t *)0)->name));
+}
+
+// First directory block of inode_num, for checking a child's ".."
+const dirent64_t *dir_first_block(fsck_t *ck, uint32_t inode_num) {
+    const inode_t *ino = vsfs_inode(&ck->img, inode_num);
+    if (!(ino->flags & INODE_FL_EXTENTS) || ino->extent_count == 0) {
+        return NULL;
+    }
+    uint64_t first = ino->extents[0].start;
+    if (ino->extent_count > INODE_EXTENTS) {
+        const extent_t *index = (const extent_t *)vsfs_block(&ck->img, first);
+        if (!index) {
+            return NULL;
+        }
+        first = index[0].start;
+    }
+    if (first < ck->sb->data_region_start || first >= ck->sb->total_blocks) {
+        return NULL;
+    }
+    return (const dirent64_t *)vsfs_block(&ck->img, first);
+}
+
+// Checking one live entry of directory dir_ino and counting the reference
+void check_dirent(fsck_t *ck, uint32_t dir_ino, const dirent64_t *de) {
+    const superblock_t *sb = ck->sb;
+    if (de->inode_no == 0 || de->inode_no > sb->inode_count) {
+        report(ck, "directory %u: entry '%.57s' names invalid inode %u", dir_ino, de->name, de->inode_no);
+        return;
+    }
+    if (de->name[0] == '\0' || strchr(de->name, '/') || strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) {
+        report(ck, "directory %u: invalid entry name '%.57s'", dir_ino, de->name);
+    }
+
+    // Saturating reference count
+    uint16_t seen = __atomic_load_n(&ck->inode_refs[de->inode_no - 1], __ATOMIC_RELAXED);
+    while (seen < UINT16_MAX &&
+           !__atomic_compare_exchange_n(&ck->inode_refs[de->inode_no - 1], &seen, seen + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if (!vsfs_inode_initialized(&ck->img, de->inode_no)) {
+        report(ck, "directory %u: entry '%.57s' names inode %u past the inode table's high-water mark",
+               dir_ino, de->name, de->inode_no);
+        return;
+    }
+    const inode_t *child = vsfs_inode(&ck->img, de->inode_no);
+    int is_dir = (child->mode & 0170000) == 0040000;
+    if (de->type != (is_dir ? DIRENT_DIR : DIRENT_FILE)) {
+        report(ck, "directory %u: entry '%.57s' has type %u but inode %u has mode %o",
+               dir_ino, de->name, de->type, de->inode_no, child->mode);
+        return;
+    }
+    if (is_dir && inode_in_use(ck, de->inode_no)) {
+        const dirent64_t *child_entries = dir_first_block(ck, de->inode_no);
+        if (child_entries && child_entries[1].inode_no != dir_ino) {
+            report(ck, "directory %u: '..' is %u, but it is linked from directory %u",
+                   de->inode_no, child_entries[1].inode_no, dir_ino);
+        }
+    }
+}
+
+// Following the hash index the way a lookup would; returns the leaf for hash h
+uint64_t dx_route(uint8_t *root, uint8_t **node_blocks, uint32_t h) {
+    dx_header_t *hdr = dx_header(root, 0);
+    uint64_t l = dx_entries(hdr)[dx_search(hdr, h)].block;
+    if (hdr->levels == 1) {
+        dx_header_t *nhdr = dx_header(node_blocks[l], l);
+        l = dx_entries(nhdr)[dx_search(nhdr, h)].block;
+    }
+    return l;
+}
+
+// Validating the hash index of a directory; marks index nodes in is_node
+int check_dx(fsck_t *ck, uint32_t dir_ino, uint8_t **blocks, uint64_t nblocks, uint8_t *is_node) {
+    dx_header_t *hdr = dx_header(blocks[0], 0);
+    if (hdr->magic != DX_MAGIC || hdr->levels > 1 || hdr->count == 0 || hdr->count > DX_ROOT_LIMIT ||
+        hdr->limit != DX_ROOT_LIMIT) {
+        report(ck, "directory %u: corrupt index root", dir_ino);
+        return -1;
+    }
+
+    dx_header_t *levels[1 + DX_ROOT_LIMIT];
+    uint64_t nodes[1 + DX_ROOT_LIMIT];
+    uint32_t nlevels = 1;
+    levels[0] = hdr;
+    nodes[0] = 0;
+    for (uint32_t i = 0; hdr->levels == 1 && i < hdr->count; i++) {
+        uint64_t l = dx_entries(hdr)[i].block;
+        if (l == 0 || l >= nblocks || is_node[l]) {
+            report(ck, "directory %u: index entry points at block %lu", dir_ino, l);
+            return -1;
+        }
+        dx_header_t *nhdr = dx_header(blocks[l], l);
+        if (nhdr->magic != DX_MAGIC || nhdr->levels != 0 || nhdr->count == 0 ||
+            nhdr->count > DX_NODE_LIMIT || nhdr->limit != DX_NODE_LIMIT) {
+            report(ck, "directory %u: corrupt index node at block %lu", dir_ino, l);
+            return -1;
+        }
+        is_node[l] = 1;
+        levels[nlevels] = nhdr;
+        nodes[nlevels++] = l;
+    }
+
+    // Hashes ascend within every index block; the bottom level names leaves
+    for (uint32_t k = 0; k < nlevels; k++) {
+        dx_entry_t *e = dx_entries(levels[k]);
+        int leaf_level = hdr->levels == 0 || k > 0;
+        for (uint32_t i = 0; i < levels[k]->count; i++) {
+            if (i > 0 && e[i].hash < e[i - 1].hash) {
+                report(ck, "directory %u: index block %lu is not sorted", dir_ino, nodes[k]);
+                return -1;
+            }
+            if (leaf_level && (e[i].block == 0 || e[i].block >= nblocks || is_node[e[i].block])) {
+                report(ck, "directory %u: index entry points at block %u", dir_ino, e[i].block);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Checking a directory's entries, index and child links
+void check_dir(fsck_t *ck, uint32_t dir_ino, const inode_t *ino, const extent_t *extents, uint64_t nblocks) {
+    uint64_t *phys = dir_block_map(extents, ino->extent_count, nblocks);
+    uint8_t **blocks = malloc(nblocks * sizeof(uint8_t *));
+    uint8_t *is_node = calloc(nblocks, 1);
+    dirent64_t *names = malloc(nblocks * DIRENTS_PER_BLOCK * sizeof(dirent64_t));
+    if (!phys || !blocks || !is_node || !names) {
+        report(ck, "directory %u: out of memory", dir_ino);
+        goto out;
+    }
+    for (uint64_t l = 0; l < nblocks; l++) {
+        blocks[l] = vsfs_block(&ck->img, phys[l]);
+    }
+
+    const dirent64_t *dots = (const dirent64_t *)blocks[0];
+    if (dots[0].inode_no != dir_ino || strcmp(dots[0].name, ".") != 0 || dots[0].type != DIRENT_DIR ||
+        dots[1].inode_no == 0 || strcmp(dots[1].name, "..") != 0 || dots[1].type != DIRENT_DIR) {
+        report(ck, "directory %u: missing '.' or '..'", dir_ino);
+    }
+    if (dir_ino == ROOT_INO && dots[1].inode_no != ROOT_INO) {
+        report(ck, "root directory: '..' is %u", dots[1].inode_no);
+    }
+
+    int htree = (ino->flags & INODE_FL_HTREE) != 0;
+    if (htree && check_dx(ck, dir_ino, blocks, nblocks, is_node) < 0) {
+        goto out;
+    }
+
+    uint64_t count = 0;
+    for (uint64_t l = 0; l < nblocks; l++) {
+        if (is_node[l]) {
+            continue;
+        }
+        const dirent64_t *entries = (const dirent64_t *)blocks[l];
+        int first = l == 0 ? 2 : 0;
+        int last = l == 0 && htree ? 2 : DIRENTS_PER_BLOCK;
+        for (int i = 0; i < last; i++) {
+            const dirent64_t *de = &entries[i];
+            if (de->inode_no == 0) {
+                continue;
+            }
+            dirent64_t tmp = *de;
+            dirent_checksum_finalize(&tmp);
+            if (tmp.checksum != de->checksum) {
+                report(ck, "directory %u: entry %d of block %lu has a bad checksum", dir_ino, i, l);
+            }
+            if (!memchr(de->name, '\0', sizeof(de->name))) {
+                report(ck, "directory %u: entry %d of block %lu has an unterminated name", dir_ino, i, l);
+                continue;
+            }
+            if (i < first) {
+                continue;
+            }
+            if (htree && dx_route(blocks[0], blocks, dirent_name_hash(de->name)) != l) {
+                report(ck, "directory %u: entry '%s' is not where the index says", dir_ino, de->name);
+            }
+            names[count++] = *de;
+            check_dirent(ck, dir_ino, de);
+        }
+    }
+
+    qsort(names, count, sizeof(dirent64_t), dirent_name_cmp);
+    for (uint64_t i = 1; i < count; i++) {
+        if (dirent_name_cmp(&names[i - 1], &names[i]) == 0) {
+            report(ck, "directory %u: duplicate entry '%s'", dir_ino, names[i].name);
+        }
+    }
+
+out:
+    free(phys);
+    free(blocks);
+    free(is_node);
+    free(names);
+}
+
+// Decompressing every cluster of a compressed file, and checking that the
+// stream fills exactly the blocks it maps
+void check_compressed(fsck_t *ck, uint32_t inode_num, const inode_t *ino, const extent_t *extents, uint64_t nblocks) {
+    uint64_t clusters = (ino->size_bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    uint64_t end = 0;
+    if (clusters == 0 ||
+        vsfs_stream_read(&ck->img, extents, ino->extent_count, sizeof(cluster_map_t) + (clusters - 1) * sizeof(uint64_t),
+                         &end, sizeof(end)) < 0 ||
+        (end + BS - 1) / BS != nblocks) {
+        report(ck, "inode %u: compressed stream of %lu bytes does not fill its %lu blocks", inode_num, end, nblocks);
+        return;
+    }
+
+    uint8_t *out = malloc(CLUSTER_SIZE);
+    if (!out) {
+        report(ck, "inode %u: out of memory checking compressed data", inode_num);
+        return;
+    }
+    for (uint64_t c = 0; c < clusters; c++) {
+        if (vsfs_cluster_read(&ck->img, extents, ino->extent_count, ino->size_bytes, c, out) < 0) {
+            report(ck, "inode %u: compressed cluster %lu is corrupt", inode_num, c);
+            break;
+        }
+    }
+    free(out);
+}
+
+// Checking an in-use inode and marking every block it references
+void check_inode(fsck_t *ck, uint32_t inode_num) {
+    const inode_t *ino = vsfs_inode(&ck->img, inode_num);
+
+    inode_t tmp = *ino;
+    inode_crc_finalize(&tmp);
+    if (tmp.inode_crc != ino->inode_crc) {
+        report(ck, "inode %u: bad checksum", inode_num);
+    }
+
+    int is_dir = (ino->mode & 0170000) == 0040000;
+    if (!is_dir && (ino->mode & 0170000) != 0100000) {
+        report(ck, "inode %u: unknown mode %o", inode_num, ino->mode);
+        return;
+    }
+    if (inode_num == ROOT_INO && !is_dir) {
+        report(ck, "root inode is not a directory");
+        return;
+    }
+    // Inline files own no blocks
+    if (ino->flags & INODE_FL_INLINE) {
+        if (is_dir || (ino->flags & INODE_FL_EXTENTS) || ino->extent_count != 0 ||
+            ino->size_bytes > INODE_INLINE_MAX) {
+            report(ck, "inode %u: bad inline data (%lu bytes)", inode_num, ino->size_bytes);
+        }
+        return;
+    }
+    if (!(ino->flags & INODE_FL_EXTENTS)) {
+        report(ck, "inode %u: not extent mapped", inode_num);
+        return;
+    }
+
+    extent_t *owned;
+    const extent_t *extents = inode_extent_list(ck, inode_num, ino, &owned);
+    if (!extents) {
+        return;
+    }
+    uint64_t nblocks = 0;
+    int bad = 0;
+    for (uint32_t i = 0; i < ino->extent_count; i++) {
+        if (extents[i].length == 0 || extents[i].start < ck->sb->data_region_start ||
+            extents[i].start >= ck->sb->total_blocks ||
+            extents[i].length > ck->sb->total_blocks - extents[i].start) {
+            report(ck, "inode %u: extent %u (%lu+%u) outside the data region",
+                   inode_num, i, extents[i].start, extents[i].length);
+            bad = 1;
+            continue;
+        }
+        mark_run(ck, inode_num, extents[i].start, extents[i].length);
+        nblocks += extents[i].length;
+    }
+
+    if (!bad && is_dir) {
+        if (nblocks == 0) {
+            report(ck, "directory %u has no blocks", inode_num);
+        } else {
+            check_dir(ck, inode_num, ino, extents, nblocks);
+        }
+    } else if (!bad && (ino->flags & INODE_FL_COMPRESSED)) {
+        check_compressed(ck, inode_num, ino, extents, nblocks);
+    } else if (!bad && nblocks != (ino->size_bytes + BS - 1) / BS) {
+        report(ck, "inode %u: %lu bytes but %lu blocks mapped", inode_num, ino->size_bytes, nblocks);
+    }
+    free(owned);
+}
+
+// Pass 1: checking in-use inodes, INODE_CHUNK at a time from a shared cursor
+void *scan_worker(void *arg) {
+    fsck_t *ck = ((worker_t *)arg)->ck;
+    uint64_t count = ck->sb->inode_count;
+
+    for (;;) {
+        uint64_t chunk = __atomic_fetch_add(&ck->next_chunk, 1, __ATOMIC_RELAXED);
+        uint64_t first = chunk * INODE_CHUNK;
+        if (first >= count) {
+            break;
+        }
+        uint64_t end = first + INODE_CHUNK < count ? first + INODE_CHUNK : count;
+        // Visiting set bits only: mostly empty tables are skipped a word at a time
+        for (uint64_t i = bitmap_find_set(ck->inode_bitmap, end, first); i < end;
+             i = bitmap_find_set(ck->inode_bitmap, end, i + 1)) {
+            // Past the high-water mark the table is never read
+            if (!vsfs_inode_initialized(&ck->img, (uint32_t)(i + 1))) {
+                report(ck, "inode %lu is marked used past the inode table's high-water mark", i + 1);
+                continue;
+            }
+            check_inode(ck, (uint32_t)(i + 1));
+        }
+    }
+    return NULL;
+}
+
+// Pass 2: comparing both bitmaps with what pass 1 found referenced, over this worker's slice
+void *compare_worker(void *arg) {
+    worker_t *w = arg;
+    fsck_t *ck = w->ck;
+    const superblock_t *sb = ck->sb;
+
+    uint64_t inodes = sb->inode_count;
+    uint64_t ifirst = inodes * w->index / w->nthreads;
+    uint64_t iend = inodes * (w->index + 1) / w->nthreads;
+    uint64_t used_inodes = 0;
+    for (uint64_t i = ifirst; i < iend; i++) {
+        uint32_t inode_num = (uint32_t)(i + 1);
+        int used = inode_in_use(ck, inode_num);
+        uint16_t refs = ck->inode_refs[i];
+        used_inodes += used;
+        if (!used) {
+            if (refs) {
+                report(ck, "inode %u is linked from a directory but marked free", inode_num);
+            }
+            continue;
+        }
+        if (!vsfs_inode_initialized(&ck->img, inode_num)) {
+            continue;
+        }
+        const inode_t *ino = vsfs_inode(&ck->img, inode_num);
+        int is_dir = (ino->mode & 0170000) == 0040000;
+        if (refs == 0 && inode_num != ROOT_INO) {
+            report(ck, "inode %u is marked used but not linked from any directory", inode_num);
+        } else if (is_dir && refs > 1) {
+            report(ck, "directory %u is linked %u times", inode_num, refs);
+        } else if (!is_dir && refs != ino->links) {
+            report(ck, "inode %u: link count %u, but %u directory entries", inode_num, ino->links, refs);
+        }
+    }
+
+    uint64_t words = (sb->data_region_blocks + 63) / 64;
+    uint64_t wfirst = words * w->index / w->nthreads;
+    uint64_t wend = words * (w->index + 1) / w->nthreads;
+    uint64_t used_blocks = 0;
+    for (uint64_t wd = wfirst; wd < wend; wd++) {
+        uint64_t valid = wd == words - 1 && sb->data_region_blocks % 64 ? (1ull << (sb->data_region_blocks % 64)) - 1 : ~0ull;
+        uint64_t marked = (wd == words - 1 ? bitmap_load_tail(ck->data_bitmap, wd, sb->data_region_blocks)
+                                          : bitmap_load64(ck->data_bitmap, wd)) & valid;
+        uint64_t refs = ck->block_refs[wd];
+        used_blocks += (uint64_t)__builtin_popcountll(marked);
+        for (uint64_t diff = marked ^ refs; diff; diff &= diff - 1) {
+            uint64_t bit = (uint64_t)__builtin_ctzll(diff);
+            uint64_t blk = sb->data_region_start + wd * 64 + bit;
+            if (refs >> bit & 1) {
+                report(ck, "block %lu is in use but marked free in the data bitmap", blk);
+            } else {
+                report(ck, "block %lu is marked used but not referenced by any inode", blk);
+            }
+        }
+    }
+
+    // Every data block's extra references must match the table, free ones included
+    uint64_t bfirst = wfirst * 64;
+    uint64_t bend = wend * 64 < sb->data_region_blocks ? wend * 64 : sb->data_region_blocks;
+    for (uint64_t i = bfirst; ck->refcounts && i < bend; i++) {
+        if (ck->extra_refs[i] != ck->refcounts[i]) {
+            report(ck, "block %lu: %u references recorded, %u found", sb->data_region_start + i,
+                   ck->refcounts[i] + 1u, ck->extra_refs[i] + 1u);
+        }
+    }
+
+    __atomic_add_fetch(&ck->inodes_used, used_inodes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ck->blocks_used, used_blocks, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Pass 3: the superblock's free counters and the per-block summary against the bitmaps
+void check_summary(fsck_t *ck) {
+    const superblock_t *sb = ck->sb;
+    const uint32_t *summary = vsfs_summary(&ck->img);
+    if (sb->free_inodes != sb->inode_count - ck->inodes_used) {
+        report(ck, "superblock counts %lu free inodes, bitmap has %lu", sb->free_inodes, sb->inode_count - ck->inodes_used);
+    }
+    if (sb->free_blocks != sb->data_region_blocks - ck->blocks_used) {
+        report(ck, "superblock counts %lu free blocks, bitmap has %lu", sb->free_blocks, sb->data_region_blocks - ck->blocks_used);
+    }
+    for (uint64_t i = 0; i < sb->inode_bitmap_blocks + sb->data_bitmap_blocks; i++) {
+        int data = i >= sb->inode_bitmap_blocks;
+        uint32_t clear = data ? vsfs_bitmap_block_free(ck->data_bitmap, i - sb->inode_bitmap_blocks, sb->data_region_blocks)
+                              : vsfs_bitmap_block_free(ck->inode_bitmap, i, sb->inode_count);
+        if (summary[i] != clear) {
+            report(ck, "summary: %s bitmap block %lu has %u free bits, recorded %u", data ? "data" : "inode",
+                   data ? i - sb->inode_bitmap_blocks : i, clear, summary[i]);
+        }
+    }
+    if (crc32_fast(summary, sb->summary_blocks * BS) != sb->summary_crc) {
+        report(ck, "summary checksum mismatch");
+    }
+}
+
+int run_workers(fsck_t *ck, int nthreads, void *(*fn)(void *)) {
+    pthread_t tids[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (worker_t){ck, i, nthreads};
+        if (pthread_create(&tids[i], NULL, fn, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (started < nthreads) {
+        // Whatever did not get a thread runs here
+        for (int i = started; i < nthreads; i++) {
+            fn(&workers[i]);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+    crc32_fast_init();
+
+    cli_args_t args;
+    if (parse_args(argc, argv, &args) < 0) {
+        return 1;
+    }
+
+    fsck_t ck;
+    memset(&ck, 0, sizeof(ck));
+    pthread_mutex_init(&ck.report_lock, NULL);
+    // Only --replay opens the image writable
+    if (vsfs_open(&ck.img, args.image_name, args.replay) < 0) {
+        return 1;
+    }
+    int ret = 1;
+    if (vsfs_check(&ck.img) < 0) {
+        goto out;
+    }
+    if (args.replay && vsfs_journal_recover(&ck.img) < 0) {
+        goto out;
+    }
+    ck.sb = vsfs_sb(&ck.img);
+    ck.inode_bitmap = vsfs_inode_bitmap(&ck.img);
+    ck.data_bitmap = vsfs_data_bitmap(&ck.img);
+
+    printf("Checking MiniVSFS image: %lu blocks, %lu inodes, %d threads\n",
+           ck.sb->total_blocks, ck.sb->inode_count, args.threads);
+    if (ck.img.overlay) {
+        const uint8_t *present = vsfs_block(&ck.img, ck.sb->overlay_start);
+        uint64_t local = ck.sb->total_blocks - bitmap_count_clear(present, ck.sb->total_blocks);
+        printf("Overlay over '%s': %lu of %lu blocks local\n", ck.sb->base_image, local, ck.sb->total_blocks);
+    }
+    fflush(stdout);
+
+    uint8_t *sb_copy = malloc(BS);
+    ck.block_refs = calloc((ck.sb->data_region_blocks + 63) / 64, sizeof(uint64_t));
+    ck.inode_refs = calloc(ck.sb->inode_count, sizeof(uint16_t));
+    ck.refcounts = vsfs_refcounts(&ck.img);
+    ck.extra_refs = ck.refcounts ? calloc(ck.sb->data_region_blocks, sizeof(uint16_t)) : NULL;
+    if (!sb_copy || !ck.block_refs || !ck.inode_refs || (ck.refcounts && !ck.extra_refs)) {
+        perror("Memory allocation failed");
+        free(sb_copy);
+        goto out;
+    }
+
+    memcpy(sb_copy, ck.sb, BS);
+    if (superblock_crc_finalize((superblock_t *)sb_copy) != ck.sb->checksum) {
+        report(&ck, "superblock checksum mismatch");
+    }
+    free(sb_copy);
+    if (vsfs_journal_pending(&ck.img)) {
+        report(&ck, "journal holds a committed transaction; rerun with --replay");
+    } else if (ck.sb->journal_blocks && ((journal_header_t *)vsfs_block(&ck.img, ck.sb->journal_start))->magic != JOURNAL_MAGIC) {
+        report(&ck, "journal header at block %lu is corrupt", ck.sb->journal_start);
+    }
+    if (ck.img.overlay && !(vsfs_block(&ck.img, ck.sb->overlay_start)[0] & 1)) {
+        report(&ck, "overlay superblock is not marked present");
+    }
+    if (ck.sb->root_inode != ROOT_INO || !inode_in_use(&ck, ROOT_INO)) {
+        report(&ck, "root inode %lu missing", ck.sb->root_inode);
+    }
+
+    vsfs_advise(&ck.img, ck.sb->inode_table_start, ck.sb->inode_table_init, MADV_WILLNEED);
+    run_workers(&ck, args.threads, scan_worker);
+    run_workers(&ck, args.threads, compare_worker);
+    check_summary(&ck);
+
+    printf("%lu inodes and %lu data blocks in use\n", ck.inodes_used, ck.blocks_used);
+    if (ck.problems == 0) {
+        printf("Image is clean\n");
+        ret = 0;
+    } else {
+        printf("%lu problems found\n", ck.problems);
+    }
+
+out:
+    free(ck.block_refs);
+    free(ck.extra_refs);
+    free(ck.inode_refs);
+    vsfs_close(&ck.img);
+    pthread_mutex_destroy(&ck.report_lock);
+    return ret;
+}
@@ -0,0 +1,622 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "minivsfs.h"
+
+// Command line arguments structure
+typedef struct {
+    char *image_name;
+    char **file_names;
+    uint32_t file_count;
+    int64_t truncate_size;       // -1: unlink
+} cli_args_t;
+
+// Private copies of the metadata blocks this run rewrites, committed as one
+// transaction. Reads go through them too, so later files see earlier changes.
+typedef struct {
+    vsfs_image_t *img;
+    superblock_t *sb;            // the private copy of block 0
+    uint64_t *targets;
+    uint8_t **blocks;
+    uint64_t count;
+    uint64_t capacity;
+    extent_t *freed;             // data runs freed, punched once the metadata is committed
+    uint64_t freed_count;
+    uint64_t freed_capacity;
+    uint64_t freed_blocks;
+    uint64_t released_refs;      // references dropped from blocks that stay shared
+} rm_t;
+
+int parse_args(int argc, char *argv[], cli_args_t *args) {
+    int opt;
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"file", required_argument, 0, 'f'},
+        {"truncate", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->truncate_size = -1;
+    while ((opt = getopt_long(argc, argv, "i:f:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                args->image_name = optarg;
+                break;
+            case 'f': {
+                char **names = realloc(args->file_names, (args->file_count + 1) * sizeof(char *));
+                if (!names) {
+                    perror("Memory allocation failed");
+                    return -1;
+                }
+                args->file_names = names;
+                args->file_names[args->file_count++] = optarg;
+                break;
+            }
+            case 't': {
+                char *end;
+                errno = 0;
+                long long size = strtoll(optarg, &end, 10);
+                if (errno || *end || size < 0) {
+                    fprintf(stderr, "Error: --truncate takes a size in bytes\n");
+                    return -1;
+                }
+                args->truncate_size = size;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    if (!args->image_name || args->file_count == 0) {
+        fprintf(stderr, "Usage: mkfs_rm --image <file> --file <path> [--file <path> ...] [--truncate <bytes>]\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The current contents of a block: this run's copy if it has one, else the image
+uint8_t *view_block(const rm_t *rm, uint64_t block_no) {
+    for (uint64_t i = 0; i < rm->count; i++) {
+        if (rm->targets[i] == block_no) {
+            return rm->blocks[i];
+        }
+    }
+    return vsfs_block(rm->img, block_no);
+}
+
+// A block to modify, copied from the image on first use
+uint8_t *meta_block(rm_t *rm, uint64_t block_no) {
+    for (uint64_t i = 0; i < rm->count; i++) {
+        if (rm->targets[i] == block_no) {
+            return rm->blocks[i];
+        }
+    }
+    if (rm->count == rm->capacity) {
+        uint64_t cap = rm->capacity ? rm->capacity * 2 : 16;
+        uint64_t *targets = realloc(rm->targets, cap * sizeof(uint64_t));
+        if (targets) {
+            rm->targets = targets;
+        }
+        uint8_t **blocks = realloc(rm->blocks, cap * sizeof(uint8_t *));
+        if (blocks) {
+            rm->blocks = blocks;
+        }
+        if (!targets || !blocks) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        rm->capacity = cap;
+    }
+    uint8_t *copy = malloc(BS);
+    if (!copy) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memcpy(copy, vsfs_block(rm->img, block_no), BS);
+    rm->targets[rm->count] = block_no;
+    rm->blocks[rm->count++] = copy;
+    return copy;
+}
+
+void rm_free(rm_t *rm) {
+    for (uint64_t i = 0; i < rm->count; i++) {
+        free(rm->blocks[i]);
+    }
+    free(rm->targets);
+    free(rm->blocks);
+    free(rm->freed);
+}
+
+inode_t *rm_inode(rm_t *rm, uint32_t inode_num, int for_write) {
+    uint64_t block_no = rm->sb->inode_table_start + (inode_num - 1) / INODES_PER_BLOCK;
+    uint8_t *block = for_write ? meta_block(rm, block_no) : view_block(rm, block_no);
+    return block ? (inode_t *)(block + (uint64_t)(inode_num - 1) % INODES_PER_BLOCK * INODE_SIZE) : NULL;
+}
+
+// Adding one to the summary entry of bitmap block i (inode bitmap blocks first)
+int summary_release(rm_t *rm, uint64_t i) {
+    uint32_t *summary = (uint32_t *)meta_block(rm, rm->sb->summary_start + i / SUMMARY_PER_BLOCK);
+    if (!summary) {
+        return -1;
+    }
+    summary[i % SUMMARY_PER_BLOCK]++;
+    return 0;
+}
+
+// Clearing bit i of the bitmap starting at block start; -1 if it was already clear
+int bitmap_release(rm_t *rm, uint64_t start, uint64_t i) {
+    uint8_t *block = meta_block(rm, start + i / BITS_PER_BLOCK);
+    if (!block) {
+        return -1;
+    }
+    uint64_t bit = i % BITS_PER_BLOCK;
+    if (!(block[bit / 8] >> (bit % 8) & 1)) {
+        fprintf(stderr, "Error: Bit %lu of the bitmap at block %lu is already clear\n", i, start);
+        return -1;
+    }
+    block[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+    return 0;
+}
+
+// Dropping one reference to a data block; the block is freed with its last one
+int drop_block(rm_t *rm, uint64_t block_no) {
+    superblock_t *sb = rm->sb;
+    if (block_no < sb->data_region_start || block_no - sb->data_region_start >= sb->data_region_blocks) {
+        fprintf(stderr, "Error: Block %lu is outside the data region\n", block_no);
+        return -1;
+    }
+    uint64_t i = block_no - sb->data_region_start;
+
+    // A shared block only loses a reference
+    if (sb->refcount_blocks) {
+        uint64_t rblock = sb->refcount_start + i / REFCOUNTS_PER_BLOCK;
+        if (((const uint16_t *)view_block(rm, rblock))[i % REFCOUNTS_PER_BLOCK]) {
+            uint16_t *refs = (uint16_t *)meta_block(rm, rblock);
+            if (!refs) {
+                return -1;
+            }
+            refs[i % REFCOUNTS_PER_BLOCK]--;
+            rm->released_refs++;
+            return 0;
+        }
+    }
+
+    if (bitmap_release(rm, sb->data_bitmap_start, i) < 0 ||
+        summary_release(rm, sb->inode_bitmap_blocks + i / BITS_PER_BLOCK) < 0) {
+        return -1;
+    }
+    sb->free_blocks++;
+    rm->freed_blocks++;
+
+    if (rm->freed_count && rm->freed[rm->freed_count - 1].start + rm->freed[rm->freed_count - 1].length == block_no &&
+        rm->freed[rm->freed_count - 1].length < UINT32_MAX) {
+        rm->freed[rm->freed_count - 1].length++;
+        return 0;
+    }
+    if (rm->freed_count == rm->freed_capacity) {
+        uint64_t cap = rm->freed_capacity ? rm->freed_capacity * 2 : 64;
+        extent_t *freed = realloc(rm->freed, cap * sizeof(extent_t));
+        if (!freed) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        rm->freed = freed;
+        rm->freed_capacity = cap;
+    }
+    rm->freed[rm->freed_count++] = (extent_t){block_no, 1};
+    return 0;
+}
+
+// An inode's leaf extents, from the inode or its index blocks (caller frees)
+extent_t *inode_extents(const rm_t *rm, const inode_t *ino) {
+    extent_t *list = malloc((ino->extent_count ? ino->extent_count : 1) * sizeof(extent_t));
+    if (!list) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    if (ino->extent_count <= INODE_EXTENTS) {
+        memcpy(list, ino->extents, ino->extent_count * sizeof(extent_t));
+        return list;
+    }
+    uint32_t filled = 0;
+    for (uint32_t i = 0; i < INODE_EXTENTS && filled < ino->extent_count; i++) {
+        uint32_t n = ino->extents[i].length;
+        const uint8_t *block = view_block(rm, ino->extents[i].start);
+        if (n == 0 || n > EXTENTS_PER_BLOCK || n > ino->extent_count - filled || !block) {
+            break;
+        }
+        memcpy(&list[filled], block, n * sizeof(extent_t));
+        filled += n;
+    }
+    if (filled != ino->extent_count) {
+        fprintf(stderr, "Error: Extent index does not match extent count\n");
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Blocks of the extent index, 0 if the extents fit in the inode
+uint32_t index_block_count(uint32_t extent_count) {
+    return extent_count <= INODE_EXTENTS ? 0 : (extent_count + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+}
+
+// Finding name in a directory: the block and slot of its entry; 0 if absent, -1 on error
+int dir_find(rm_t *rm, uint32_t dir_ino, const char *name, uint64_t *block_no, int *slot) {
+    const inode_t *dir = rm_inode(rm, dir_ino, 0);
+    if ((dir->mode & 0170000) != 0040000 || !(dir->flags & INODE_FL_EXTENTS)) {
+        fprintf(stderr, "Error: Inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+    extent_t *extents = inode_extents(rm, dir);
+    if (!extents) {
+        return -1;
+    }
+    uint64_t nblocks = 0;
+    for (uint32_t i = 0; i < dir->extent_count; i++) {
+        nblocks += extents[i].length;
+    }
+    uint64_t *phys = malloc((nblocks ? nblocks : 1) * sizeof(uint64_t));
+    if (!phys) {
+        perror("Memory allocation failed");
+        free(extents);
+        return -1;
+    }
+    uint64_t l = 0;
+    for (uint32_t i = 0; i < dir->extent_count; i++) {
+        for (uint32_t j = 0; j < extents[i].length; j++) {
+            phys[l++] = extents[i].start + j;
+        }
+    }
+    free(extents);
+
+    // A hashed directory names the one leaf that can hold the entry
+    uint64_t first = 0, last = nblocks;
+    if (dir->flags & INODE_FL_HTREE) {
+        uint32_t h = dirent_name_hash(name);
+        dx_header_t *hdr = dx_header(view_block(rm, phys[0]), 0);
+        uint64_t leaf = dx_entries(hdr)[dx_search(hdr, h)].block;
+        if (hdr->levels == 1 && leaf < nblocks) {
+            dx_header_t *node = dx_header(view_block(rm, phys[leaf]), leaf);
+            leaf = dx_entries(node)[dx_search(node, h)].block;
+        }
+        if (hdr->magic != DX_MAGIC || leaf == 0 || leaf >= nblocks) {
+            fprintf(stderr, "Error: Directory inode %u has a corrupt index\n", dir_ino);
+            free(phys);
+            return -1;
+        }
+        first = leaf;
+        last = leaf + 1;
+    }
+
+    int found = 0;
+    for (uint64_t b = first; b < last && !found; b++) {
+        const dirent64_t *entries = (const dirent64_t *)view_block(rm, phys[b]);
+        for (int i = b == 0 ? 2 : 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no != 0 && strncmp(entries[i].name, name, sizeof(entries[i].name)) == 0) {
+                *block_no = phys[b];
+                *slot = i;
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(phys);
+    return found;
+}
+
+// Freeing every block a file maps, its extent index included, and the inode itself
+int release_inode(rm_t *rm, uint32_t inode_num) {
+    inode_t *ino = rm_inode(rm, inode_num, 1);
+    if (!ino) {
+        return -1;
+    }
+    if (!(ino->flags & INODE_FL_INLINE) && ino->extent_count) {
+        extent_t *extents = inode_extents(rm, ino);
+        if (!extents) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < ino->extent_count; i++) {
+            for (uint32_t j = 0; j < extents[i].length; j++) {
+                if (drop_block(rm, extents[i].start + j) < 0) {
+                    free(extents);
+                    return -1;
+                }
+            }
+        }
+        free(extents);
+        for (uint32_t i = 0; i < index_block_count(ino->extent_count); i++) {
+            if (drop_block(rm, ino->extents[i].start) < 0) {
+                return -1;
+            }
+        }
+    }
+    memset(ino, 0, sizeof(*ino));
+
+    if (bitmap_release(rm, rm->sb->inode_bitmap_start, inode_num - 1) < 0 ||
+        summary_release(rm, (inode_num - 1) / BITS_PER_BLOCK) < 0) {
+        return -1;
+    }
+    rm->sb->free_inodes++;
+    return 0;
+}
+
+// Shrinking a file to size bytes; the blocks past the new end are freed
+int truncate_inode(rm_t *rm, uint32_t inode_num, uint64_t size, time_t now) {
+    inode_t *ino = rm_inode(rm, inode_num, 1);
+    if (!ino) {
+        return -1;
+    }
+    if (size > ino->size_bytes) {
+        fprintf(stderr, "Error: --truncate only shrinks files (inode %u has %lu bytes)\n", inode_num, ino->size_bytes);
+        return -1;
+    }
+    if (ino->flags & INODE_FL_COMPRESSED) {
+        fprintf(stderr, "Error: Inode %u is compressed and cannot be truncated\n", inode_num);
+        return -1;
+    }
+
+    if (ino->flags & INODE_FL_INLINE) {
+        memset((uint8_t *)ino->extents + size, 0, ino->size_bytes - size);
+    } else if (ino->extent_count) {
+        extent_t *extents = inode_extents(rm, ino);
+        if (!extents) {
+            return -1;
+        }
+        uint64_t keep = (size + BS - 1) / BS, seen = 0;
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < ino->extent_count; i++) {
+            uint64_t kept = seen >= keep ? 0 : (keep - seen < extents[i].length ? keep - seen : extents[i].length);
+            for (uint64_t j = kept; j < extents[i].length; j++) {
+                if (drop_block(rm, extents[i].start + j) < 0) {
+                    free(extents);
+                    return -1;
+                }
+            }
+            seen += extents[i].length;
+            if (kept) {
+                extents[count].start = extents[i].start;
+                extents[count++].length = (uint32_t)kept;
+            }
+        }
+
+        // The shorter list goes back into the inode or the leading index blocks
+        uint32_t old_index = index_block_count(ino->extent_count);
+        uint32_t new_index = index_block_count(count);
+        for (uint32_t i = new_index; i < old_index; i++) {
+            if (drop_block(rm, ino->extents[i].start) < 0) {
+                free(extents);
+                return -1;
+            }
+            memset(&ino->extents[i], 0, sizeof(extent_t));
+        }
+        if (new_index == 0) {
+            memset(ino->extents, 0, sizeof(ino->extents));
+            memcpy(ino->extents, extents, count * sizeof(extent_t));
+        }
+        for (uint32_t i = 0, filled = 0; i < new_index; i++) {
+            uint32_t n = count - filled < EXTENTS_PER_BLOCK ? count - filled : (uint32_t)EXTENTS_PER_BLOCK;
+            uint8_t *block = meta_block(rm, ino->extents[i].start);
+            if (!block) {
+                free(extents);
+                return -1;
+            }
+            memset(block, 0, BS);
+            memcpy(block, &extents[filled], n * sizeof(extent_t));
+            ino->extents[i].length = n;
+            filled += n;
+        }
+        ino->extent_count = count;
+        free(extents);
+    }
+    ino->size_bytes = size;
+    ino->mtime = now;
+    ino->ctime = now;
+    inode_crc_finalize(ino);
+    return 0;
+}
+
+// Unlinking (or truncating) the regular file at path
+int rm_path(rm_t *rm, const char *path, int64_t truncate_size, time_t now) {
+    char *buf = strdup(path);
+    if (!buf) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    // Walking the directories; the last component is the file
+    uint32_t parent = ROOT_INO, inode_num = 0;
+    uint64_t block_no = 0;
+    int slot = 0, ret = -1;
+    char *save = NULL;
+    for (char *name = strtok_r(buf, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+        if (inode_num) {
+            parent = inode_num;
+        }
+        int found = dir_find(rm, parent, name, &block_no, &slot);
+        if (found < 0) {
+            goto out;
+        }
+        if (!found) {
+            fprintf(stderr, "Error: '%s' not found in the image\n", path);
+            goto out;
+        }
+        inode_num = ((const dirent64_t *)view_block(rm, block_no))[slot].inode_no;
+        if (inode_num > rm->sb->inode_count || !vsfs_inode_initialized(rm->img, inode_num)) {
+            fprintf(stderr, "Error: Entry '%s' names invalid inode %u\n", name, inode_num);
+            goto out;
+        }
+    }
+    if (!inode_num) {
+        fprintf(stderr, "Error: '%s' names the root directory\n", path);
+        goto out;
+    }
+    if ((rm_inode(rm, inode_num, 0)->mode & 0170000) != 0100000) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+        goto out;
+    }
+
+    if (truncate_size >= 0) {
+        ret = truncate_inode(rm, inode_num, (uint64_t)truncate_size, now);
+        goto out;
+    }
+
+    // The parent loses the entry and the link it counted
+    dirent64_t *entries = (dirent64_t *)meta_block(rm, block_no);
+    inode_t *dir = entries ? rm_inode(rm, parent, 1) : NULL;
+    if (!dir) {
+        goto out;
+    }
+    memset(&entries[slot], 0, sizeof(dirent64_t));
+    dir->links--;
+    dir->size_bytes -= sizeof(dirent64_t);
+    dir->mtime = now;
+    inode_crc_finalize(dir);
+    ret = release_inode(rm, inode_num);
+
+out:
+    free(buf);
+    return ret;
+}
+
+// Committing the changed metadata with the superblock last as one journal
+// transaction, so a crash leaves either the old or the new image; a removal
+// the journal cannot hold is refused
+int rm_commit(rm_t *rm, time_t now) {
+    superblock_t *sb = rm->sb;
+    uint8_t *summary = malloc(sb->summary_blocks * BS);
+    if (!summary) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    for (uint64_t i = 0; i < sb->summary_blocks; i++) {
+        memcpy(summary + i * BS, view_block(rm, sb->summary_start + i), BS);
+    }
+    sb->summary_crc = crc32_fast(summary, sb->summary_blocks * BS);
+    free(summary);
+    sb->mtime_epoch = now;
+    superblock_crc_finalize(sb);
+
+    // Block 0 was copied first
+    uint64_t last = rm->count - 1;
+    uint8_t *sb_block = rm->blocks[0];
+    memmove(rm->targets, rm->targets + 1, last * sizeof(uint64_t));
+    memmove(rm->blocks, rm->blocks + 1, last * sizeof(uint8_t *));
+    rm->targets[last] = 0;
+    rm->blocks[last] = sb_block;
+
+    return vsfs_commit_blocks(rm->img, rm->count, rm->targets, rm->blocks);
+}
+
+// Giving the freed blocks' space back to the host filesystem; they are
+// already free in the image, so a failure here only costs space
+uint64_t punch_freed(const rm_t *rm) {
+    uint64_t punched = 0;
+    for (uint64_t i = 0; i < rm->freed_count; i++) {
+        if (fallocate(rm->img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      rm->freed[i].start * BS, (uint64_t)rm->freed[i].length * BS) != 0) {
+            fprintf(stderr, "Warning: Could not punch freed blocks out of the image: %s\n", strerror(errno));
+            break;
+        }
+        punched += rm->freed[i].length;
+    }
+    return punched;
+}
+
+// Carrying the dedup index over to the new superblock: the blocks it names
+// are unchanged, and the adder drops any that are no longer allocated
+void restamp_dedup_index(const char *image_name, uint32_t old_checksum, uint32_t new_checksum) {
+    char *path = malloc(strlen(image_name) + sizeof(".dedup"));
+    if (!path) {
+        return;
+    }
+    sprintf(path, "%s.dedup", image_name);
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd < 0) {
+        return;
+    }
+    dedup_file_header_t hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == DEDUP_MAGIC && hdr.sb_checksum == old_checksum) {
+        hdr.sb_checksum = new_checksum;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            fprintf(stderr, "Warning: Could not update the dedup index; the next batch starts a new one\n");
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+    crc32_fast_init();
+
+    cli_args_t args;
+    if (parse_args(argc, argv, &args) < 0) {
+        free(args.file_names);
+        return 1;
+    }
+
+    vsfs_image_t img = {0};
+    rm_t rm;
+    memset(&rm, 0, sizeof(rm));
+    int ret = 1;
+    if (vsfs_open(&img, args.image_name, 1) < 0) {
+        free(args.file_names);
+        return 1;
+    }
+    // An interrupted batch is finished before anything is looked up
+    if (vsfs_check(&img) < 0 || vsfs_journal_recover(&img) < 0) {
+        goto out;
+    }
+    rm.img = &img;
+    rm.sb = (superblock_t *)meta_block(&rm, 0);
+    if (!rm.sb) {
+        goto out;
+    }
+
+    uint32_t old_checksum = rm.sb->checksum;
+    time_t now = time(NULL);
+    for (uint32_t i = 0; i < args.file_count; i++) {
+        if (rm_path(&rm, args.file_names[i], args.truncate_size, now) < 0) {
+            goto out;
+        }
+    }
+    if (rm_commit(&rm, now) < 0) {
+        goto out;
+    }
+    uint64_t punched = punch_freed(&rm);
+    if (rm.sb->refcount_blocks) {
+        restamp_dedup_index(args.image_name, old_checksum, rm.sb->checksum);
+    }
+
+    for (uint32_t i = 0; i < args.file_count; i++) {
+        if (args.truncate_size >= 0) {
+            printf("File '%s' truncated to %ld bytes\n", args.file_names[i], args.truncate_size);
+        } else {
+            printf("File '%s' removed from MiniVSFS image\n", args.file_names[i]);
+        }
+    }
+    printf("Freed %lu data blocks (%lu punched out of the image file), %lu shared references dropped\n",
+           rm.freed_blocks, punched, rm.released_refs);
+    ret = 0;
+
+out:
+    rm_free(&rm);
+    if (vsfs_close(&img) != 0) {
+        ret = 1;
+    }
+    free(args.file_names);
+    return ret;
+}
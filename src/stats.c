@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+static uint64_t syscalls[VSFS_SYS_CLASSES];
+static uint64_t bytes_read, bytes_written;
+
+static const char *const class_names[VSFS_SYS_CLASSES] = {"read", "write", "copy", "sync", "other"};
+
+void vsfs_stats_syscall(int cls) {
+    __atomic_fetch_add(&syscalls[cls], 1, __ATOMIC_RELAXED);
+}
+
+void vsfs_stats_bytes(uint64_t read, uint64_t written) {
+    if (read) {
+        __atomic_fetch_add(&bytes_read, read, __ATOMIC_RELAXED);
+    }
+    if (written) {
+        __atomic_fetch_add(&bytes_written, written, __ATOMIC_RELAXED);
+    }
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void vsfs_stats_start(vsfs_stats_t *st) {
+    st->nphases = 0;
+    st->nvalues = 0;
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+    st->mark = st->start;
+}
+
+void vsfs_stats_phase(vsfs_stats_t *st, const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (st->nphases < STATS_MAX) {
+        st->phase[st->nphases] = name;
+        st->seconds[st->nphases++] = elapsed(&st->mark, &now);
+    }
+    st->mark = now;
+}
+
+void vsfs_stats_value(vsfs_stats_t *st, const char *name, uint64_t value) {
+    if (st->nvalues < STATS_MAX) {
+        st->value_name[st->nvalues] = name;
+        st->value[st->nvalues++] = value;
+    }
+}
+
+void vsfs_stats_print(const vsfs_stats_t *st, FILE *out, const char *tool, int json) {
+    double total = elapsed(&st->start, &st->mark);
+    uint64_t calls[VSFS_SYS_CLASSES], all_calls = 0;
+    for (int c = 0; c < VSFS_SYS_CLASSES; c++) {
+        calls[c] = __atomic_load_n(&syscalls[c], __ATOMIC_RELAXED);
+        all_calls += calls[c];
+    }
+    uint64_t rd = __atomic_load_n(&bytes_read, __ATOMIC_RELAXED);
+    uint64_t wr = __atomic_load_n(&bytes_written, __ATOMIC_RELAXED);
+
+    if (json) {
+        fprintf(out, "{\"tool\": \"%s\", \"seconds\": %.6f, \"phases\": {", tool, total);
+        for (int i = 0; i < st->nphases; i++) {
+            fprintf(out, "%s\"%s\": %.6f", i ? ", " : "", st->phase[i], st->seconds[i]);
+        }
+        fprintf(out, "}, \"bytes_read\": %lu, \"bytes_written\": %lu, \"syscalls\": {\"total\": %lu", rd, wr, all_calls);
+        for (int c = 0; c < VSFS_SYS_CLASSES; c++) {
+            fprintf(out, ", \"%s\": %lu", class_names[c], calls[c]);
+        }
+        fprintf(out, "}");
+        for (int i = 0; i < st->nvalues; i++) {
+            fprintf(out, ", \"%s\": %lu", st->value_name[i], st->value[i]);
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+
+    fprintf(out, "Stats for %s:\n", tool);
+    for (int i = 0; i < st->nphases; i++) {
+        fprintf(out, "  %-16s %10.6f s\n", st->phase[i], st->seconds[i]);
+    }
+    fprintf(out, "  %-16s %10.6f s\n", "total", total);
+    fprintf(out, "  %-16s %lu\n", "bytes_read", rd);
+    fprintf(out, "  %-16s %lu\n", "bytes_written", wr);
+    fprintf(out, "  %-16s %lu (", "syscalls", all_calls);
+    for (int c = 0; c < VSFS_SYS_CLASSES; c++) {
+        fprintf(out, "%s%s %lu", c ? ", " : "", class_names[c], calls[c]);
+    }
+    fprintf(out, ")\n");
+    for (int i = 0; i < st->nvalues; i++) {
+        fprintf(out, "  %-16s %lu\n", st->value_name[i], st->value[i]);
+    }
+}
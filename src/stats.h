@@ -0,0 +1,52 @@
+// Run statistics for --stats: wall time per phase and the I/O behind it.
+// The I/O counters are process-wide; libminivsfs and the tools bump them
+// around each system call and each block stored through a mapping.
+#ifndef MINIVSFS_STATS_H
+#define MINIVSFS_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// System call classes
+enum {
+    VSFS_SYS_READ,               // read, pread
+    VSFS_SYS_WRITE,              // write, pwrite
+    VSFS_SYS_COPY,               // copy_file_range, FICLONE
+    VSFS_SYS_SYNC,               // fsync, msync
+    VSFS_SYS_OTHER,              // open, stat, mmap, munmap, ftruncate, fallocate, io_uring_enter
+    VSFS_SYS_CLASSES,
+};
+
+// Counting one system call; safe from any thread
+void vsfs_stats_syscall(int cls);
+
+// Counting bytes read (source files, the image) and written (the image, scratch files)
+void vsfs_stats_bytes(uint64_t read, uint64_t written);
+
+#define STATS_MAX 16
+
+typedef struct {
+    struct timespec start;
+    struct timespec mark;
+    int nphases;
+    const char *phase[STATS_MAX];
+    double seconds[STATS_MAX];
+    int nvalues;
+    const char *value_name[STATS_MAX];
+    uint64_t value[STATS_MAX];
+} vsfs_stats_t;
+
+// Starting the clock (CLOCK_MONOTONIC) for the first phase
+void vsfs_stats_start(vsfs_stats_t *st);
+
+// Ending the phase that began at the previous mark
+void vsfs_stats_phase(vsfs_stats_t *st, const char *name);
+
+// Recording a tool-specific counter, e.g. bits_scanned
+void vsfs_stats_value(vsfs_stats_t *st, const char *name, uint64_t value);
+
+// Printing phases, I/O counters and values, as text or as one line of JSON
+void vsfs_stats_print(const vsfs_stats_t *st, FILE *out, const char *tool, int json);
+
+#endif
@@ -5,14 +5,21 @@ set -euo pipefail
 ROOT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
 cd "$ROOT_DIR"
 
-BUILDER="./mkfs_builder"
-ADDER="./mkfs_adder"
+BUILDER="$ROOT_DIR/mkfs_builder"
+ADDER="$ROOT_DIR/mkfs_adder"
+FSCK="$ROOT_DIR/mkfs_fsck"
+APPLY="$ROOT_DIR/mkfs_apply"
+RM="$ROOT_DIR/mkfs_rm"
 
-if [[ ! -x "$BUILDER" || ! -x "$ADDER" ]]; then
+if [[ ! -x "$BUILDER" || ! -x "$ADDER" || ! -x "$FSCK" || ! -x "$APPLY" || ! -x "$RM" ]]; then
   echo "[tests] Binaries not found. Run: make build"
   exit 1
 fi
 
+# Work in a scratch directory so reruns start clean
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR"
 mkdir -p examples
 
 # 1) Create a fresh filesystem image
@@ -20,10 +27,17 @@ echo "[tests] Creating image..."
 $BUILDER --image mini.img --size-kib 512 --inodes 256
 [[ -f mini.img ]] || (echo "[tests] mini.img not created" && exit 1)
 
+# 1b) Sparse and preallocated creation must yield the same filesystem
+$BUILDER --image prealloc.img --size-kib 512 --inodes 256 --preallocate > /dev/null
+cmp -s -i 4096 mini.img prealloc.img || (echo "[tests] preallocated image differs" && exit 1)
+
 # 2) Add a small file
 echo "hello, mini-vsfs" > examples/hello.txt
 $ADDER --input mini.img --output mini2.img --file examples/hello.txt
 [[ -f mini2.img ]] || (echo "[tests] mini2.img not created" && exit 1)
+# hello.txt is small enough to live in its inode: only the root and examples/ blocks are used
+$FSCK --image mini2.img > inline.log
+grep -q "and 2 data blocks in use" inline.log || (echo "[tests] tiny file not stored inline" && exit 1)
 
 # 3) Basic sanity: output must be same size as input (filesystem rewrite)
 in_size=$(stat -c%s mini.img 2>/dev/null || wc -c < mini.img)
@@ -33,11 +47,446 @@ if [[ "$in_size" -ne "$out_size" ]]; then
   exit 1
 fi
 
-# 4) Try adding a larger file (still within 12 blocks)
+# 4) Try adding a larger file
 python3 - <<'PY'
 open('examples/40k.bin','wb').write(b'B'*(40*1024))
 PY
 $ADDER --input mini2.img --output mini3.img --file examples/40k.bin
 [[ -f mini3.img ]] || (echo "[tests] mini3.img not created" && exit 1)
 
+# 5) Batch mode: several --file arguments plus a manifest on stdin
+# Past the inline limit, so each file owns a data block
+for n in 1 2 3 4; do { echo "batch file $n"; seq 1 20; } > "examples/batch$n.txt"; done
+printf 'examples/batch3.txt\n\n# comment\nexamples/batch4.txt\n' |
+  $ADDER --input mini.img --output batch.img \
+    --file examples/batch1.txt --file examples/batch2.txt --manifest - > batch.log
+[[ $(grep -c "added successfully" batch.log) -eq 4 ]] || (echo "[tests] batch add incomplete" && exit 1)
+# inode 2 is the examples/ directory created on demand
+grep -q "Allocated inode: 6" batch.log || (echo "[tests] batch inode allocation wrong" && exit 1)
+
+# 6) A failing batch must not leave an output image behind
+if $ADDER --input mini.img --output bad.img --file examples/hello.txt --file examples/missing.txt 2>/dev/null; then
+  echo "[tests] batch with missing file should fail"
+  exit 1
+fi
+[[ ! -e bad.img ]] || (echo "[tests] partial output left behind" && exit 1)
+
+# 7) In-place mode rewrites only the input image
+cp mini.img inplace.img
+$ADDER --input inplace.img --in-place --file examples/hello.txt > /dev/null
+[[ $(stat -c%s inplace.img) -eq $in_size ]] || (echo "[tests] in-place changed image size" && exit 1)
+if cmp -s mini.img inplace.img; then
+  echo "[tests] in-place add did not modify the image"
+  exit 1
+fi
+if $ADDER --input inplace.img --in-place --output x.img --file examples/hello.txt 2>/dev/null; then
+  echo "[tests] --in-place with --output should be rejected"
+  exit 1
+fi
+
+# 8) Files beyond the old 12-block limit are mapped with extents
+head -c $((3 * 1024 * 1024 + 123)) /dev/urandom > examples/3m.bin
+$ADDER --input mini.img --output extents.img --file examples/3m.bin > /dev/null 2>&1 &&
+  (echo "[tests] 3 MiB file should not fit in a 512 KiB image" && exit 1)
+$BUILDER --image roomy.img --size-kib 8192 --inodes 256 > /dev/null
+$ADDER --input roomy.img --in-place --file examples/3m.bin | grep -q "in 1 extents" ||
+  (echo "[tests] 3 MiB file not stored as one extent" && exit 1)
+
+# 9) Large image with multi-block bitmaps (sparse, so cheap to create)
+$BUILDER --image large.img --size-kib $((1024 * 1024)) --inodes 100000 > /dev/null
+$ADDER --input large.img --in-place --file examples/40k.bin > /dev/null
+[[ $(stat -c%s large.img) -eq $((1024 * 1024 * 1024)) ]] || (echo "[tests] large image size wrong" && exit 1)
+
+# 10) More than 64 entries converts a directory to a hashed multi-block one
+mkdir -p examples/many
+for n in $(seq 1 200); do : > "examples/many/f$n"; done
+ls examples/many/* | $ADDER --input roomy.img --in-place --manifest - > /dev/null
+if $ADDER --input roomy.img --in-place --file examples/many/f150 2>/dev/null; then
+  echo "[tests] duplicate name in hashed directory should be rejected"
+  exit 1
+fi
+$ADDER --input roomy.img --in-place --file examples/hello.txt | grep -q "Allocated inode: 205" ||
+  (echo "[tests] add after directory growth allocated the wrong inode" && exit 1)
+
+# 11) Nested paths create each missing directory once and reuse existing ones
+mkdir -p examples/a/b/c/d
+echo deep > examples/a/b/c/d/deep.txt
+echo side > examples/a/b/side.txt
+$ADDER --input mini.img --output tree.img --file examples/a/b/c/d/deep.txt --file ./examples/a/b/side.txt > tree.log
+grep -q "Allocated inode: 7" tree.log || (echo "[tests] nested directories not created once each" && exit 1)
+echo file > examples/node
+$ADDER --input tree.img --in-place --file examples/node > /dev/null
+rm examples/node && mkdir examples/node && echo x > examples/node/x
+if $ADDER --input tree.img --in-place --file examples/node/x 2>/dev/null; then
+  echo "[tests] path through a regular file should be rejected"
+  exit 1
+fi
+
+# 10b) Best-fit fills the smallest hole that holds a file; first-fit splits it
+$BUILDER --image holes.img --size-kib 2048 --inodes 128 > /dev/null
+python3 - <<'PY'
+import struct
+b = bytearray(open('holes.img', 'rb').read())
+dbm = struct.unpack_from('<Q', b, 44)[0] * 4096
+# Data blocks 0-99 used except holes of 3, 10 and 5 blocks
+for i in range(100):
+    if not (10 <= i < 13 or 30 <= i < 40 or 60 <= i < 65):
+        b[dbm + i // 8] |= 1 << (i % 8)
+open('holes.img', 'wb').write(b)
+PY
+head -c 20000 /dev/urandom > examples/5blk.bin
+$ADDER --input holes.img --output best.img --file examples/5blk.bin > best.log
+$ADDER --input holes.img --output first.img --file examples/5blk.bin --alloc first-fit > first.log
+grep -q "in 1 extents" best.log || (echo "[tests] best-fit split a file that fits a hole" && exit 1)
+grep -q "in 2 extents" first.log || (echo "[tests] first-fit allocation changed" && exit 1)
+grep -q "Free space: .* in 3 runs" best.log || (echo "[tests] free-space stats wrong" && exit 1)
+
+# 10c) Dedup shares identical blocks within a batch and, via the index file, across runs
+$BUILDER --image dedup.img --size-kib 2048 --inodes 128 --dedup > /dev/null
+head -c 40000 /dev/urandom > examples/dup1.bin
+cp examples/dup1.bin examples/dup2.bin
+cp examples/dup1.bin examples/dup3.bin
+$ADDER --input dedup.img --in-place --dedup --file examples/dup1.bin --file examples/dup2.bin > dedup.log
+grep -q "Dedup: 10 of 20 data blocks shared" dedup.log || (echo "[tests] duplicate file not shared" && exit 1)
+[[ -f dedup.img.dedup ]] || (echo "[tests] dedup index not written" && exit 1)
+$ADDER --input dedup.img --output dedup2.img --dedup --file examples/dup3.bin > dedup2.log
+grep -q "Dedup: 10 of 10 data blocks shared" dedup2.log || (echo "[tests] dedup index not reused" && exit 1)
+if $ADDER --input mini.img --output nodedup.img --dedup --file examples/dup1.bin 2>/dev/null; then
+  echo "[tests] dedup without a reference-count table should fail"
+  exit 1
+fi
+
+# 10d) Compressible files are stored as LZ clusters and read back intact
+for n in $(seq 1 5000); do echo "12:00:$((n % 60)) INFO request id=$n status=200 bytes=$((n * 7 % 9000))"; done > examples/app.log
+head -c 100000 /dev/urandom > examples/rand.bin
+$ADDER --input roomy.img --output packed.img --compress --file examples/app.log --file examples/rand.bin > packed.log
+grep -q "Compression: 1 files" packed.log || (echo "[tests] log not compressed (or random data was)" && exit 1)
+python3 - <<'PY'
+import struct
+b = open('packed.img', 'rb').read()
+itable = struct.unpack_from('<Q', b, 60)[0] * 4096
+def lz(src):
+    out, i = bytearray(), 0
+    def length(n):
+        nonlocal i
+        while n >= 15:
+            i += 1
+            n += src[i - 1]
+            if src[i - 1] != 255:
+                break
+        return n
+    while i < len(src):
+        t = src[i]; i += 1
+        n = length(t >> 4); out += src[i:i + n]; i += n
+        if i == len(src):
+            break
+        off = src[i] | src[i + 1] << 8; i += 2
+        for _ in range(length(t & 15) + 4):
+            out.append(out[-off])
+    return bytes(out)
+found = 0
+for ino in range(1, struct.unpack_from('<Q', b, 20)[0] + 1):
+    off = itable + (ino - 1) * 128
+    size, flags = struct.unpack_from('<Q', b, off + 12)[0], struct.unpack_from('<I', b, off + 92)[0]
+    if flags & 8:
+        start, length = struct.unpack_from('<QI', b, off + 44)
+        stream = b[start * 4096:(start + length) * 4096]
+        magic, shift, clusters = struct.unpack_from('<IIQ', stream)
+        ends = struct.unpack_from('<%dQ' % clusters, stream, 16)
+        data, pos = b'', 16 + 8 * clusters
+        for c in range(clusters):
+            raw = min(1 << shift, size - (c << shift))
+            data += stream[pos:ends[c]] if ends[c] - pos == raw else lz(stream[pos:ends[c]])
+            pos = ends[c]
+        assert data == open('examples/app.log', 'rb').read(), 'compressed log differs'
+        found += 1
+assert found == 1, 'expected one compressed inode'
+PY
+
+# 10e) Every I/O backend writes the same file data (io_uring falls back to threads without kernel support)
+$BUILDER --image aio.img --size-kib 16384 --inodes 128 > /dev/null
+head -c 3145800 /dev/urandom > examples/big1.bin
+head -c 1048576 /dev/urandom > examples/big2.bin
+data_start=$(python3 -c "import struct; print(struct.unpack_from('<Q', open('aio.img', 'rb').read(), 76)[0] * 4096)")
+for io in sync threads uring; do
+  $ADDER --input aio.img --output aio-$io.img --io $io --file examples/big1.bin --file examples/big2.bin --file examples/hello.txt > aio-$io.log 2>&1
+  grep -q "File data I/O: " aio-$io.log || (echo "[tests] --io $io failed" && exit 1)
+done
+cmp -s -i $data_start aio-sync.img aio-threads.img || (echo "[tests] threaded copy differs" && exit 1)
+cmp -s -i $data_start aio-sync.img aio-uring.img || (echo "[tests] io_uring copy differs" && exit 1)
+
+# 10f) --stats=json ends the output with one JSON line whose free counts match the image
+$BUILDER --image stats.img --size-kib 2048 --inodes 128 --stats=json | tail -n 1 > stats-build.json
+$ADDER --input stats.img --in-place --file examples/big2.bin --file examples/hello.txt --stats=json | tail -n 1 > stats-add.json
+$ADDER --input stats.img --in-place --file examples/app.log --stats > stats-text.log
+grep -q "^Stats for mkfs_adder:" stats-text.log || (echo "[tests] text stats missing" && exit 1)
+python3 - <<'PY'
+import json, struct
+build, add = json.load(open('stats-build.json')), json.load(open('stats-add.json'))
+data_blocks = struct.unpack_from('<Q', open('stats.img', 'rb').read(), 84)[0]
+assert build['free_inodes'] == 127 and build['free_blocks'] == data_blocks - 1, build
+# examples/ and big2.bin take an inode and 1 + 256 blocks; hello.txt only an inode
+assert add['free_inodes'] == build['free_inodes'] - 3, add
+assert add['free_blocks'] == build['free_blocks'] - 257, add
+assert add['bytes_read'] >= 1048576 and add['syscalls']['sync'] >= 3, add
+assert set(add['phases']) == {'load', 'plan', 'data', 'metadata'}, add['phases']
+PY
+
+# 10g) --from-dir lays a host tree out in one pass; the adder can keep adding to it
+mkdir -p src-tree/a/b src-tree/many
+head -c 20000 /dev/urandom > src-tree/big.bin
+cp examples/hello.txt src-tree/a/b/
+: > src-tree/a/empty
+for i in $(seq 1 100); do echo "entry $i" > src-tree/many/f$i.txt; done
+ln -s big.bin src-tree/link
+$BUILDER --image fromdir.img --size-kib 2048 --inodes 256 --from-dir src-tree 2> fromdir.err > /dev/null
+grep -q "Skipping 'src-tree/link'" fromdir.err || (echo "[tests] symlink not skipped" && exit 1)
+python3 - <<'PY'
+import struct
+b = open('fromdir.img', 'rb').read()
+itable = struct.unpack_from('<Q', b, 60)[0] * 4096
+def inode(n):
+    return b[itable + (n - 1) * 128:itable + n * 128]
+# Breadth-first, names sorted: 1 /, 2 a, 3 big.bin, 4 many, 5 a/b, 6 a/empty
+big = inode(3)
+start, length = struct.unpack_from('<QI', big, 44)
+assert struct.unpack_from('<Q', big, 12)[0] == 20000 and length == 5, (start, length)
+assert b[start * 4096:start * 4096 + 20000] == open('src-tree/big.bin', 'rb').read()
+# many/ holds 102 entries: an index block and two leaves
+assert struct.unpack_from('<I', inode(4), 92)[0] == 3 and struct.unpack_from('<QI', inode(4), 44)[1] == 3
+assert struct.unpack_from('<H', inode(1), 2)[0] == 5 and struct.unpack_from('<Q', inode(6), 12)[0] == 0
+PY
+$ADDER --input fromdir.img --in-place --file examples/big2.bin > /dev/null
+
+# 10h) A delta carries only the changed blocks; applied to a copy of the base it adds the files
+$BUILDER --image delta-base.img --size-kib 16384 --inodes 128 > /dev/null
+cp delta-base.img delta.img
+$ADDER --input delta-base.img --delta batch.vsd --file examples/big1.bin --file examples/hello.txt > /dev/null
+# big1.bin is 769 blocks; the header, run table and a few metadata blocks come on top
+(( $(stat -c %s batch.vsd) < 800 * 4096 )) || (echo "[tests] delta larger than the change" && exit 1)
+$APPLY --image delta.img --delta batch.vsd > /dev/null
+$ADDER --input delta-base.img --output delta-full.img --file examples/big1.bin --file examples/hello.txt > /dev/null
+cmp -s -i $data_start delta-full.img delta.img || (echo "[tests] delta data differs from a full rewrite" && exit 1)
+if $APPLY --image delta.img --delta batch.vsd > delta-twice.log 2>&1; then
+  echo "[tests] delta applied to the wrong base"
+  exit 1
+fi
+grep -q "different base image" delta-twice.log || (echo "[tests] wrong base misreported" && exit 1)
+
+# 10i) An overlay holds only the blocks written through it; the base is never touched
+$BUILDER --image ovl-base.img --size-kib 16384 --inodes 128 > /dev/null
+$ADDER --input ovl-base.img --in-place --file examples/big2.bin > /dev/null
+cp ovl-base.img ovl-base.orig
+$BUILDER --image overlay.img --base ovl-base.img > /dev/null
+$ADDER --input overlay.img --in-place --file examples/big1.bin --file examples/hello.txt > /dev/null
+cmp -s ovl-base.img ovl-base.orig || (echo "[tests] overlay wrote to its base" && exit 1)
+(( $(du -k overlay.img | cut -f1) < 4096 )) || (echo "[tests] overlay materialised its base" && exit 1)
+$FSCK --image overlay.img > overlay-fsck.log
+grep -q "blocks local" overlay-fsck.log || (echo "[tests] overlay not recognised" && exit 1)
+python3 - <<'PY'
+import struct
+b = open('overlay.img', 'rb').read()
+# examples/ is inode 2 and big2.bin inode 3 in the base; big1.bin is inode 4, read from the overlay file itself
+ino = struct.unpack_from('<Q', b, 60)[0] * 4096 + 3 * 128
+start = struct.unpack_from('<Q', b, ino + 44)[0]
+assert b[start * 4096:start * 4096 + 3145800] == open('examples/big1.bin', 'rb').read()
+PY
+
+# 10j) The superblock's free counters refuse a batch that cannot fit before anything is planned
+$BUILDER --image full.img --size-kib 1024 --inodes 128 > /dev/null
+cp full.img full.orig
+mkdir -p examples/full
+for i in $(seq 1 128); do echo "$i" > examples/full/f$i; done
+ls examples/full/* > full.list
+if $ADDER --input full.img --in-place --manifest full.list > full.log 2>&1; then
+  echo "[tests] 128 files fit in 127 free inodes"
+  exit 1
+fi
+grep -q "Not enough free inodes (need 128, image has 127)" full.log || (echo "[tests] full inode table misreported" && exit 1)
+if $ADDER --input full.img --in-place --file examples/big1.bin > full.log 2>&1; then
+  echo "[tests] big1.bin fit in a 1 MiB image"
+  exit 1
+fi
+grep -q "Not enough free data blocks for 'examples/big1.bin'" full.log || (echo "[tests] full data region misreported" && exit 1)
+cmp -s full.img full.orig || (echo "[tests] refused batch changed the image" && exit 1)
+$ADDER --input full.img --in-place --file examples/40k.bin > /dev/null
+python3 - <<'PY'
+import struct
+b = open('full.img', 'rb').read()
+free_inodes, free_blocks, summary = struct.unpack_from('<QQQ', b, 144)
+data_blocks = struct.unpack_from('<Q', b, 84)[0]
+# examples/ and 40k.bin: two inodes, 1 + 10 blocks besides the root directory
+assert (free_inodes, free_blocks) == (125, data_blocks - 12), (free_inodes, free_blocks)
+assert struct.unpack_from('<II', b, summary * 4096) == (125, data_blocks - 12)
+PY
+
+# 10k) Inode table blocks past the high-water mark are never read; the adder zeroes them as it reaches them
+$BUILDER --image lazy.img --size-kib 2048 --inodes 256 > /dev/null
+python3 - <<'PY'
+import struct
+b = bytearray(open('lazy.img', 'rb').read())
+itable, iblocks = struct.unpack_from('<QQ', b, 60)
+assert struct.unpack_from('<Q', b, 180)[0] == 1
+# Garbage where no inode was ever written
+b[(itable + 1) * 4096:(itable + iblocks) * 4096] = b'\xff' * ((iblocks - 1) * 4096)
+open('lazy.img', 'wb').write(b)
+PY
+mkdir -p examples/lazy
+for i in $(seq 1 40); do echo "$i" > examples/lazy/f$i; done
+ls examples/lazy/* > lazy.list
+$ADDER --input lazy.img --in-place --manifest lazy.list > /dev/null
+python3 - <<'PY'
+import struct
+b = open('lazy.img', 'rb').read()
+itable, iblocks = struct.unpack_from('<QQ', b, 60)
+# The root, examples/, lazy/ and 40 files: 43 inodes, into the second table block
+assert struct.unpack_from('<Q', b, 180)[0] == 2
+assert b[itable * 4096 + 43 * 128:(itable + 2) * 4096] == bytes(4096 * 2 - 43 * 128)
+assert b[(itable + 2) * 4096:(itable + 3) * 4096] == b'\xff' * 4096
+PY
+
+# 10l) Removing a file frees its inode and blocks and punches them out of the image file; truncating keeps the head
+$BUILDER --image rm.img --size-kib 16384 --inodes 128 > /dev/null
+$ADDER --input rm.img --in-place --file examples/big1.bin --file examples/big2.bin --file examples/hello.txt > /dev/null
+rm_before=$(du -k rm.img | cut -f1)
+$RM --image rm.img --file examples/big1.bin > /dev/null
+(( $(du -k rm.img | cut -f1) <= rm_before - 3000 )) || (echo "[tests] removed blocks still take host space" && exit 1)
+$RM --image rm.img --file examples/big2.bin --truncate 5000 > /dev/null
+if $RM --image rm.img --file examples/big1.bin > rm.log 2>&1; then
+  echo "[tests] removed a file twice"
+  exit 1
+fi
+grep -q "not found" rm.log || (echo "[tests] missing file misreported" && exit 1)
+python3 - <<'PY'
+import struct
+b = open('rm.img', 'rb').read()
+itable = struct.unpack_from('<Q', b, 60)[0] * 4096
+def inode(n):
+    return b[itable + (n - 1) * 128:itable + n * 128]
+# 1 /, 2 examples/, 3 big1.bin (gone), 4 big2.bin, 5 hello.txt
+assert struct.unpack_from('<H', inode(2), 2)[0] == 4 and struct.unpack_from('<Q', inode(2), 12)[0] == 4 * 64
+assert inode(3) == bytes(128)
+big2 = inode(4)
+start, length = struct.unpack_from('<QI', big2, 44)
+assert struct.unpack_from('<Q', big2, 12)[0] == 5000 and length == 2, (start, length)
+assert b[start * 4096:start * 4096 + 5000] == open('examples/big2.bin', 'rb').read()[:5000]
+data_blocks = struct.unpack_from('<Q', b, 84)[0]
+# The root and examples/ blocks and big2.bin's two
+assert struct.unpack_from('<QQ', b, 144) == (124, data_blocks - 4)
+PY
+# The freed inode and blocks are reused
+$ADDER --input rm.img --in-place --file examples/big1.bin > rm-readd.log
+grep -q "Allocated inode: 3" rm-readd.log || (echo "[tests] freed inode not reused" && exit 1)
+
+# 12) Every image built above checks clean; injected damage is reported
+for img in mini.img mini3.img batch.img inplace.img extents.img roomy.img large.img tree.img dedup.img dedup2.img packed.img aio-uring.img stats.img fromdir.img delta.img overlay.img full.img lazy.img rm.img; do
+  [[ -f $img ]] || continue
+  $FSCK --image $img --threads 4 > /dev/null || (echo "[tests] fsck rejected $img" && exit 1)
+done
+python3 - <<'PY'
+import struct, zlib
+base = open('batch.img', 'rb').read()
+itable, root_dir = struct.unpack_from('<Q', base, 60)[0], struct.unpack_from('<Q', base, 76)[0]
+def damaged(name, fn):
+    b = bytearray(base); fn(b); open(name, 'wb').write(b)
+def move_extent(b):
+    # inode 4 now claims inode 3's first block; its checksum is kept valid
+    off = itable * 4096 + 3 * 128
+    b[off + 44:off + 52] = b[off - 128 + 44:off - 128 + 52]
+    b[off + 120:off + 128] = struct.pack('<Q', zlib.crc32(bytes(b[off:off + 120])))
+damaged('bad_sb.img', lambda b: b.__setitem__(100, b[100] ^ 1))
+damaged('bad_dirent.img', lambda b: b.__setitem__(root_dir * 4096 + 2 * 64 + 10, b[root_dir * 4096 + 2 * 64 + 10] ^ 1))
+damaged('bad_leak.img', lambda b: b.__setitem__(2 * 4096 + 3, b[2 * 4096 + 3] | 0x80))
+damaged('bad_double.img', move_extent)
+summary = struct.unpack_from('<Q', base, 160)[0]
+damaged('bad_summary.img', lambda b: b.__setitem__(summary * 4096 + 4, b[summary * 4096 + 4] ^ 1))
+PY
+for img in bad_sb bad_dirent bad_leak bad_double bad_summary; do
+  if $FSCK --image $img.img > $img.log 2>&1; then
+    echo "[tests] fsck missed damage in $img.img"
+    exit 1
+  fi
+done
+grep -q "superblock checksum" bad_sb.log || (echo "[tests] superblock damage misreported" && exit 1)
+grep -q "bad checksum" bad_dirent.log || (echo "[tests] dirent damage misreported" && exit 1)
+grep -q "not referenced" bad_leak.log || (echo "[tests] leaked block misreported" && exit 1)
+grep -q "allocated more than once" bad_double.log || (echo "[tests] double allocation misreported" && exit 1)
+grep -q "summary: data bitmap block 0" bad_summary.log || (echo "[tests] summary damage misreported" && exit 1)
+python3 - <<'PY'
+import struct
+b = bytearray(open('dedup2.img', 'rb').read())
+# One share too few on the first data block of dup1.bin
+refs, data = struct.unpack_from('<Q', b, 128)[0], struct.unpack_from('<Q', b, 76)[0]
+ino = struct.unpack_from('<Q', b, 60)[0] * 4096 + 2 * 128
+first = struct.unpack_from('<Q', b, ino + 44)[0] - data
+struct.pack_into('<H', b, refs * 4096 + 2 * first, struct.unpack_from('<H', b, refs * 4096 + 2 * first)[0] - 1)
+open('bad_refs.img', 'wb').write(b)
+PY
+if $FSCK --image bad_refs.img > bad_refs.log 2>&1; then
+  echo "[tests] fsck missed a wrong reference count"
+  exit 1
+fi
+grep -q "references recorded" bad_refs.log || (echo "[tests] reference count damage misreported" && exit 1)
+
+# 13) A batch interrupted after its journal commit is replayed, not lost:
+# crash.img gets the batch's file data and a committed, unreplayed log
+cp mini.img crash.img
+cp mini.img committed.img
+$ADDER --input committed.img --in-place --file examples/hello.txt > /dev/null
+python3 - <<'PY'
+import struct, zlib
+old = bytearray(open('crash.img', 'rb').read())
+new = open('committed.img', 'rb').read()
+data = struct.unpack_from('<Q', old, 76)[0]
+jstart, jblocks = struct.unpack_from('<QQ', old, 112)
+blk = lambda b, i: bytes(b[i * 4096:(i + 1) * 4096])
+changed = [i for i in range(len(old) // 4096)
+           if not jstart <= i < jstart + jblocks and blk(old, i) != blk(new, i)]
+meta = sorted((i for i in changed if i < data), key=lambda i: i == 0)   # superblock last
+for i in changed:
+    if i >= data:
+        old[i * 4096:(i + 1) * 4096] = blk(new, i)
+desc = -(-len(meta) // 512)
+log = struct.pack('<%dQ' % len(meta), *meta).ljust(desc * 4096, b'\0') + b''.join(blk(new, i) for i in meta)
+old[(jstart + 1) * 4096:(jstart + 1) * 4096 + len(log)] = log
+hdr = struct.pack('<IIQQI', 0x4A535356, 1, 1, len(meta), zlib.crc32(log))
+old[jstart * 4096:jstart * 4096 + 32] = hdr + struct.pack('<I', zlib.crc32(hdr))
+open('crash.img', 'wb').write(old)
+PY
+if $FSCK --image crash.img > crash.log 2>&1; then
+  echo "[tests] fsck missed the pending journal transaction"
+  exit 1
+fi
+grep -q "committed transaction" crash.log || (echo "[tests] pending journal misreported" && exit 1)
+$FSCK --image crash.img --replay > replay.log 2>&1 || (cat replay.log && exit 1)
+grep -q "Replayed journal" replay.log || (echo "[tests] journal not replayed" && exit 1)
+$FSCK --image crash.img > /dev/null || (echo "[tests] image inconsistent after replay" && exit 1)
+if $ADDER --input crash.img --in-place --file examples/hello.txt 2>/dev/null; then
+  echo "[tests] replayed file missing"
+  exit 1
+fi
+
+# A batch the journal cannot hold is refused, leaving the image as it was
+$BUILDER --image small_journal.img --size-kib 512 --inodes 128 --journal-blocks 3 > /dev/null
+if $ADDER --input small_journal.img --in-place --file examples/hello.txt > small_journal.log 2>&1; then
+  echo "[tests] batch larger than the journal was not refused"
+  exit 1
+fi
+grep -q "journal-blocks" small_journal.log || (echo "[tests] journal overflow misreported" && exit 1)
+$FSCK --image small_journal.img > /dev/null || (echo "[tests] refused batch damaged the image" && exit 1)
+$ADDER --input small_journal.img --delta small_journal.vsd --file examples/hello.txt > /dev/null
+if $APPLY --image small_journal.img --delta small_journal.vsd > small_journal.log 2>&1; then
+  echo "[tests] delta larger than the journal was not refused"
+  exit 1
+fi
+grep -q "journal-blocks" small_journal.log || (echo "[tests] delta journal overflow misreported" && exit 1)
+$FSCK --image small_journal.img > /dev/null || (echo "[tests] refused delta damaged the image" && exit 1)
+$ADDER --input small_journal.img --output small_journal2.img --file examples/hello.txt > /dev/null
+if $RM --image small_journal2.img --file examples/hello.txt > small_journal.log 2>&1; then
+  echo "[tests] removal larger than the journal was not refused"
+  exit 1
+fi
+grep -q "journal-blocks" small_journal.log || (echo "[tests] removal journal overflow misreported" && exit 1)
+$FSCK --image small_journal2.img > /dev/null || (echo "[tests] refused removal damaged the image" && exit 1)
+
 echo "[tests] OK ✅"